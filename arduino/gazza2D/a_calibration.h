@@ -54,7 +54,8 @@ void read_horizontal_accel(){
   x0 = 0;
   z1 = 0;
   for(int i=0; i<5; i++){
-    accel_readings(accel, false);
+    while(!accel_readings(accel, false)) {   // the LSM6DSV16X runs at 1 kHz
+    }
     x0 += accel[0];
     z1 += accel[2];
     delay(100);
@@ -75,7 +76,8 @@ void read_vertical_accel(){
   x1 = 0;
   z0 = 0;
   for(int i=0; i<5; i++){
-    accel_readings(accel, false);
+    while(!accel_readings(accel, false)) {
+    }
     x1 += accel[0];
     z0 += accel[2];
     delay(100);
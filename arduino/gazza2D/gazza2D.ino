@@ -23,6 +23,7 @@
 #include "m_calibration.h"
 #include "m_compensation.h"
 #include "a_calibration.h"
+#include "scheduler.h"
 #include "defines.h"
 
 unsigned long magLoopIntervalMs;
@@ -33,14 +34,10 @@ unsigned long magCompLoopIntervalMS = 100;
 unsigned long headingLoopIntervalMs;
 const unsigned long outputLoopIntervalMs = 100;  // sensors sent to Raspberry at 10 Hz - sounds enough
 const unsigned long devoutputLoopIntervalMs = 200;  // outputs mag and untiltacc raw data - temporary, can be removed after development tests
+const unsigned long commandLoopIntervalMs = 10;     // console, raspberry and joystick polled at 100 Hz
 
-unsigned long last_mag_time = millis();
-unsigned long last_untilt_time = millis();
-unsigned long last_accel_time = millis();
 unsigned long last_mag_cal_time = millis();
-unsigned long last_compensation_time = millis();
-unsigned long last_heading_time = millis();
-unsigned long last_print_time = millis();
+int compensation_task_id;
 
 bool m_calib_on = false;        // true if calibration data collection is in progress
 bool m_calib_complete = false;
@@ -67,6 +64,14 @@ float acc[3];
 float mag[3];
 float unt_acc[3];
 
+bool accel_task(unsigned long now);
+bool untilt_task(unsigned long now);
+bool mag_task(unsigned long now);
+bool compensation_task(unsigned long now);
+bool heading_task(unsigned long now);
+bool output_task(unsigned long now);
+bool command_task(unsigned long now);
+
 void setup() {
   // put your setup code here, to run once:
   Serial.begin(115200);   // Serial: Console
@@ -96,14 +101,23 @@ void setup() {
   Serial.print("MAG interval ms: ");Serial.println(magLoopIntervalMs);
   Serial.print("UNTILT interval ms: ");Serial.println(untiltLoopIntervalMs);
   Serial.print("ACC interval ms: ");Serial.println(accelLoopIntervalMs);
+
+  // tasks by priority, see scheduler.h
+  sched_add("ACC", accel_task, accelLoopIntervalMs * 1000, 0);
+  sched_add("UNTILT", untilt_task, untiltLoopIntervalMs * 1000, 1);
+  sched_add("MAG", mag_task, magLoopIntervalMs * 1000, 2);
+  sched_add("HEADING", heading_task, headingLoopIntervalMs * 1000, 3);
+  compensation_task_id = sched_add("COMPENSATION", compensation_task, magCompLoopIntervalMS * 1000, 4);
+  sched_add("OUTPUT", output_task, outputLoopIntervalMs * 1000, 5);
+  sched_add("COMMANDS", command_task, commandLoopIntervalMs * 1000, 6);
+  sched_begin();
 }
 
 void checkSerial();
 void checkSerial1();
 
 /**
- * main cycle.
- * actions to perform, with different intervals
+ * main cycle: the tasks are released by the scheduler timer at their own interval
  * 
  * - accelererometer readings - accelLoopIntervalMS
  * - untilt accelerometer readings - 500 Hz, 2ms
@@ -112,92 +126,107 @@ void checkSerial1();
  * - samples acquisition for magnetometer compensation (mag data and accel data)
  * - ALT-AZ computation
  * - ALT-AZ sendout to raspberry (and serial console)
+ * - commands from console, raspberry and joystick
  **/
 void loop() {
-    unsigned long timestamp = millis();
-    // ALTITUDE ACC
-    if ((timestamp - last_accel_time) >= accelLoopIntervalMs) {                       // time to read accelerometer
-        last_accel_time = timestamp;
-        accel_readings(acc, debug);
-        a_calibrate(acc);                                                             // call a_calibrate even if calibration is not done, won't harm
+    sched_run();
+}
+
+// ALTITUDE ACC
+bool accel_task(unsigned long now) {
+    if(!accel_readings(acc, debug)) {
+        return false;
     }
+    a_calibrate(acc);                                                             // call a_calibrate even if calibration is not done, won't harm
+    return true;
+}
 
-    // UNTILT ACC
-    if ((timestamp - last_untilt_time) >= untiltLoopIntervalMs) {                     // time to read untilt accelerometer
-        last_untilt_time = timestamp;
-//        Serial.println("LOOP Reading untilter");
-        get_untilt_raw(unt_acc, debug);
-//        Serial.print("LOOP untilter READ ");Serial.print(unt_acc[0]);Serial.print(" ");Serial.print(unt_acc[1]);Serial.print(" ");Serial.println(unt_acc[2]);
+// UNTILT ACC
+bool untilt_task(unsigned long now) {
+//    Serial.println("LOOP Reading untilter");
+    if(!get_untilt_raw(unt_acc, debug)) {
+        return true;        // no untilter, nothing to wait for
     }
+//    Serial.print("LOOP untilter READ ");Serial.print(unt_acc[0]);Serial.print(" ");Serial.print(unt_acc[1]);Serial.print(" ");Serial.println(unt_acc[2]);
+    return true;
+}
 
-    // MAGNETOMETER
-    if ((timestamp - last_mag_time) >= magLoopIntervalMs) {                           // time to read magnetometer
-        last_mag_time = timestamp;
-        mag_readings(mag, debug);
-        if (m_calib_on && (timestamp - last_mag_cal_time) >= magCalLoopIntervalMs) {        // time to read mag calibration sample
-            last_mag_cal_time = timestamp;
-    
-            float unt_acc[3];
-            get_untilt_raw(unt_acc, debug);
-    
-            int to_go = add_sample(mag, unt_acc, debug);
-            if(!to_go) {
-                m_calib_on = false;
-                m_calib_complete = true;
-                Serial.print("AZ_CORR ");Serial.println(AZ_CORR*RadToDeg);
-                Serial.println("M_CAL, points collected");
-                Serial1.println("M_CAL, points collected");  // tell Raspberry that magnetometer calibration is completed
-            } else {
-                Serial.print(millis());Serial.print(" \tM Calibration togo ");Serial.println(to_go);
-            }
-        }
-        m_calibrate(mag, unt_acc, debug);                    // can call m_calibrate even if calibration is not completed, won't harm
+// MAGNETOMETER
+bool mag_task(unsigned long now) {
+    unsigned long timestamp = millis();
+    if(!mag_readings(mag, debug)) {
+        return false;
     }
+    if (m_calib_on && (timestamp - last_mag_cal_time) >= magCalLoopIntervalMs) {        // time to read mag calibration sample
+        last_mag_cal_time = timestamp;
 
-    // MAGNETOMETER COMPENSATION
-    if (compensation_on && (timestamp - last_compensation_time) >= magCompLoopIntervalMS) {  // time to read mag compensation sample
-        last_compensation_time = timestamp;
-        int to_go = add_compensation_sample(compensation_reference, altitude, azimuth, debug);
+        float unt_acc[3];
+        get_untilt_raw(unt_acc, debug);
+
+        int to_go = add_sample(mag, unt_acc, debug);
         if(!to_go) {
-          compensation_on = false;
-          compensation_complete = true;
-          Serial.println("M_COMP, compensation map completed");
-          Serial1.println("M_COMP, compensation map completed");  // tell Raspberry that magnetometer compensation is completed
+            m_calib_on = false;
+            m_calib_complete = true;
+            Serial.print("AZ_CORR ");Serial.println(AZ_CORR*RadToDeg);
+            Serial.println("M_CAL, points collected");
+            Serial1.println("M_CAL, points collected");  // tell Raspberry that magnetometer calibration is completed
         } else {
-          Serial.print(millis());Serial.print(" \tM Compensation togo ");Serial.println(to_go);
+            Serial.print(millis());Serial.print(" \tM Calibration togo ");Serial.println(to_go);
         }
     }
+    m_calibrate(mag, unt_acc, debug);                    // can call m_calibrate even if calibration is not completed, won't harm
+    return true;
+}
 
-    // AZIMUTH
-    if ((timestamp - last_heading_time) >= headingLoopIntervalMs) {       // time to calculate ALT/AZ using most recent readings
-        last_heading_time = timestamp;
-//        altitude = elevation(acc[0], acc[2], debug);
-        altitude = elevation(acc, debug);
-//        azimuth = flatCompass(unt_acc, mag, debug);
-        azimuth = compass3D(unt_acc, mag, debug);
-        // azimuth_ALT = flatCompassALT(unt_acc, mag, debug);
+// MAGNETOMETER COMPENSATION
+bool compensation_task(unsigned long now) {
+    if (!compensation_on) {
+        return true;
+    }
+    int to_go = add_compensation_sample(compensation_reference, altitude, azimuth, debug);
+    if(!to_go) {
+      compensation_on = false;
+      compensation_complete = true;
+      Serial.println("M_COMP, compensation map completed");
+      Serial1.println("M_COMP, compensation map completed");  // tell Raspberry that magnetometer compensation is completed
+    } else {
+      Serial.print(millis());Serial.print(" \tM Compensation togo ");Serial.println(to_go);
     }
+    return true;
+}
+
+// AZIMUTH
+bool heading_task(unsigned long now) {       // calculates ALT/AZ using most recent readings
+//    altitude = elevation(acc[0], acc[2], debug);
+    altitude = elevation(acc, debug);
+//    azimuth = flatCompass(unt_acc, mag, debug);
+    azimuth = compass3D(unt_acc, mag, debug);
+    // azimuth_ALT = flatCompassALT(unt_acc, mag, debug);
+    return true;
+}
 
-    // OUTPUTS
-    if ((timestamp - last_print_time) >= outputLoopIntervalMs) {          // time to send to serial ALT/AZ
-        last_print_time = timestamp;
-        snprintf(output_str, MAX_LEN_OUT_BUF, "SENSORS, AZ, %+3.3f, ALT, %+3.3f,", azimuth, altitude);
-        if(!m_calib_on) {
-            if((uint8_t)(debug | ~DEBUG_UNTILT_ACC)==255) {
-                Serial.print("UNT ");Serial.print(unt_acc[0], 4);Serial.print(" ");Serial.print(unt_acc[1], 4);Serial.print(" ");Serial.print(unt_acc[2], 4);
-                Serial.print(" ");Serial.print(mag[0], 4);Serial.print(" ");Serial.print(mag[1], 4);Serial.print(" ");Serial.println(mag[2], 4);
-            }
-            if(!debug){  // don't print if debug is active (!= 0)
-                Serial.println(output_str);
-                // Serial.print("Alternative AZ ");Serial.println(azimuth_ALT);
-            }
+// OUTPUTS
+bool output_task(unsigned long now) {          // sends to serial ALT/AZ
+    snprintf(output_str, MAX_LEN_OUT_BUF, "SENSORS, AZ, %+3.3f, ALT, %+3.3f,", azimuth, altitude);
+    if(!m_calib_on) {
+        if((uint8_t)(debug | ~DEBUG_UNTILT_ACC)==255) {
+            Serial.print("UNT ");Serial.print(unt_acc[0], 4);Serial.print(" ");Serial.print(unt_acc[1], 4);Serial.print(" ");Serial.print(unt_acc[2], 4);
+            Serial.print(" ");Serial.print(mag[0], 4);Serial.print(" ");Serial.print(mag[1], 4);Serial.print(" ");Serial.println(mag[2], 4);
+        }
+        if(!debug){  // don't print if debug is active (!= 0)
+            Serial.println(output_str);
+            // Serial.print("Alternative AZ ");Serial.println(azimuth_ALT);
         }
-        Serial1.println(output_str); // send to Raspberry
     }
+    Serial1.println(output_str); // send to Raspberry
+    return true;
+}
 
+bool command_task(unsigned long now) {
     checkSerial();        // manual commands
     checkSerial1();       // commands from raspberry
     checkJoystick(debug);
+    return true;
 }
 
 
@@ -256,6 +285,8 @@ void processCommand(String command) {
     SendEllipse();    
   } else if(command=="show_m_cal") {
     printIrons();
+  } else if(command=="sched_stats") {
+    print_sched_stats();
   } else if(command.startsWith("debug")) {  // valid debugs: MAG_CAL, MAG_RAW, UNTILT, ALT_ACC, ALTAZ, JOYSTICK, ALL
     debug_on(command);
   } else if(command.startsWith("nodebug")) {
@@ -348,6 +379,7 @@ void start_mag_compensation(String msg) {
   magCompLoopIntervalMS = init_compensation(duration_in_seconds * 1000); // result in milliseconds for 1000 calibration readings
   Serial.print("Interval: ");
   Serial.println(magCompLoopIntervalMS);
+  sched_set_period(compensation_task_id, magCompLoopIntervalMS * 1000);
   compensation_reference = azimuth;
   Serial.print("Comp Reference: ");Serial.println(azimuth);
 }
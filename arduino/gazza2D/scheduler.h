@@ -0,0 +1,150 @@
+/******
+ * Cooperative scheduler with deadline accounting
+ *
+ * An IntervalTimer ticks every SCHED_TICK_MUS and releases the tasks whose period has elapsed: the ISR only
+ * sets flags, the tasks run in loop() through sched_run(), highest priority first, each one to completion.
+ * A task returning false is not done yet (e.g. its sample has not arrived): it stays released and the next
+ * released task is tried.
+ * A task still released when its next period starts has missed its deadline. The miss is counted and the
+ * skipped releases are not queued, so a late task does not run in bursts afterwards.
+ *
+ * Released under GPLv3 License - see LICENSE file for details.
+ ******/
+
+#ifndef SCHEDULER
+#define SCHEDULER
+
+#define SCHED_MAX_TASKS 8
+#define SCHED_TICK_MUS 250    // release granularity
+
+struct SchedTask {
+  const char* name;
+  bool (*run)(unsigned long now);      // false if the job is not completed, the task is then retried
+  volatile unsigned long period_mus;
+  uint8_t priority;                    // 0 is the highest
+  volatile unsigned long release_mus;  // start of the current period
+  volatile bool released;
+  volatile unsigned long misses;       // periods started with the previous job not completed
+  unsigned long runs;                  // completed jobs
+  unsigned long max_resp_mus;          // release to completion
+  unsigned long max_exec_mus;          // duration of the completing call
+};
+
+SchedTask sched_tasks[SCHED_MAX_TASKS];
+uint8_t sched_order[SCHED_MAX_TASKS];  // task ids by priority
+int sched_count = 0;
+IntervalTimer sched_timer;
+
+/*
+ * registers a task, released immediately. Returns its id, -1 if the table is full
+ */
+int sched_add(const char* name, bool (*run)(unsigned long now), unsigned long period_mus, uint8_t priority) {
+  if(sched_count == SCHED_MAX_TASKS) {
+    return -1;
+  }
+  int id = sched_count;
+  SchedTask* t = &sched_tasks[id];
+  t->name = name;
+  t->run = run;
+  t->period_mus = period_mus;
+  t->priority = priority;
+  t->release_mus = micros();
+  t->released = true;
+  t->misses = 0;
+  t->runs = 0;
+  t->max_resp_mus = 0;
+  t->max_exec_mus = 0;
+  int i = sched_count++;
+  while(i > 0 && sched_tasks[sched_order[i - 1]].priority > priority) {
+    sched_order[i] = sched_order[i - 1];
+    i--;
+  }
+  sched_order[i] = id;
+  return id;
+}
+
+void sched_set_period(int id, unsigned long period_mus) {
+  noInterrupts();
+  sched_tasks[id].period_mus = period_mus;
+  interrupts();
+}
+
+// IntervalTimer ISR
+void sched_tick() {
+  unsigned long now = micros();
+  for(int i = 0; i < sched_count; i++) {
+    SchedTask* t = &sched_tasks[i];
+    if(!t->period_mus) {          // no period: released at every tick
+      t->release_mus = now;
+      t->released = true;
+      continue;
+    }
+    unsigned long elapsed = now - t->release_mus;
+    if(elapsed < t->period_mus) {
+      continue;
+    }
+    unsigned long periods = elapsed / t->period_mus;
+    t->release_mus += periods * t->period_mus;
+    t->misses += t->released ? periods : periods - 1;
+    t->released = true;
+  }
+}
+
+void sched_begin() {
+  sched_timer.begin(sched_tick, SCHED_TICK_MUS);
+}
+
+/*
+ * runs the released tasks in priority order until one completes.
+ * Returns false if none did
+ */
+bool sched_run() {
+  for(int i = 0; i < sched_count; i++) {
+    SchedTask* t = &sched_tasks[sched_order[i]];
+    if(!t->released) {
+      continue;
+    }
+    noInterrupts();
+    unsigned long release = t->release_mus;
+    interrupts();
+    unsigned long start = micros();
+    if(!t->run(start)) {
+      continue;
+    }
+    unsigned long end = micros();
+    noInterrupts();
+    if(t->release_mus == release) {
+      t->released = false;
+    }   // otherwise a new period started while running: the miss is counted, the task stays released
+    interrupts();
+    t->runs++;
+    t->max_resp_mus = max(t->max_resp_mus, end - release);
+    t->max_exec_mus = max(t->max_exec_mus, end - start);
+    return true;
+  }
+  return false;
+}
+
+/*
+ * Prints per task period, completed jobs, deadline misses and the worst response and execution times since
+ * the previous report
+ */
+void print_sched_stats() {
+  for(int i = 0; i < sched_count; i++) {
+    SchedTask* t = &sched_tasks[sched_order[i]];
+    Serial.print("TASK, ");Serial.print(t->name);
+    Serial.print(", PERIOD, ");Serial.print(t->period_mus);
+    Serial.print(", RUNS, ");Serial.print(t->runs);
+    Serial.print(", MISSES, ");Serial.print(t->misses);
+    Serial.print(", MAX_RESP, ");Serial.print(t->max_resp_mus);
+    Serial.print(", MAX_EXEC, ");Serial.println(t->max_exec_mus);
+    noInterrupts();
+    t->misses = 0;
+    interrupts();
+    t->runs = 0;
+    t->max_resp_mus = 0;
+    t->max_exec_mus = 0;
+  }
+}
+
+#endif
@@ -160,11 +160,18 @@ void rotate(float raw[3], bool force=false) {
   }
 }
 
-void mag_readings(float mag_raw[3], uint8_t debug) {
+/*
+ * returns false if the magnetometer has no new sample, mag_raw is then left untouched
+ */
+bool mag_readings(float mag_raw[3], uint8_t debug) {
+  bool fresh = false;
   if(LIS3MDL_MAG){
-    mag_readings_LIS(mag_raw);
+    fresh = mag_readings_LIS(mag_raw);
   } else if(RM3100_MAG) {
-    mag_readings_RM3100(mag_raw);
+    fresh = mag_readings_RM3100(mag_raw);
+  }
+  if(!fresh) {
+    return false;
   }
   rotate(mag_raw);
   if(mag_smooth) {
@@ -178,11 +185,18 @@ void mag_readings(float mag_raw[3], uint8_t debug) {
   if((uint8_t)(debug | ~DEBUG_MAG_RAW)==255) {
       Serial.print("MAG ");Serial.print(mag_raw[0], 4);Serial.print(" ");Serial.print(mag_raw[1], 4);Serial.print(" ");Serial.println(mag_raw[2], 4);
   }
+  return true;
 }
 
-void accel_readings(float accel_raw[3], uint8_t debug, bool smooth=true) {
+/*
+ * returns false if there is no new sample, accel_raw is then left untouched
+ * the MMA8451 has no data ready check in its library, each call reads its latest sample
+ */
+bool accel_readings(float accel_raw[3], uint8_t debug, bool smooth=true) {
   if(LSM_ACCEL){
-    accel_readings_LSM(accel_raw);
+    if(!accel_readings_LSM(accel_raw)) {
+      return false;
+    }
   } else if(MMA_ACCEL) {
     accel_readings_MMA(accel_raw);
   }
@@ -196,6 +210,7 @@ void accel_readings(float accel_raw[3], uint8_t debug, bool smooth=true) {
   if((uint8_t)(debug | ~DEBUG_ALT_ACC)==255) {
     Serial.print("ACC ");Serial.print(accel_raw[0]);Serial.print(" ");Serial.print(accel_raw[1]);Serial.print(" ");Serial.println(accel_raw[2]);
   }
+  return true;
 }
 
 void zero_untilt() {
@@ -207,7 +222,11 @@ void zero_untilt() {
   Serial.println("Gyro/Accel offset calculated");
 }
 
-void get_untilt_raw(float raw[3], uint8_t debug, bool smooth=true) {
+/*
+ * returns false if there is no untilter, raw is then left untouched. MMA8451 and MPU6050 have no data ready
+ * check in their libraries, each call reads their latest sample
+ */
+bool get_untilt_raw(float raw[3], uint8_t debug, bool smooth=true) {
   if(untilter) {
     if(MMA_UNTILTER) {
       accel_readings_MMA(raw);
@@ -224,6 +243,7 @@ void get_untilt_raw(float raw[3], uint8_t debug, bool smooth=true) {
         Serial.print("UNT ");Serial.print(raw[0]);Serial.print(" ");Serial.print(raw[1]);Serial.print(" ");Serial.println(raw[2]);
     }
   }
+  return untilter;
 }
 
 void set_bmag(String msg) {
@@ -82,7 +82,11 @@ void mag_axes_LIS(float raw[3]) {
   raw[2] = down;  // -z;
 }
 
-void mag_readings_LIS(float mag_raw[3]) {
+// returns false, mag_raw untouched, if no new sample is available
+bool mag_readings_LIS(float mag_raw[3]) {
+   if(!magnet_LIS3MDL.magneticFieldAvailable()) {
+     return false;
+   }
    sensors_event_t mevent;
    magnet_LIS3MDL.getEvent(&mevent);
   //  mag_raw[0] = kf_mx.updateEstimate(mevent.magnetic.x);  // gauss
@@ -93,4 +97,5 @@ void mag_readings_LIS(float mag_raw[3]) {
    mag_raw[2] = mevent.magnetic.z;  // gauss
 
    mag_axes_LIS(mag_raw);
+   return true;
 }
@@ -68,16 +68,18 @@ void axes_LSM(float raw[3]) {
     raw[2] = down;        // signs are defined accordingly to NED reference frame
 }
 
-/* returns values in gravity */
-void accel_readings_LSM(float raw[3]) {
+/* returns values in gravity, false if no new sample is available (raw untouched) */
+bool accel_readings_LSM(float raw[3]) {
     sfe_lsm_data_t accelData;
-    while(!LSM6D.checkAccelStatus()){
+    if(!LSM6D.checkAccelStatus()){
+        return false;
     }
     LSM6D.getAccel(&accelData);
     raw[0] = accelData.xData / 1000;    // the lib returns values in milligravity
     raw[1] = accelData.yData / 1000;
     raw[2] = accelData.zData / 1000;
     axes_LSM(raw);
+    return true;
 }
 
 /* returns values in deg per second */
@@ -128,13 +128,16 @@ void mag_axes_RM3100(float raw[3]) {
 }
 
 // void mag_readings_RM3100(float mag_raw[3], bool smooth=true) {
-void mag_readings_RM3100(float mag_raw[3]) {
+// returns false, mag_raw untouched, if no new measurement is ready
+bool mag_readings_RM3100(float mag_raw[3]) {
   long x = 0;
   long y = 0;
   long z = 0;
   uint8_t x2,x1,x0,y2,y1,y0,z2,z1,z0;
-  //wait until data is ready using polling method
-  while((readReg(RM3100_STATUS_REG) & 0x80) != 0x80); //read internal status register
+  //check if data is ready using polling method
+  if((readReg(RM3100_STATUS_REG) & 0x80) != 0x80) { //read internal status register
+    return false;
+  }
 
   //read measurements
   Wire.beginTransmission(I2CAddress);
@@ -196,6 +199,7 @@ void mag_readings_RM3100(float mag_raw[3]) {
   //   mag_raw[2] = kf_r_mz.updateEstimate(mag_raw[2]);
   // }
   mag_axes_RM3100(mag_raw);
+  return true;
 }
 
 /*
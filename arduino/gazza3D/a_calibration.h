@@ -24,6 +24,7 @@
 
 //#define MAX_RANGE 9.81       // when m/s^2 readings -9.81..9.81
 #define MAX_RANGE 1            // when m/s^2 readings -9.81..9.81
+#define A_CAL_TIMEOUT_MS 500   // longest wait for an accelerometer reading
 
 float oX = 0;  // offset X
 float oZ = 0;  // offset Z
@@ -42,25 +43,44 @@ void calc_a_calibration(){
   gZ = MAX_RANGE / z1;
 }
 
+/*
+ * Waits for the next accelerometer reading (in FIFO mode the batch arrives with a later call).
+ * Returns false, and tells the console and the Raspberry, if none arrives in A_CAL_TIMEOUT_MS
+ */
+bool a_cal_reading(float accel[3], const char* position) {
+  unsigned long start = millis();
+  while(!accel_readings(accel, false)) {
+    if(millis() - start >= A_CAL_TIMEOUT_MS) {
+      Serial.print("A_CAL_FAILED, ");Serial.print(position);Serial.println(", no accelerometer reading");
+      pi_link.print("A_CAL_FAILED, ");pi_link.print(position);pi_link.println(", no accelerometer reading");
+      return false;
+    }
+  }
+  return true;
+}
+
 /*
  * Reads X / Z value when they should be 0g / 1g i.e. with scope in horizontal position
+ * On failure the previous calibration is kept
  */
 void read_horizontal_accel(){
   float accel[3];
   int iter = 5;
-  x0 = 0;
-  z1 = 0;
+  float x = 0;
+  float z = 0;
   for(int i=0; i<5; i++){
-    accel_readings(accel, false);
-    x0 += accel[0];
-    z1 += accel[2];
+    if(!a_cal_reading(accel, "horizontal")) {
+      return;
+    }
+    x += accel[0];
+    z += accel[2];
     delay(100);
   }
-  x0 /= iter;
-  z1 /= iter;
+  x0 = x / iter;
+  z1 = z / iter;
   calc_a_calibration();
   Serial.println("Acc cal horizontal reading acquired");
-  Serial1.println("Acc cal horizontal reading acquired");
+  pi_link.println("Acc cal horizontal reading acquired");
 }
 
 /*
@@ -69,19 +89,21 @@ void read_horizontal_accel(){
 void read_vertical_accel(){
   float accel[3];
   int iter = 5;
-  x1 = 0;
-  z0 = 0;
+  float x = 0;
+  float z = 0;
   for(int i=0; i<5; i++){
-    accel_readings(accel, false);
-    x1 += accel[0];
-    z0 += accel[2];
+    if(!a_cal_reading(accel, "vertical")) {
+      return;
+    }
+    x += accel[0];
+    z += accel[2];
     delay(100);
   }
-  x1 /= iter;
-  z0 /= iter;
+  x1 = x / iter;
+  z0 = z / iter;
   calc_a_calibration();
   Serial.println("Acc cal vertical reading acquired");
-  Serial1.println("Acc cal vertical reading acquired");
+  pi_link.println("Acc cal vertical reading acquired");
 }
 
 /*
@@ -107,7 +129,7 @@ void set_a_calibration(float ox, float gx, float oz, float gz){
  */
 void export_a_calibration(){
   Serial.print("A_CAL,OX,");Serial.print(oX);Serial.print(",GX,");Serial.print(gX);Serial.print(",OZ,");Serial.print(oZ);Serial.print(",GZ,");Serial.println(gZ);
-  Serial1.print("A_CAL, ");Serial1.print(oX);Serial1.print(", ");Serial1.print(gX);Serial1.print(", ");Serial1.print(oZ);Serial1.print(", ");Serial1.println(gZ);
+  pi_link.print("A_CAL, ");pi_link.print(oX);pi_link.print(", ");pi_link.print(gX);pi_link.print(", ");pi_link.print(oZ);pi_link.print(", ");pi_link.println(gZ);
 }
 
 void print_a_cal(){
@@ -0,0 +1,38 @@
+/******
+ * Kalman filter for an angle, radians in [0, 2PI)
+ *
+ * Same filter and same tuning as TimedKalmanFilter, but the innovation (measurement - estimate) is taken the
+ * short way round the circle, in (-PI, PI], and the estimate is wrapped back to [0, 2PI). A heading going from
+ * 359° to 1° is a 2° step for the filter, not a 358° sweep back through every intermediate azimuth.
+ *
+ * Released under GPLv3 License - see LICENSE file for details.
+ ******/
+
+#ifndef ANGLE_KALMAN
+#define ANGLE_KALMAN
+
+#include <math.h>
+#include "sensors/timed_kalman.h"
+
+class AngleKalmanFilter : public TimedKalmanFilter {
+  public:
+    AngleKalmanFilter(float mea_e, float est_e, float q, unsigned long nominal_mus = 10000) :
+      TimedKalmanFilter(mea_e, est_e, q, nominal_mus) {}
+
+    float updateEstimate(float mea, unsigned long t_mus) {
+      correct(wrap(mea - last_estimate), t_mus);
+      last_estimate = fmod(last_estimate + 2 * PI, 2 * PI);
+      return last_estimate;
+    }
+
+  private:
+    // (-PI, PI]
+    static float wrap(float a) {
+      a = fmod(a, 2 * PI);
+      if(a > PI) a -= 2 * PI;
+      if(a <= -PI) a += 2 * PI;
+      return a;
+    }
+};
+
+#endif
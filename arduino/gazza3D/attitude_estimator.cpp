@@ -0,0 +1,420 @@
+// Attitude estimator based on the fusion of 3-axis accelerometer, gyroscope and magnetometer data
+// File: attitude_estimator.cpp
+// Author: Philipp Allgeuer <pallgeuer@ais.uni-bonn.de>
+// Implementation of the interface declared in attitude_estimator.h
+
+// Includes
+#include "attitude_estimator.h"
+#include <cmath>
+
+//
+// Constants
+//
+
+// Single precision has about 7 significant digits, the tolerances it can resolve are larger
+template<> const double AttitudeEstimatorT<double>::ACC_TOL_SQ       = 1e-12;
+template<> const double AttitudeEstimatorT<double>::QY_NORM_TOL_SQ   = 1e-10;
+template<> const double AttitudeEstimatorT<double>::QHAT_NORM_TOL_SQ = 1e-20;
+template<> const double AttitudeEstimatorT<double>::XGYG_NORM_TOL_SQ = 1e-12;
+template<> const double AttitudeEstimatorT<double>::WEZE_NORM_TOL_SQ = 1e-10;
+template<> const double AttitudeEstimatorT<double>::ZGHAT_ABS_TOL    = 1e-50;
+
+template<> const float AttitudeEstimatorT<float>::ACC_TOL_SQ       = 1e-10f;
+template<> const float AttitudeEstimatorT<float>::QY_NORM_TOL_SQ   = 1e-8f;
+template<> const float AttitudeEstimatorT<float>::QHAT_NORM_TOL_SQ = 1e-20f;
+template<> const float AttitudeEstimatorT<float>::XGYG_NORM_TOL_SQ = 1e-10f;
+template<> const float AttitudeEstimatorT<float>::WEZE_NORM_TOL_SQ = 1e-8f;
+template<> const float AttitudeEstimatorT<float>::ZGHAT_ABS_TOL    = 1e-30f;
+
+// Default configuration
+static const double DEFAULT_KP       = 2.20;
+static const double DEFAULT_TI       = 2.65;
+static const double DEFAULT_KP_QUICK = 10.0;
+static const double DEFAULT_TI_QUICK = 1.25;
+static const double DEFAULT_QL_TIME  = 3.00;
+
+//
+// Quaternion helpers, format (w,x,y,z)
+//
+
+// Product r = p*q (r must not alias p or q)
+template<typename Scalar>
+static void quatMult(const Scalar p[], const Scalar q[], Scalar r[])
+{
+	r[0] = p[0]*q[0] - p[1]*q[1] - p[2]*q[2] - p[3]*q[3];
+	r[1] = p[0]*q[1] + p[1]*q[0] + p[2]*q[3] - p[3]*q[2];
+	r[2] = p[0]*q[2] - p[1]*q[3] + p[2]*q[0] + p[3]*q[1];
+	r[3] = p[0]*q[3] + p[1]*q[2] - p[2]*q[1] + p[3]*q[0];
+}
+
+// Shortest arc rotation taking the unit vector a to the unit vector b, i.e. q*a*conj(q) = b (false if a = -b, q is then untouched)
+template<typename Scalar>
+static bool quatArc(const Scalar a[], const Scalar b[], Scalar q[])
+{
+	Scalar w = Scalar(1.0) + a[0]*b[0] + a[1]*b[1] + a[2]*b[2];
+	Scalar x = a[1]*b[2] - a[2]*b[1];
+	Scalar y = a[2]*b[0] - a[0]*b[2];
+	Scalar z = a[0]*b[1] - a[1]*b[0];
+	Scalar nsq = w*w + x*x + y*y + z*z;
+	if(nsq < AttitudeEstimatorT<Scalar>::QY_NORM_TOL_SQ) return false;
+	Scalar n = Scalar(1.0) / std::sqrt(nsq);
+	q[0] = w*n; q[1] = x*n; q[2] = y*n; q[3] = z*n;
+	return true;
+}
+
+// Coerces the argument of asin() to its domain, rounding errors may push it slightly out
+template<typename Scalar>
+static Scalar safeAsin(Scalar x)
+{
+	return std::asin(x >= Scalar(1.0) ? Scalar(1.0) : (x <= -Scalar(1.0) ? -Scalar(1.0) : x));
+}
+
+// Wraps an angle to (-pi,pi]
+template<typename Scalar>
+static Scalar wrapPI(Scalar a)
+{
+	if(a > Scalar(M_PI)) return a - Scalar(2.0)*Scalar(M_PI);
+	if(a <= -Scalar(M_PI)) return a + Scalar(2.0)*Scalar(M_PI);
+	return a;
+}
+
+//
+// Constructor and reset functions
+//
+
+template<typename Scalar>
+AttitudeEstimatorT<Scalar>::AttitudeEstimatorT(bool quickLearn)
+{
+	resetAll(quickLearn);
+}
+
+template<typename Scalar>
+void AttitudeEstimatorT<Scalar>::reset(bool quickLearn, bool resetGyroBias)
+{
+	setLambda(quickLearn ? Scalar(0.0) : Scalar(1.0));
+	resetState(resetGyroBias);
+}
+
+template<typename Scalar>
+void AttitudeEstimatorT<Scalar>::resetAll(bool quickLearn)
+{
+	m_accMethod = ME_DEFAULT;
+	m_Kp = Scalar(DEFAULT_KP);
+	m_Ti = Scalar(DEFAULT_TI);
+	m_KpQuick = Scalar(DEFAULT_KP_QUICK);
+	m_TiQuick = Scalar(DEFAULT_TI_QUICK);
+	m_QLTime = Scalar(DEFAULT_QL_TIME);
+	setMagCalib(Scalar(1.0), Scalar(0.0), Scalar(0.0));
+	reset(quickLearn, true);
+}
+
+template<typename Scalar>
+void AttitudeEstimatorT<Scalar>::resetState(bool resetGyroBias)
+{
+	m_Qy[0] = m_Qtilde[0] = m_Qhat[0] = Scalar(1.0);
+	for(int i = 1;i < 4;i++) m_Qy[i] = m_Qtilde[i] = m_Qhat[i] = Scalar(0.0);
+	for(int i = 0;i < 4;i++) m_dQ[i] = m_dQold[i] = Scalar(0.0);
+	for(int i = 0;i < 3;i++)
+	{
+		m_w[i] = m_wold[i] = m_omega[i] = m_base[i] = Scalar(0.0);
+		m_Ehat[i] = m_Fhat[i] = Scalar(0.0);
+		if(resetGyroBias) m_bhat[i] = Scalar(0.0);
+	}
+	for(int i = 0;i < 9;i++) m_Ry[i] = (i % 4 == 0 ? Scalar(1.0) : Scalar(0.0));
+	m_FhatHemi = true;
+	m_eulerValid = m_fusedValid = true;
+}
+
+//
+// Get/set functions
+//
+
+template<typename Scalar>
+void AttitudeEstimatorT<Scalar>::setAttitude(Scalar w, Scalar x, Scalar y, Scalar z)
+{
+	Scalar nsq = w*w + x*x + y*y + z*z;
+	if(nsq < QHAT_NORM_TOL_SQ)
+	{
+		m_Qhat[0] = Scalar(1.0);
+		m_Qhat[1] = m_Qhat[2] = m_Qhat[3] = Scalar(0.0);
+	}
+	else
+	{
+		Scalar n = Scalar(1.0) / std::sqrt(nsq);
+		m_Qhat[0] = w*n; m_Qhat[1] = x*n; m_Qhat[2] = y*n; m_Qhat[3] = z*n;
+	}
+	m_eulerValid = m_fusedValid = false;
+}
+
+template<typename Scalar>
+void AttitudeEstimatorT<Scalar>::setAttitudeEuler(Scalar yaw, Scalar pitch, Scalar roll)
+{
+	// q = qz(yaw) * qy(pitch) * qx(roll)
+	Scalar cy = std::cos(Scalar(0.5)*yaw),   sy = std::sin(Scalar(0.5)*yaw);
+	Scalar cp = std::cos(Scalar(0.5)*pitch), sp = std::sin(Scalar(0.5)*pitch);
+	Scalar cr = std::cos(Scalar(0.5)*roll),  sr = std::sin(Scalar(0.5)*roll);
+	setAttitude(cy*cp*cr + sy*sp*sr, cy*cp*sr - sy*sp*cr, cy*sp*cr + sy*cp*sr, sy*cp*cr - cy*sp*sr);
+}
+
+template<typename Scalar>
+void AttitudeEstimatorT<Scalar>::setAttitudeFused(Scalar yaw, Scalar pitch, Scalar roll, bool hemi)
+{
+	// The fused pitch and roll give the global z-axis in body coordinates, zGhat = (-sin(pitch), sin(roll), +-cos(tilt))
+	Scalar sth = std::sin(pitch), sph = std::sin(roll);
+	Scalar crit = sth*sth + sph*sph;
+	if(crit > Scalar(1.0))
+	{
+		Scalar n = Scalar(1.0) / std::sqrt(crit);
+		sth *= n;
+		sph *= n;
+		crit = Scalar(1.0);
+	}
+	Scalar zGhat[3] = {-sth, sph, (hemi ? Scalar(1.0) : -Scalar(1.0)) * std::sqrt(Scalar(1.0) - crit)};
+	Scalar zB[3] = {Scalar(0.0), Scalar(0.0), Scalar(1.0)};
+
+	// q = qz(yaw) * qtilt, the tilt rotation taking zGhat to the z-axis about a horizontal axis
+	Scalar qtilt[4] = {Scalar(0.0), Scalar(1.0), Scalar(0.0), Scalar(0.0)};
+	if(std::fabs(zGhat[2] + Scalar(1.0)) >= ZGHAT_ABS_TOL) quatArc(zGhat, zB, qtilt);
+	Scalar qyaw[4] = {std::cos(Scalar(0.5)*yaw), Scalar(0.0), Scalar(0.0), std::sin(Scalar(0.5)*yaw)};
+	Scalar q[4];
+	quatMult(qyaw, qtilt, q);
+	setAttitude(q[0], q[1], q[2], q[3]);
+}
+
+template<typename Scalar>
+void AttitudeEstimatorT<Scalar>::getPIGains(Scalar &Kp, Scalar &Ti, Scalar &KpQuick, Scalar &TiQuick)
+{
+	Kp = m_Kp;
+	Ti = m_Ti;
+	KpQuick = m_KpQuick;
+	TiQuick = m_TiQuick;
+}
+
+template<typename Scalar>
+void AttitudeEstimatorT<Scalar>::setPIGains(Scalar Kp, Scalar Ti, Scalar KpQuick, Scalar TiQuick)
+{
+	if(Kp > Scalar(0.0) && Ti > Scalar(0.0))
+	{
+		m_Kp = Kp;
+		m_Ti = Ti;
+	}
+	if(KpQuick > Scalar(0.0) && TiQuick > Scalar(0.0))
+	{
+		m_KpQuick = KpQuick;
+		m_TiQuick = TiQuick;
+	}
+}
+
+//
+// Update functions
+//
+
+template<typename Scalar>
+void AttitudeEstimatorT<Scalar>::update(Scalar dt, Scalar gyroX, Scalar gyroY, Scalar gyroZ, Scalar accX, Scalar accY, Scalar accZ, Scalar magX, Scalar magY, Scalar magZ)
+{
+	// PI gains for this step, faded from the quick learning ones while lambda rises to 1
+	Scalar Kp, Ti;
+	if(m_lambda >= Scalar(1.0))
+	{
+		Kp = m_Kp;
+		Ti = m_Ti;
+	}
+	else
+	{
+		Kp = m_lambda*m_Kp + (Scalar(1.0) - m_lambda)*m_KpQuick;
+		Ti = m_lambda*m_Ti + (Scalar(1.0) - m_lambda)*m_TiQuick;
+		setLambda(m_lambda + dt / m_QLTime);
+	}
+	Scalar Ki = Kp / Ti;
+
+	// The values of the previous step, for the trapezoidal integrations
+	for(int i = 0;i < 3;i++) m_wold[i] = m_w[i];
+	for(int i = 0;i < 4;i++) m_dQold[i] = m_dQ[i];
+
+	// The measured orientation
+	updateQy(accX, accY, accZ, magX, magY, magZ);
+
+	// Error quaternion Qtilde = conj(Qhat) * Qy, the rotation from the estimate to the measurement in body coordinates
+	Scalar Qhatconj[4] = {m_Qhat[0], -m_Qhat[1], -m_Qhat[2], -m_Qhat[3]};
+	quatMult(Qhatconj, m_Qy, m_Qtilde);
+
+	// Corrective angular velocity, towards Qy, about the error axis (sin(2a) weighting keeps the shortest way round)
+	Scalar wscale = Scalar(2.0)*Kp*m_Qtilde[0];
+	for(int i = 0;i < 3;i++) m_w[i] = wscale*m_Qtilde[i+1];
+
+	// Gyro bias, integral of -Ki*w
+	for(int i = 0;i < 3;i++) m_bhat[i] -= Scalar(0.5)*Ki*dt*(m_w[i] + m_wold[i]);
+
+	// Angular velocity estimate
+	m_omega[0] = gyroX - m_bhat[0] + m_w[0];
+	m_omega[1] = gyroY - m_bhat[1] + m_w[1];
+	m_omega[2] = gyroZ - m_bhat[2] + m_w[2];
+
+	// Attitude derivative dQ = 0.5 * Qhat * (0,omega), integrated with the trapezoidal rule
+	Scalar Qomega[4] = {Scalar(0.0), m_omega[0], m_omega[1], m_omega[2]};
+	quatMult(m_Qhat, Qomega, m_dQ);
+	for(int i = 0;i < 4;i++) m_dQ[i] *= Scalar(0.5);
+	for(int i = 0;i < 4;i++) m_Qhat[i] += Scalar(0.5)*dt*(m_dQ[i] + m_dQold[i]);
+
+	// Back to a unit quaternion, in the positive w hemisphere
+	Scalar nsq = m_Qhat[0]*m_Qhat[0] + m_Qhat[1]*m_Qhat[1] + m_Qhat[2]*m_Qhat[2] + m_Qhat[3]*m_Qhat[3];
+	if(nsq < QHAT_NORM_TOL_SQ)
+	{
+		reset(true, true);   // state of emergency
+		return;
+	}
+	Scalar n = (m_Qhat[0] >= Scalar(0.0) ? Scalar(1.0) : -Scalar(1.0)) / std::sqrt(nsq);
+	for(int i = 0;i < 4;i++) m_Qhat[i] *= n;
+
+	m_eulerValid = m_fusedValid = false;
+}
+
+template<typename Scalar>
+void AttitudeEstimatorT<Scalar>::updateQy(Scalar accX, Scalar accY, Scalar accZ, Scalar magX, Scalar magY, Scalar magZ)
+{
+	// A faulty acc measurement gives no information, the measured orientation is the current estimate
+	Scalar accNsq = accX*accX + accY*accY + accZ*accZ;
+	if(accNsq < ACC_TOL_SQ)
+	{
+		for(int i = 0;i < 4;i++) m_Qy[i] = m_Qhat[i];
+		return;
+	}
+
+	// The global z-axis (up, the inertial acceleration) in body coordinates
+	Scalar n = Scalar(1.0) / std::sqrt(accNsq);
+	Scalar zG[3] = {accX*n, accY*n, accZ*n};
+
+	// The global x and y-axes in body coordinates from the horizontal component of the magnetic field, turned by
+	// the heading the calibration vector has at the identity orientation
+	Scalar hN[3] = {zG[1]*magZ - zG[2]*magY, zG[2]*magX - zG[0]*magZ, zG[0]*magY - zG[1]*magX};   // zG x mag, horizontal, 90 degrees left of the field
+	Scalar hNsq = hN[0]*hN[0] + hN[1]*hN[1] + hN[2]*hN[2];
+	Scalar calNsq = m_magCalib[0]*m_magCalib[0] + m_magCalib[1]*m_magCalib[1];
+	if(hNsq >= XGYG_NORM_TOL_SQ && calNsq >= XGYG_NORM_TOL_SQ)
+	{
+		n = Scalar(1.0) / std::sqrt(hNsq);
+		Scalar hW[3] = {hN[0]*n, hN[1]*n, hN[2]*n};                                                    // horizontal field turned left
+		Scalar hF[3] = {hW[1]*zG[2] - hW[2]*zG[1], hW[2]*zG[0] - hW[0]*zG[2], hW[0]*zG[1] - hW[1]*zG[0]};   // horizontal field direction
+		n = Scalar(1.0) / std::sqrt(calNsq);
+		Scalar c = m_magCalib[0]*n, s = m_magCalib[1]*n;
+		for(int i = 0;i < 3;i++)
+		{
+			m_Ry[i]   = c*hF[i] - s*hW[i];   // xG
+			m_Ry[3+i] = s*hF[i] + c*hW[i];   // yG
+			m_Ry[6+i] = zG[i];
+		}
+
+		// Rotation matrix to quaternion, Ry being the body to global rotation
+		Scalar t = m_Ry[0] + m_Ry[4] + m_Ry[8];
+		if(t >= Scalar(0.0))
+		{
+			Scalar r = std::sqrt(Scalar(1.0) + t);
+			Scalar s2 = Scalar(0.5) / r;
+			m_Qy[0] = Scalar(0.5)*r;
+			m_Qy[1] = (m_Ry[7] - m_Ry[5])*s2;
+			m_Qy[2] = (m_Ry[2] - m_Ry[6])*s2;
+			m_Qy[3] = (m_Ry[3] - m_Ry[1])*s2;
+		}
+		else if(m_Ry[8] >= m_Ry[0] && m_Ry[8] >= m_Ry[4])
+		{
+			Scalar r = std::sqrt(Scalar(1.0) - m_Ry[0] - m_Ry[4] + m_Ry[8]);
+			Scalar s2 = Scalar(0.5) / r;
+			m_Qy[0] = (m_Ry[3] - m_Ry[1])*s2;
+			m_Qy[1] = (m_Ry[2] + m_Ry[6])*s2;
+			m_Qy[2] = (m_Ry[5] + m_Ry[7])*s2;
+			m_Qy[3] = Scalar(0.5)*r;
+		}
+		else if(m_Ry[4] >= m_Ry[0])
+		{
+			Scalar r = std::sqrt(Scalar(1.0) - m_Ry[0] + m_Ry[4] - m_Ry[8]);
+			Scalar s2 = Scalar(0.5) / r;
+			m_Qy[0] = (m_Ry[2] - m_Ry[6])*s2;
+			m_Qy[1] = (m_Ry[1] + m_Ry[3])*s2;
+			m_Qy[2] = Scalar(0.5)*r;
+			m_Qy[3] = (m_Ry[5] + m_Ry[7])*s2;
+		}
+		else
+		{
+			Scalar r = std::sqrt(Scalar(1.0) + m_Ry[0] - m_Ry[4] - m_Ry[8]);
+			Scalar s2 = Scalar(0.5) / r;
+			m_Qy[0] = (m_Ry[7] - m_Ry[5])*s2;
+			m_Qy[1] = Scalar(0.5)*r;
+			m_Qy[2] = (m_Ry[1] + m_Ry[3])*s2;
+			m_Qy[3] = (m_Ry[2] + m_Ry[6])*s2;
+		}
+	}
+	else
+	{
+		// Acc-only: the tilt is measured, the yaw is taken from the current estimate
+		Scalar zGhat[3] = {Scalar(2.0)*(m_Qhat[1]*m_Qhat[3] - m_Qhat[0]*m_Qhat[2]), Scalar(2.0)*(m_Qhat[2]*m_Qhat[3] + m_Qhat[0]*m_Qhat[1]), Scalar(1.0) - Scalar(2.0)*(m_Qhat[1]*m_Qhat[1] + m_Qhat[2]*m_Qhat[2])};
+		Scalar zB[3] = {Scalar(0.0), Scalar(0.0), Scalar(1.0)};
+		Scalar q[4] = {Scalar(0.0), Scalar(1.0), Scalar(0.0), Scalar(0.0)};
+		if(m_accMethod == ME_FUSED_YAW)
+		{
+			// Relative: Qy = Qhat * (shortest arc from the measured to the estimated up), no error about the z-axis
+			if(!quatArc(zG, zGhat, q))
+			{
+				for(int i = 0;i < 4;i++) m_Qy[i] = m_Qhat[i];
+				return;
+			}
+			quatMult(m_Qhat, q, m_Qy);
+		}
+		else
+		{
+			Scalar yaw = (m_accMethod == ME_ZYX_YAW ? eulerYaw() : fusedYaw());
+			Scalar qyaw[4] = {std::cos(Scalar(0.5)*yaw), Scalar(0.0), Scalar(0.0), std::sin(Scalar(0.5)*yaw)};
+			if(m_accMethod == ME_ZYX_YAW)
+			{
+				// Qy = qz(yaw) * qy(pitch) * qx(roll), with the pitch and roll of the measured up
+				Scalar pitch = safeAsin(-zG[0]);
+				Scalar roll = std::atan2(zG[1], zG[2]);
+				Scalar cp = std::cos(Scalar(0.5)*pitch), sp = std::sin(Scalar(0.5)*pitch);
+				Scalar cr = std::cos(Scalar(0.5)*roll),  sr = std::sin(Scalar(0.5)*roll);
+				q[0] = cp*cr; q[1] = cp*sr; q[2] = sp*cr; q[3] = -sp*sr;
+			}
+			else if(std::fabs(zG[2] + Scalar(1.0)) >= ZGHAT_ABS_TOL)
+				quatArc(zG, zB, q);   // tilt about a horizontal axis, the fused yaw is kept
+			quatMult(qyaw, q, m_Qy);
+		}
+	}
+
+	// Positive w hemisphere, like Qhat
+	Scalar nsq = m_Qy[0]*m_Qy[0] + m_Qy[1]*m_Qy[1] + m_Qy[2]*m_Qy[2] + m_Qy[3]*m_Qy[3];
+	if(nsq < QY_NORM_TOL_SQ)
+	{
+		for(int i = 0;i < 4;i++) m_Qy[i] = m_Qhat[i];
+		return;
+	}
+	n = (m_Qy[0] >= Scalar(0.0) ? Scalar(1.0) : -Scalar(1.0)) / std::sqrt(nsq);
+	for(int i = 0;i < 4;i++) m_Qy[i] *= n;
+}
+
+template<typename Scalar>
+void AttitudeEstimatorT<Scalar>::updateEuler()
+{
+	const Scalar *q = m_Qhat;
+	m_Ehat[0] = std::atan2(Scalar(2.0)*(q[0]*q[3] + q[1]*q[2]), Scalar(1.0) - Scalar(2.0)*(q[2]*q[2] + q[3]*q[3]));
+	m_Ehat[1] = safeAsin(Scalar(2.0)*(q[0]*q[2] - q[3]*q[1]));
+	m_Ehat[2] = std::atan2(Scalar(2.0)*(q[0]*q[1] + q[2]*q[3]), Scalar(1.0) - Scalar(2.0)*(q[1]*q[1] + q[2]*q[2]));
+	m_eulerValid = true;
+}
+
+template<typename Scalar>
+void AttitudeEstimatorT<Scalar>::updateFused()
+{
+	const Scalar *q = m_Qhat;
+	Scalar wzsq = q[0]*q[0] + q[3]*q[3];
+	m_Fhat[0] = (wzsq < WEZE_NORM_TOL_SQ ? Scalar(0.0) : wrapPI(Scalar(2.0)*std::atan2(q[3], q[0])));   // undefined when upside down
+	m_Fhat[1] = safeAsin(Scalar(2.0)*(q[0]*q[2] - q[1]*q[3]));
+	m_Fhat[2] = safeAsin(Scalar(2.0)*(q[0]*q[1] + q[2]*q[3]));
+	m_FhatHemi = (wzsq >= Scalar(0.5));
+	m_fusedValid = true;
+}
+
+//
+// Instantiations, the only ones: the template definitions are not in the header
+//
+
+template class AttitudeEstimatorT<double>;
+template class AttitudeEstimatorT<float>;
+
+// EOF
@@ -82,6 +82,10 @@
 	* maintaining its tracking performance (although, incidentally, this balance can be adjusted via the PI gains). In situations like this you
 	* would be right to invest time into signal conditioning and/or tracing the true source of the sensor noise.
 	*
+	* The class is a template on its scalar type: `AttitudeEstimator` (`double`) is the reference, also for runs on a host, while
+	* `AttitudeEstimatorF` (`float`) keeps every operation on a single precision FPU such as the Cortex-M7 one. Only these two types
+	* are instantiated, in attitude_estimator.cpp.
+	*
 	* All angles are expressed in radians (e.g. the return values of the `eulerYaw()`, `eulerPitch()` and `eulerRoll()` functions, etc...).
 	*
 	* The AttitudeEstimator class can be used as follows:
@@ -122,16 +126,17 @@
 	* }
 	* @endcode
 	**/
-	class AttitudeEstimator
+	template<typename Scalar>
+	class AttitudeEstimatorT
 	{
 	public:
 		// Constants (see attitude_estimator.cpp for the numeric values)
-		static const double ACC_TOL_SQ; //!< @brief If an acc measurement has norm-squared less than this, then it is considered to be faulty and the measurement is discarded.
-		static const double QY_NORM_TOL_SQ; //!< @brief If an acc-only generated quaternion `Qy` has norm-squared less than this, then the quaternion is considered to be zero and a fallback solution is used.
-		static const double QHAT_NORM_TOL_SQ; //!< @brief If a supposedly near-unit quaternion has norm-squared less than this during normalisation, then we declare a general state of emergency and completely reset the estimator.
-		static const double XGYG_NORM_TOL_SQ; //!< @brief If the norm-squared of the calculated `xG` and/or `yG` basis vectors (`= norm(m_magCalib)*norm(mag)*sin(angle(acc,mag))`) is less than this prior to basis normalisation, then the calculation is assumed to be faulty due to acc/mag collinearity, and the mag measurement is discarded. Note however that this constant is also used for various checks in the `updateQy()` special cases.
-		static const double WEZE_NORM_TOL_SQ; //!< @brief If the norm-squared of the `Qhat` vector with its `x` and `y` components zeroed out is less than this, then normalisation is avoided and a fallback method is used instead to generate a unit pure yaw quaternion in the fused yaw acc-only case.
-		static const double ZGHAT_ABS_TOL; //!< @brief If the absolute value of components of the `zGhat` vector are less than this, then they are considered to be zero (used deep inside the near-impossible special cases only).
+		static const Scalar ACC_TOL_SQ; //!< @brief If an acc measurement has norm-squared less than this, then it is considered to be faulty and the measurement is discarded.
+		static const Scalar QY_NORM_TOL_SQ; //!< @brief If an acc-only generated quaternion `Qy` has norm-squared less than this, then the quaternion is considered to be zero and a fallback solution is used.
+		static const Scalar QHAT_NORM_TOL_SQ; //!< @brief If a supposedly near-unit quaternion has norm-squared less than this during normalisation, then we declare a general state of emergency and completely reset the estimator.
+		static const Scalar XGYG_NORM_TOL_SQ; //!< @brief If the norm-squared of the calculated `xG` and/or `yG` basis vectors (`= norm(m_magCalib)*norm(mag)*sin(angle(acc,mag))`) is less than this prior to basis normalisation, then the calculation is assumed to be faulty due to acc/mag collinearity, and the mag measurement is discarded. Note however that this constant is also used for various checks in the `updateQy()` special cases.
+		static const Scalar WEZE_NORM_TOL_SQ; //!< @brief If the norm-squared of the `Qhat` vector with its `x` and `y` components zeroed out is less than this, then normalisation is avoided and a fallback method is used instead to generate a unit pure yaw quaternion in the fused yaw acc-only case.
+		static const Scalar ZGHAT_ABS_TOL; //!< @brief If the absolute value of components of the `zGhat` vector are less than this, then they are considered to be zero (used deep inside the near-impossible special cases only).
 
 		//! @brief Acc-only resolution method enumeration.
 		enum AccMethodEnum
@@ -144,7 +149,7 @@
 		};
 
 		// Constructor
-		explicit AttitudeEstimator(bool quickLearn = true); //!< @brief Default constructor.
+		explicit AttitudeEstimatorT(bool quickLearn = true); //!< @brief Default constructor.
 
 		// Reset functions
 		void reset(bool quickLearn = true, bool resetGyroBias = true); //!< @brief Resets the entire class, except for the magnetometer calibration, the acc-only resolution method, and the configuration variables (i.e. the PI gains and the quick learn time).
@@ -158,50 +163,50 @@
 		void setAccMethod(AccMethodEnum method) { m_accMethod = (method < ME_DEFAULT || method >= ME_COUNT ? ME_DEFAULT : method); } //!< @brief Sets the acc-only measurement resolution method to use.
 
 		// Get/set functions for the current attitude estimate
-		void getAttitude(double q[]) const { for(int i = 0;i < 4;i++) q[i] = m_Qhat[i]; } //!< @brief Returns the current attitude estimate in the quaternion form (w,x,y,z) (Note: `q[]` must have room for 4 elements).
-		void setAttitude(const double q[]) { setAttitude(q[0], q[1], q[2], q[3]); } //!< @brief Resets the current attitude estimate to a particular quaternion orientation (Note: `q[]` must have 4 elements, `q[]` is normalised, if `q[]` has zero norm then the attitude estimate is reset to the identity orientation).
-		void setAttitude(double w, double x, double y, double z); //!< @brief Resets the current attitude estimate to a particular quaternion orientation (Note: `q[]` is normalised, if `q[]` has zero norm then the attitude estimate is reset to the identity orientation).
-		void setAttitudeEuler(double yaw, double pitch, double roll); //!< @brief Resets the current attitude estimate to a particular set of ZYX Euler angles.
-		void setAttitudeFused(double yaw, double pitch, double roll, bool hemi); //!< @brief Resets the current attitude estimate to a particular set of fused angles.
+		void getAttitude(Scalar q[]) const { for(int i = 0;i < 4;i++) q[i] = m_Qhat[i]; } //!< @brief Returns the current attitude estimate in the quaternion form (w,x,y,z) (Note: `q[]` must have room for 4 elements).
+		void setAttitude(const Scalar q[]) { setAttitude(q[0], q[1], q[2], q[3]); } //!< @brief Resets the current attitude estimate to a particular quaternion orientation (Note: `q[]` must have 4 elements, `q[]` is normalised, if `q[]` has zero norm then the attitude estimate is reset to the identity orientation).
+		void setAttitude(Scalar w, Scalar x, Scalar y, Scalar z); //!< @brief Resets the current attitude estimate to a particular quaternion orientation (Note: `q[]` is normalised, if `q[]` has zero norm then the attitude estimate is reset to the identity orientation).
+		void setAttitudeEuler(Scalar yaw, Scalar pitch, Scalar roll); //!< @brief Resets the current attitude estimate to a particular set of ZYX Euler angles.
+		void setAttitudeFused(Scalar yaw, Scalar pitch, Scalar roll, bool hemi); //!< @brief Resets the current attitude estimate to a particular set of fused angles.
 
 		// Get functions for the current attitude estimate in alternative representations
-		double eulerYaw()   { if(!m_eulerValid) { updateEuler(); } return m_Ehat[0];  } //!< @brief Returns the ZYX Euler yaw of the current attitude estimate (1st of the three ZYX Euler angles).
-		double eulerPitch() { if(!m_eulerValid) { updateEuler(); } return m_Ehat[1];  } //!< @brief Returns the ZYX Euler pitch of the current attitude estimate (2nd of the three ZYX Euler angles).
-		double eulerRoll()  { if(!m_eulerValid) { updateEuler(); } return m_Ehat[2];  } //!< @brief Returns the ZYX Euler roll of the current attitude estimate (3rd of the three ZYX Euler angles).
-		double fusedYaw()   { if(!m_fusedValid) { updateFused(); } return m_Fhat[0];  } //!< @brief Returns the fused yaw of the current attitude estimate (1st of the fused angles).
-		double fusedPitch() { if(!m_fusedValid) { updateFused(); } return m_Fhat[1];  } //!< @brief Returns the fused pitch of the current attitude estimate (2nd of the fused angles).
-		double fusedRoll()  { if(!m_fusedValid) { updateFused(); } return m_Fhat[2];  } //!< @brief Returns the fused roll of the current attitude estimate (3rd of the fused angles).
+		Scalar eulerYaw()   { if(!m_eulerValid) { updateEuler(); } return m_Ehat[0];  } //!< @brief Returns the ZYX Euler yaw of the current attitude estimate (1st of the three ZYX Euler angles).
+		Scalar eulerPitch() { if(!m_eulerValid) { updateEuler(); } return m_Ehat[1];  } //!< @brief Returns the ZYX Euler pitch of the current attitude estimate (2nd of the three ZYX Euler angles).
+		Scalar eulerRoll()  { if(!m_eulerValid) { updateEuler(); } return m_Ehat[2];  } //!< @brief Returns the ZYX Euler roll of the current attitude estimate (3rd of the three ZYX Euler angles).
+		Scalar fusedYaw()   { if(!m_fusedValid) { updateFused(); } return m_Fhat[0];  } //!< @brief Returns the fused yaw of the current attitude estimate (1st of the fused angles).
+		Scalar fusedPitch() { if(!m_fusedValid) { updateFused(); } return m_Fhat[1];  } //!< @brief Returns the fused pitch of the current attitude estimate (2nd of the fused angles).
+		Scalar fusedRoll()  { if(!m_fusedValid) { updateFused(); } return m_Fhat[2];  } //!< @brief Returns the fused roll of the current attitude estimate (3rd of the fused angles).
 		bool   fusedHemi()  { if(!m_fusedValid) { updateFused(); } return m_FhatHemi; } //!< @brief Returns the hemisphere of the current attitude estimate (boolean 4th parameter of the fused angles representation, where `true` implies `1` and `false` implies `-1`).
 
 		// Get/set functions for the gyroscope bias
-		void getGyroBias(double b[]) const { for(int i = 0;i < 3;i++) b[i] = m_bhat[i]; } //!< @brief Returns the current estimated gyro bias (Note: `b[]` must have room for 3 elements).
-		void setGyroBias(const double b[]) { for(int i = 0;i < 3;i++) m_bhat[i] = b[i]; } //!< @brief Resets the current estimated gyro bias to a particular vector value (Note: `b[]` must have 3 elements).
-		void setGyroBias(double bx, double by, double bz) { m_bhat[0] = bx; m_bhat[1] = by; m_bhat[2] = bz; } //!< @brief Resets the current estimated gyro bias to a particular vector value.
+		void getGyroBias(Scalar b[]) const { for(int i = 0;i < 3;i++) b[i] = m_bhat[i]; } //!< @brief Returns the current estimated gyro bias (Note: `b[]` must have room for 3 elements).
+		void setGyroBias(const Scalar b[]) { for(int i = 0;i < 3;i++) m_bhat[i] = b[i]; } //!< @brief Resets the current estimated gyro bias to a particular vector value (Note: `b[]` must have 3 elements).
+		void setGyroBias(Scalar bx, Scalar by, Scalar bz) { m_bhat[0] = bx; m_bhat[1] = by; m_bhat[2] = bz; } //!< @brief Resets the current estimated gyro bias to a particular vector value.
 
 		// Get/set functions for the magnetometer calibration
-		void getMagCalib(double mt[]) const { for(int i = 0;i < 3;i++) mt[i] = m_magCalib[i]; } //!< @brief Returns the current magnetometer calibration vector. This should be the value of `(magX,magY,magZ)` that corresponds to a true orientation of identity (Note: `mt[]` must have room for 3 elements).
-		void setMagCalib(const double mt[]) { for(int i = 0;i < 3;i++) m_magCalib[i] = mt[i]; } //!< @brief Sets the magnetometer calibration vector to use in the update functions. This should be the value of `(magX,magY,magZ)` that corresponds to a true orientation of identity (Note: `mt[]` must have 3 elements).
-		void setMagCalib(double mtx, double mty, double mtz = 0.0) { m_magCalib[0] = mtx; m_magCalib[1] = mty; m_magCalib[2] = mtz; } //!< @brief Sets the magnetometer calibration vector to use in the update functions. This should be the value of `(magX,magY,magZ)` that corresponds to a true orientation of identity.
+		void getMagCalib(Scalar mt[]) const { for(int i = 0;i < 3;i++) mt[i] = m_magCalib[i]; } //!< @brief Returns the current magnetometer calibration vector. This should be the value of `(magX,magY,magZ)` that corresponds to a true orientation of identity (Note: `mt[]` must have room for 3 elements).
+		void setMagCalib(const Scalar mt[]) { for(int i = 0;i < 3;i++) m_magCalib[i] = mt[i]; } //!< @brief Sets the magnetometer calibration vector to use in the update functions. This should be the value of `(magX,magY,magZ)` that corresponds to a true orientation of identity (Note: `mt[]` must have 3 elements).
+		void setMagCalib(Scalar mtx, Scalar mty, Scalar mtz = Scalar(0.0)) { m_magCalib[0] = mtx; m_magCalib[1] = mty; m_magCalib[2] = mtz; } //!< @brief Sets the magnetometer calibration vector to use in the update functions. This should be the value of `(magX,magY,magZ)` that corresponds to a true orientation of identity.
 
 		// Get/set functions for the quick learning lambda parameter
-		double getLambda() const { return m_lambda; } //!< @brief Returns the current value of the quick learning parameter, &lambda;. This will always be on the unit interval `[0,1]`, and specifies the factor for linear interpolation between the standard (`Kp`, `Ti`) and quick learning (`KpQuick`, `TiQuick`) PI gains. &lambda; is auto-incremented in each call to `update()` in inverse proportion to `QLTime`.
-		void   resetLambda() { setLambda(0.0); } //!< @brief Restarts (activates) quick learning by setting &lambda; to zero.
-		void   setLambda(double value = 1.0) { m_lambda = (value >= 1.0 ? 1.0 : (value <= 0.0 ? 0.0 : value)); } //!< @brief Sets &lambda; to the desired value, by default this is `1.0`, which turns quick learning off. Values outside of `[0,1]` are coerced.
+		Scalar getLambda() const { return m_lambda; } //!< @brief Returns the current value of the quick learning parameter, &lambda;. This will always be on the unit interval `[0,1]`, and specifies the factor for linear interpolation between the standard (`Kp`, `Ti`) and quick learning (`KpQuick`, `TiQuick`) PI gains. &lambda; is auto-incremented in each call to `update()` in inverse proportion to `QLTime`.
+		void   resetLambda() { setLambda(Scalar(0.0)); } //!< @brief Restarts (activates) quick learning by setting &lambda; to zero.
+		void   setLambda(Scalar value = Scalar(1.0)) { m_lambda = (value >= Scalar(1.0) ? Scalar(1.0) : (value <= Scalar(0.0) ? Scalar(0.0) : value)); } //!< @brief Sets &lambda; to the desired value, by default this is `1.0`, which turns quick learning off. Values outside of `[0,1]` are coerced.
 
 		// Get/set functions for the configuration variables
-		void   getPIGains(double &Kp, double &Ti, double &KpQuick, double &TiQuick); //!< @brief Returns the currently set attitude estimator PI gains. Refer to `getLambda()` for more information on the PI gains (Note: The values are passed out of this function via the four reference parameters).
-		void   setPIGains(double Kp, double Ti, double KpQuick, double TiQuick); //!< @brief Sets the PI gains to use in both normal situations and for quick learning (Note: Each `Kp/Ti` pair must be a pair of positive values or the respective pair is not updated).
-		double getQLTime() const { return m_QLTime; } //!< @brief Returns the currently set quick learning time. A rate at which to auto-increment &lambda; is calculated so that quick learning fades over into standard operation in exactly `QLTime` seconds.
-		void   setQLTime(double QLTime) { if(QLTime > 0.0) m_QLTime = QLTime; } //!< @brief Sets the quick learning time to use. See `getQLTime()` for more details (Note: Non-positive values of `QLTime` are ignored by this function).
+		void   getPIGains(Scalar &Kp, Scalar &Ti, Scalar &KpQuick, Scalar &TiQuick); //!< @brief Returns the currently set attitude estimator PI gains. Refer to `getLambda()` for more information on the PI gains (Note: The values are passed out of this function via the four reference parameters).
+		void   setPIGains(Scalar Kp, Scalar Ti, Scalar KpQuick, Scalar TiQuick); //!< @brief Sets the PI gains to use in both normal situations and for quick learning (Note: Each `Kp/Ti` pair must be a pair of positive values or the respective pair is not updated).
+		Scalar getQLTime() const { return m_QLTime; } //!< @brief Returns the currently set quick learning time. A rate at which to auto-increment &lambda; is calculated so that quick learning fades over into standard operation in exactly `QLTime` seconds.
+		void   setQLTime(Scalar QLTime) { if(QLTime > Scalar(0.0)) m_QLTime = QLTime; } //!< @brief Sets the quick learning time to use. See `getQLTime()` for more details (Note: Non-positive values of `QLTime` are ignored by this function).
 
 		// Public estimation update functions
-		void update(double dt, double gyroX, double gyroY, double gyroZ, double accX, double accY, double accZ, double magX, double magY, double magZ); //!< @brief Updates the current attitude estimate based on new sensor measurements and the amount of elapsed time since the last update.
+		void update(Scalar dt, Scalar gyroX, Scalar gyroY, Scalar gyroZ, Scalar accX, Scalar accY, Scalar accZ, Scalar magX, Scalar magY, Scalar magZ); //!< @brief Updates the current attitude estimate based on new sensor measurements and the amount of elapsed time since the last update.
 
 #ifndef ATT_EST_PRIVATE_ARE_AVAILABLE
 	private: // <-- This private accessor can be pre-processored out in order to be able to run the special tests in test_attitude_estimator.cpp!
 #endif
 		// Private estimation update functions
-		void updateQy(double accX, double accY, double accZ, double magX, double magY, double magZ); // Calculates a 'measured' orientation based on given sensor measurements
+		void updateQy(Scalar accX, Scalar accY, Scalar accZ, Scalar magX, Scalar magY, Scalar magZ); // Calculates a 'measured' orientation based on given sensor measurements
 		void updateEuler(); // Takes the current value of m_Qhat, converts it into Euler angles, and stores the result in m_Ehat
 		void updateFused(); // Takes the current value of m_Qhat, converts it into fused angles, and stores the result in m_Fhat and m_FhatHemi
 
@@ -209,26 +214,29 @@
 		AccMethodEnum m_accMethod; // The method to use if we cannot use a mag measurement to resolve the corresponding acc measurement into a full 3D orientation
 
 		// Configuration variables
-		double m_Kp;      // Kp for standard operation (at lambda = 1)
-		double m_Ti;      // Ti for standard operation (at lambda = 1)
-		double m_KpQuick; // Kp for quick learning (at lambda = 0)
-		double m_TiQuick; // Ti for quick learning (at lambda = 0)
-		double m_QLTime;  // The nominal duration of quick learning when lambda is reset to zero
+		Scalar m_Kp;      // Kp for standard operation (at lambda = 1)
+		Scalar m_Ti;      // Ti for standard operation (at lambda = 1)
+		Scalar m_KpQuick; // Kp for quick learning (at lambda = 0)
+		Scalar m_TiQuick; // Ti for quick learning (at lambda = 0)
+		Scalar m_QLTime;  // The nominal duration of quick learning when lambda is reset to zero
 
 		// Magnetometer calibration
-		double m_magCalib[3]; // The mag value corresponding to/calibrated at the identity orientation
+		Scalar m_magCalib[3]; // The mag value corresponding to/calibrated at the identity orientation
 
 		// Internal variables
-		double m_lambda; // The quick learning parameter (0 => Quick learning, 1 => Normal operation, In-between => Faded PI gains with m_lambda as the interpolation constant)
-		double m_Qy[4], m_Qtilde[4], m_Qhat[4]; // Quaternions: Format is (q0,qvec) = (w,x,y,z), m_Qhat must *always* be a unit quaternion (or within a few eps of it)!
-		double m_dQ[4], m_dQold[4]; // Quaternion derivatives: Format is (dw,dx,dy,dz)
-		double m_w[3], m_wold[3], m_bhat[3], m_omega[3], m_base[3]; // 3D vectors: Format is (x,y,z)
-		double m_Ry[9]; // Rotation matrix: The numbering of the 3x3 matrix entries is left to right, top to bottom
-		double m_Ehat[3]; // Euler angles: Format is (psi,theta,phi) = (yaw,pitch,roll) and follows the ZYX convention
-		double m_Fhat[3]; // Fused angles: Format is (psi,theta,phi) = (yaw,pitch,roll) and follows the standard definition of fused angles
+		Scalar m_lambda; // The quick learning parameter (0 => Quick learning, 1 => Normal operation, In-between => Faded PI gains with m_lambda as the interpolation constant)
+		Scalar m_Qy[4], m_Qtilde[4], m_Qhat[4]; // Quaternions: Format is (q0,qvec) = (w,x,y,z), m_Qhat must *always* be a unit quaternion (or within a few eps of it)!
+		Scalar m_dQ[4], m_dQold[4]; // Quaternion derivatives: Format is (dw,dx,dy,dz)
+		Scalar m_w[3], m_wold[3], m_bhat[3], m_omega[3], m_base[3]; // 3D vectors: Format is (x,y,z)
+		Scalar m_Ry[9]; // Rotation matrix: The numbering of the 3x3 matrix entries is left to right, top to bottom
+		Scalar m_Ehat[3]; // Euler angles: Format is (psi,theta,phi) = (yaw,pitch,roll) and follows the ZYX convention
+		Scalar m_Fhat[3]; // Fused angles: Format is (psi,theta,phi) = (yaw,pitch,roll) and follows the standard definition of fused angles
 		bool   m_FhatHemi; // Fused angles: Extra fourth hemisphere parameter, true is taken to mean 1 (positive z hemisphere), and false is taken to mean -1 (negative z hemisphere)
 		bool   m_eulerValid, m_fusedValid; // Flags specifying whether the currently stored Euler and fused angle representations are up to date with the quaternion stored in m_Qhat
 	};
+
+	typedef AttitudeEstimatorT<double> AttitudeEstimator;
+	typedef AttitudeEstimatorT<float> AttitudeEstimatorF;
 //}
 
 #endif /* ATTITUDE_ESTIMATOR_H */
@@ -0,0 +1,105 @@
+/******
+ * Command line handling without heap allocations and without blocking
+ *
+ * A LineAssembler collects the bytes available on its stream in a fixed buffer, a line at a time;
+ * a complete line is tokenised in place (words separated by spaces or commas) and dispatched through
+ * a static table on its first word. Lines longer than CMD_LINE_MAX are discarded whole.
+ *
+ * Released under GPLv3 License - see LICENSE file for details.
+ ******/
+
+#ifndef COMMANDS
+#define COMMANDS
+
+#define CMD_LINE_MAX 96
+#define CMD_MAX_ARGS 8
+
+struct LineAssembler {
+  char buf[CMD_LINE_MAX];
+  uint8_t len;
+  bool overflow;      // the current line did not fit, it is dropped at its end
+};
+
+unsigned long command_time_mus = 0;   // micros() when the last line was completed
+
+/*
+ * A command runs either run(), if it takes no arguments, or run_args() with the words of the line,
+ * argv[0] being the command itself
+ */
+struct Command {
+  const char* name;
+  void (*run)();
+  void (*run_args)(int argc, char* argv[]);
+};
+
+/*
+ * consumes the bytes available, up to the end of a line.
+ * Returns true if a line is complete, it is then in la->buf, zero terminated
+ */
+bool line_poll(Stream& in, LineAssembler* la) {
+  while(in.available()) {
+    char c = in.read();
+    if(c == '\r') {
+      continue;
+    }
+    if(c == '\n') {
+      bool complete = !la->overflow;
+      la->buf[la->len] = 0;
+      la->len = 0;
+      la->overflow = false;
+      if(complete) {
+        command_time_mus = micros();
+        return true;
+      }
+      Serial.println("Command line too long, dropped");
+      continue;
+    }
+    if(la->len < CMD_LINE_MAX - 1) {
+      la->buf[la->len++] = c;
+    } else {
+      la->overflow = true;
+    }
+  }
+  return false;
+}
+
+/*
+ * splits line in place, returns the number of words
+ */
+int tokenize(char* line, char* argv[], int max_args) {
+  int argc = 0;
+  char* p = line;
+  while(*p && argc < max_args) {
+    while(*p == ' ' || *p == ',') {
+      *p++ = 0;
+    }
+    if(!*p) {
+      break;
+    }
+    argv[argc++] = p;
+    while(*p && *p != ' ' && *p != ',') {
+      p++;
+    }
+  }
+  return argc;
+}
+
+/*
+ * Returns false if the command is not in the table
+ */
+bool dispatch(const Command* table, int n, int argc, char* argv[]) {
+  for(int i = 0; i < n; i++) {
+    if(strcmp(table[i].name, argv[0])) {
+      continue;
+    }
+    if(table[i].run_args) {
+      table[i].run_args(argc, argv);
+    } else {
+      table[i].run();
+    }
+    return true;
+  }
+  return false;
+}
+
+#endif
@@ -1,23 +1,28 @@
 /******
  * Calculates azimuth and altitude from sensors readings
- * Azimuth is smoothed by a kalman filter
+ * Azimuth and altitude are smoothed by kalman filters, the azimuth one wraps around north (angle_kalman.h).
+ * Both are driven by the time of the samples the angles come from (sensors/timed_kalman.h)
  * 
  * Created by Massimo Tasso, January, 1, 2023
  * Released under GPLv3 License - see LICENSE file for details.
  ******/
  
-#include <SimpleKalmanFilter.h>
+#include "sensors/timed_kalman.h"
+#include "angle_kalman.h"
 #include "defines.h"
+#include "profiler.h"
 
 float K_ERR_AZ = 0.01;   // expected magnitude of error - small, readings are already smoothed 
 float K_Q_AZ = 1.0;      // meaning: how much we expect the measurement to vary. Quite small, fastest rotation at 3°/sec when calibrating. Generally below 1"/sec
 float K_ERR_ALT = 0.01;  // expected magnitude of error - small, the sensor is not particularly noisy
 float K_Q_ALT = 1.0;     // meaning: how much we expect the measurement to vary. Even smaller than azimuth, the scope rotates at 1°/sec when slewing. Generally below 1"/sec
 
-SimpleKalmanFilter kf_azimuth = SimpleKalmanFilter(K_ERR_AZ, K_ERR_AZ, K_Q_AZ);  // TODO NON POSSO USARE KF per l'Azimuth perchè da 359 salta a 0
-SimpleKalmanFilter kf_altitude = SimpleKalmanFilter(K_ERR_ALT, K_ERR_ALT, K_Q_ALT);
+AngleKalmanFilter kf_azimuth = AngleKalmanFilter(K_ERR_AZ, K_ERR_AZ, K_Q_AZ);
+TimedKalmanFilter kf_altitude = TimedKalmanFilter(K_ERR_ALT, K_ERR_ALT, K_Q_ALT);
 
 float latest_yaw = 0;
+float raw_azimuth = 0;     // degrees, before the kalman filter
+float raw_altitude = 0;
 
 float norm_2PI(float angle);
 
@@ -46,15 +51,17 @@ void vector_normalize(float a[3]) {
   a[2] /= mag;
 }
 
-float compass2D(float mag[3], uint8_t debug);
+float compass2D(float mag[3], unsigned long t_mus, uint8_t debug);
 
 // https://github.com/jremington/AltIMU-AHRS/blob/master/altimu10v3_tiltcomp/altimu10v3_tiltcomp.ino
 // https://github.com/jremington/AltIMU-AHRS
 // brilliant method that replaces lots of trig functions with simple vector products
 //
-float compass3D(float acc[3], float mag[3], uint8_t debug) {
+// t_mus is the time of the newer of the two samples, the filter skips the ones it has already seen
+float compass3D(float acc[3], float mag[3], unsigned long t_mus, uint8_t debug) {
+    PROFILE_SCOPE(PROF_COMPASS3D);
     if((acc[0]==0) & (acc[1]==0) & (acc[2] ==0))
-        return compass2D(mag, debug);  // if there's no untilter calculate azimut with the mag only compass
+        return compass2D(mag, t_mus, debug);  // if there's no untilter calculate azimut with the mag only compass
     float E[3], N[3]; //direction vectors
     float P[] = {1, 0, 0};      // X ahead, to North
     vector_cross(acc, mag, E);  // cross "down" (acceleration vector) with magnetic vector (magnetic north + inclination) with  to produce "east"
@@ -68,8 +75,9 @@ float compass3D(float acc[3], float mag[3], uint8_t debug) {
     if((uint8_t)(debug | ~DEBUG_AZ)==255) {
         Serial.print("debug Az,");Serial.print(yaw*RadToDeg);
     }
+    raw_azimuth = yaw*RadToDeg;
     if(not_NAN(yaw))  // should never happen but if it happens the kalman smooth is screwed forever
-        yaw = kf_azimuth.updateEstimate(yaw);
+        yaw = kf_azimuth.updateEstimate(yaw, t_mus);
     if((uint8_t)(debug | ~DEBUG_AZ)==255) {
         Serial.print(",KAZ,");Serial.println(yaw*RadToDeg);
     }
@@ -79,7 +87,7 @@ float compass3D(float acc[3], float mag[3], uint8_t debug) {
 /*
  * Fall back for 2D calibrated magnetometer and absence of untilter accelerator
  */
-float compass2D(float mag[3], uint8_t debug) {
+float compass2D(float mag[3], unsigned long t_mus, uint8_t debug) {
     float Bx = mag[0];
     float By = mag[1];
     float yaw = norm_2PI(-atan2(By, Bx));
@@ -87,9 +95,10 @@ float compass2D(float mag[3], uint8_t debug) {
       Serial.print("Bx, ");Serial.print(Bx);Serial.print(" By, ");Serial.print(By);
       Serial.print(",Az,");Serial.print(yaw*RadToDeg);
     }
+    raw_azimuth = yaw*RadToDeg;
 //    if(!(isnan(yaw)))  // TODO debug connection to untilted mag and remove this line
     if(not_NAN(yaw))  // should never happen but if it happens the kalman smooth is screwed forever
-        yaw = kf_azimuth.updateEstimate(yaw);
+        yaw = kf_azimuth.updateEstimate(yaw, t_mus);
     if(debug){
         Serial.print("Bx, ");Serial.print(Bx);Serial.print(" By, ");Serial.print(By);
         Serial.print(",KAZ,");Serial.println(yaw*RadToDeg);
@@ -98,15 +107,17 @@ float compass2D(float mag[3], uint8_t debug) {
 
 }
 
-float elevation(float acc[3], uint8_t debug) {
+float elevation(float acc[3], unsigned long t_mus, uint8_t debug) {
+  PROFILE_SCOPE(PROF_ELEVATION);
 //  float pitch = atan2(Gx, Gz);
   float pitch = atan2(acc[0], acc[2]);
 //Serial.print("AX: ");Serial.print(acc[0], 4);Serial.print(" AY: ");Serial.print(acc[1], 4);Serial.print(" AZ: ");Serial.print(acc[2], 4);Serial.print(" Pitch: ");Serial.print(pitch);Serial.print(" Pitch°: ");Serial.println(pitch*RadToDeg);
   if((uint8_t)(debug | ~DEBUG_ALT)==255) {
       Serial.print("debug alt Alt,");Serial.print(pitch*RadToDeg);
   }
+  raw_altitude = pitch*RadToDeg;
   if(not_NAN(pitch))  // should never happen but if it happens the kalman smooth is screwed forever
-      pitch = kf_altitude.updateEstimate(pitch);
+      pitch = kf_altitude.updateEstimate(pitch, t_mus);
   if((uint8_t)(debug | ~DEBUG_ALT)==255) {
       Serial.print(",KAlt,");Serial.println(pitch*RadToDeg);
   }
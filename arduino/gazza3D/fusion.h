@@ -0,0 +1,135 @@
+/******
+ * Quaternion fusion heading engine
+ *
+ * Alternative to compass3D() and elevation() with their kalman filters: the AttitudeEstimator (a passive
+ * complementary filter with gyro bias estimation, see attitude_estimator.h) integrates the gyro once per accelerometer
+ * task (the 100 Hz batch means in FIFO mode, 500 Hz without the FIFO) and is pulled towards the attitude measured by
+ * the accelerometer and the calibrated magnetometer. The gyro carries the fast motions, so there is no smoothing lag.
+ * The accelerometer vector of this sketch points up and x is the tube, as the estimator wants: azimuth and
+ * altitude are minus the fused yaw and pitch (the estimator turns counterclockwise, z up).
+ * The estimator runs in single precision, on the FPU of the Cortex-M7; the double one is the reference that
+ * fusion_bench compares it with, on samples recorded from the sensors.
+ * Commands:
+ *    heading compass|fusion      selects the engine, compass by default. fusion restarts with quick learning
+ *    fusion_bench record         records the next FUSION_TRACE_LEN samples, fusion or not
+ *    fusion_bench                runs both precisions over the record: cycles per update and largest difference
+ *
+ * Released under GPLv3 License - see LICENSE file for details.
+ ******/
+
+#ifndef FUSION
+#define FUSION
+
+#include "attitude_estimator.h"
+
+#define FUSION_DT_MIN 0.0002      // seconds, coercion of the update interval
+#define FUSION_DT_MAX 0.05
+#define FUSION_TRACE_LEN 1000     // samples, 10 s at the 100 Hz of the FIFO mode, 2 s at 500 Hz
+
+struct FusionSample {
+  float dt;
+  float gyr[3];                   // rad/s
+  float acc[3];
+  float mag[3];
+};
+
+bool fusion_on = false;
+AttitudeEstimatorF attitude;
+unsigned long fusion_last_mus = 0;
+
+DMAMEM FusionSample fusion_trace[FUSION_TRACE_LEN];
+int fusion_trace_count = FUSION_TRACE_LEN;    // < FUSION_TRACE_LEN while recording
+int fusion_trace_len = 0;                     // samples recorded
+
+/*
+ * to be called with each accelerometer and gyro sample, t_mus being its time. One estimator step if fusion is on
+ */
+void fusion_update(float acc[3], float gyr[3], float mag[3], unsigned long t_mus) {
+  float dt = constrain((t_mus - fusion_last_mus) * 1e-6f, FUSION_DT_MIN, FUSION_DT_MAX);
+  fusion_last_mus = t_mus;
+  float w[3] = {gyr[0] * DegToRad, gyr[1] * DegToRad, gyr[2] * DegToRad};
+  if(fusion_trace_count < FUSION_TRACE_LEN) {
+    FusionSample* s = &fusion_trace[fusion_trace_count++];
+    s->dt = dt;
+    for(int i = 0; i < 3; i++) {
+      s->gyr[i] = w[i];s->acc[i] = acc[i];s->mag[i] = mag[i];
+    }
+    fusion_trace_len = fusion_trace_count;
+  }
+  if(fusion_on) {
+    PROFILE_SCOPE(PROF_FUSION);
+    attitude.update(dt, w[0], w[1], w[2], acc[0], acc[1], acc[2], mag[0], mag[1], mag[2]);
+  }
+}
+
+float fusion_azimuth() {
+  return norm_2PI(-attitude.fusedYaw()) * RadToDeg;
+}
+
+float fusion_altitude() {
+  return -attitude.fusedPitch() * RadToDeg;
+}
+
+/*
+ * heading command, see above
+ */
+void heading_command(int argc, char* argv[]) {
+  if(argc > 1) {
+    bool fusion = !strcmp(argv[1], "fusion");
+    if(fusion && !fusion_on) {
+      attitude.reset(true, false);      // quick learning, the gyro bias is kept
+    }
+    fusion_on = fusion;
+  }
+  float b[3];
+  attitude.getGyroBias(b);
+  Serial.print("HEADING, ");Serial.print(fusion_on ? "FUSION" : "COMPASS");
+  Serial.print(", LAMBDA, ");Serial.print(attitude.getLambda(), 3);
+  Serial.print(", BIAS, ");Serial.print(b[0] * RadToDeg, 4);Serial.print(", ");Serial.print(b[1] * RadToDeg, 4);Serial.print(", ");Serial.println(b[2] * RadToDeg, 4);
+}
+
+/*
+ * fusion_bench command, see above. Both estimators start from the same state, with quick learning, and the difference
+ * is the angle of the rotation between their attitudes
+ */
+void fusion_bench(int argc, char* argv[]) {
+  if(argc > 1 && !strcmp(argv[1], "record")) {
+    fusion_trace_count = fusion_trace_len = 0;
+    Serial.println("FUSION_BENCH, RECORDING");
+    return;
+  }
+  if(fusion_trace_count < FUSION_TRACE_LEN || fusion_trace_len == 0) {
+    Serial.print("FUSION_BENCH, SAMPLES, ");Serial.print(fusion_trace_len);Serial.println(", NOT READY");
+    return;
+  }
+  AttitudeEstimator ref;
+  AttitudeEstimatorF fast;
+  uint64_t cycles_d = 0, cycles_f = 0;
+  uint32_t max_d = 0, max_f = 0;
+  double max_diff = 0;
+  for(int i = 0; i < fusion_trace_len; i++) {
+    const FusionSample* s = &fusion_trace[i];
+    uint32_t t0 = ARM_DWT_CYCCNT;
+    ref.update(s->dt, s->gyr[0], s->gyr[1], s->gyr[2], s->acc[0], s->acc[1], s->acc[2], s->mag[0], s->mag[1], s->mag[2]);
+    uint32_t t1 = ARM_DWT_CYCCNT;
+    fast.update(s->dt, s->gyr[0], s->gyr[1], s->gyr[2], s->acc[0], s->acc[1], s->acc[2], s->mag[0], s->mag[1], s->mag[2]);
+    uint32_t t2 = ARM_DWT_CYCCNT;
+    cycles_d += t1 - t0;cycles_f += t2 - t1;
+    max_d = max(max_d, t1 - t0);max_f = max(max_f, t2 - t1);
+    // vector part of conj(qd)*qf, the sine of half the angle between the two
+    double qd[4];
+    float qf[4];
+    ref.getAttitude(qd);
+    fast.getAttitude(qf);
+    double x = qd[0]*qf[1] - qd[1]*qf[0] - qd[2]*qf[3] + qd[3]*qf[2];
+    double y = qd[0]*qf[2] + qd[1]*qf[3] - qd[2]*qf[0] - qd[3]*qf[1];
+    double z = qd[0]*qf[3] - qd[1]*qf[2] + qd[2]*qf[1] - qd[3]*qf[0];
+    max_diff = max(max_diff, 2 * asin(min(1.0, sqrt(x*x + y*y + z*z))));
+  }
+  Serial.print("FUSION_BENCH, SAMPLES, ");Serial.print(fusion_trace_len);
+  Serial.print(", DOUBLE_CYCLES, ");Serial.print((float)cycles_d / fusion_trace_len, 1);Serial.print(", ");Serial.print(max_d);
+  Serial.print(", FLOAT_CYCLES, ");Serial.print((float)cycles_f / fusion_trace_len, 1);Serial.print(", ");Serial.print(max_f);
+  Serial.print(", MAX_DIFF_DEG, ");Serial.println(max_diff * RadToDeg, 6);
+}
+
+#endif
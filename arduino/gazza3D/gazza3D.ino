@@ -17,11 +17,20 @@
  * Released under GPLv3 License - see LICENSE file for details.
  **************************************************************************************/
 
+#include "link.h"
 #include "sensors.h"
 #include "joystick.h"
 #include "compass.h"
 #include "m_calibration.h"
 #include "a_calibration.h"
+#include "scheduler.h"
+#include "telemetry.h"
+#include "streams.h"
+#include "commands.h"
+#include "tsync.h"
+#include "predict.h"
+#include "motion.h"
+#include "fusion.h"
 #include "defines.h"
 
 int LOOP_RATE_HZ = 100;
@@ -32,6 +41,7 @@ unsigned long headingLoopInterval_mus;
 unsigned long partialFusionLoopInterval_mus;
 const unsigned long outputLoopInterval_mus = 100000;  // sensors sent to Raspberry at 10 Hz - sounds enough
 const unsigned long devoutputLoopInterval_mus = 200000;  // outputs mag and untiltacc raw data - temporary, can be removed after development tests
+const unsigned long commandLoopInterval_mus = 10000;     // console, raspberry and joystick polled at 100 Hz
 
 //unsigned long last_mag_time = millis();
 //unsigned long last_gyro_time = millis();
@@ -40,11 +50,13 @@ const unsigned long devoutputLoopInterval_mus = 200000;  // outputs mag and unti
 //unsigned long last_heading_time = millis();
 //unsigned long last_print_time = millis();
 //unsigned long last_devoutput_time = millis();  //temporary, can be removed after development tests
-unsigned long last_mag_time = micros();
-unsigned long last_accel_time = micros();
 unsigned long last_mag_cal_time = micros();
-unsigned long last_heading_time = micros();
-unsigned long last_print_time = micros();
+unsigned long acc_read_mus = 0;       // micros() of the last accelerometer sample read
+unsigned long mag_read_mus = 0;       // micros() of the last magnetometer sample read
+unsigned long heading_time_mus = 0;   // acquisition time of the older sample azimuth and altitude come from
+int output_task_id;
+int altaz_stream_id;
+uint16_t altaz_link_drops = 0;        // SENSORS messages refused by the link, ring full
 unsigned long last_devoutput_time = micros();  //temporary, can be removed after development tests
 
 bool m_calib_on = false;        // true if calibration data collection is in progress
@@ -66,23 +78,37 @@ float azimuth = 0;
 float altitude = 0;
 float acc[3];
 float mag[3];
+float gyr[3];
+
+bool accel_task(unsigned long timestamp);
+bool mag_task(unsigned long timestamp);
+bool heading_task(unsigned long timestamp);
+bool output_task(unsigned long timestamp);
+void emit_altaz(unsigned long timestamp);
+void emit_mag(unsigned long timestamp);
+void emit_acc(unsigned long timestamp);
+void emit_gyro(unsigned long timestamp);
+void emit_filter(unsigned long timestamp);
+void emit_loop(unsigned long timestamp);
+bool command_task(unsigned long timestamp);
 
 void setup() {
   // put your setup code here, to run once:
   Serial.begin(115200);   // Serial: Console
-  Serial1.begin(115200);  // Serial1: raspberry
+  link_begin();           // Serial1: raspberry, see link.h
   while(!Serial1) {
     delay(1);
   }
 
-  initJoystick();
+  prof_begin();
   Serial.println("STARTING");
   /* Initialise the sensors */
   while(!(sensors())) {
     Serial.println("Sensor error");
-    Serial1.println("Sensor error");
+    pi_link.println("Sensor error");
     delay(1000);
   }
+  initJoystick();         // after the sensors: a bus probe may have taken the button pin
 
   // need to initialize the values here because they depend on sensors() result
 //  magLoopIntervalMs = 1000 / MAG_DATARATE;
@@ -91,6 +117,8 @@ void setup() {
   magLoopInterval_mus = 1000000 / MAG_DATARATE;
   accelLoopInterval_mus = 1000000 / ACCEL_DATARATE;
   headingLoopInterval_mus = max(magLoopInterval_mus,accelLoopInterval_mus);  // to be converted to herz
+  kf_azimuth.setNominalInterval(headingLoopInterval_mus);                    // K_Q_AZ and K_Q_ALT were tuned per heading update
+  kf_altitude.setNominalInterval(headingLoopInterval_mus);
 
   //fusion.begin(10, 10.0, 2.0);  // default 0.5, 10.0, 20.0
 //  fusion.begin(25);
@@ -98,81 +126,192 @@ void setup() {
   Serial.print("MAG interval _mus: ");Serial.println(magLoopInterval_mus);
   Serial.print("ACC interval _mus: ");Serial.println(accelLoopInterval_mus);
   Serial.print("Heading loop _mus: ");Serial.println(headingLoopInterval_mus);
+
+  // tasks by priority, see scheduler.h
+  sched_add("ACC", accel_task, accelLoopInterval_mus, 0);
+  sched_add("MAG", mag_task, magLoopInterval_mus, 1);
+  sched_add("HEADING", heading_task, headingLoopInterval_mus, 2);
+  output_task_id = sched_add("OUTPUT", output_task, outputLoopInterval_mus, 3);
+  sched_add("COMMANDS", command_task, commandLoopInterval_mus, 4);
+
+  // telemetry streams, see streams.h. Only altaz (the SENSORS message) is on by default
+  altaz_stream_id = stream_add("altaz", emit_altaz, 1000000 / outputLoopInterval_mus);
+  stream_add("mag", emit_mag, 0);
+  stream_add("acc", emit_acc, 0);
+  stream_add("gyro", emit_gyro, 0);
+  stream_add("filter", emit_filter, 0);
+  stream_add("loop", emit_loop, 0);
+  streams_begin(output_task_id);
+  sched_begin();
 }
 
 void checkSerial();
 void checkSerial1();
 
 /**
- * main cycle.
- * actions to perform, with different intervals
+ * main cycle: the tasks are released by the scheduler timer at their own interval
  * 
- * - accelererometer readings - accelLoopIntervalMS
- * - untilt accelerometer readings - 500 Hz, 2ms
- * - magnetometer readings - magLoopIntervalMS
+ * - accelererometer readings - accelLoopInterval_mus
+ * - magnetometer readings - magLoopInterval_mus
  * - samples acquisition for magnetometer calibration - interval calculated basing on rotation time and number of samples
- * - samples acquisition for magnetometer compensation (mag data and accel data)
- * - ALT-AZ computation
- * - ALT-AZ sendout to raspberry (and serial console)
+ * - ALT-AZ computation - headingLoopInterval_mus
+ * - ALT-AZ sendout to raspberry (and serial console), and the other subscribed streams - at the stream rates
+ * - commands from console, raspberry and joystick - commandLoopInterval_mus
+ * 
+ * the acquisition tasks return false, and are retried, until the sensor has a new sample
  **/
 void loop() {
-//    unsigned long timestamp = millis();
-    unsigned long timestamp = micros();
-
-    // ALTITUDE ACC
-    if ((timestamp - last_accel_time) >= accelLoopInterval_mus) {                       // time to read accelerometer
-        last_accel_time = timestamp;
-        accel_readings(acc, debug);
-        a_calibrate(acc);                                                             // call a_calibrate even if calibration is not done, won't harm
+    sched_run();
+}
+
+// ALTITUDE ACC
+bool accel_task(unsigned long timestamp) {
+    if(!accel_readings(acc, debug)) {
+        return false;
+    }
+    acc_read_mus = micros();
+    a_calibrate(acc);                                                             // call a_calibrate even if calibration is not done, won't harm
+    if(gyro_readings(gyr, debug)) {                                               // same chip, same rate. Kept if no new sample
+        predict_gyro(gyr, acc_read_mus);
+        motion_update(gyr, acc_read_mus);
     }
+    fusion_update(acc, gyr, mag, acc_time_mus ? acc_time_mus : acc_read_mus);     // chip time of the sample in FIFO mode
+    return true;
+}
 
-    // MAGNETOMETER
-    if ((timestamp - last_mag_time) >= magLoopInterval_mus) {                           // time to read magnetometer
-        last_mag_time = timestamp;
-        mag_readings(mag, false);
-        if (m_calib_on && (timestamp - last_mag_cal_time) >= magCalLoopInterval_mus) {  // time to read mag calibration sample
-            last_mag_cal_time = timestamp;
-
-            int to_go = add_sample(mag, acc, debug);      // 3D calibration uses altitude acc
-            if(!to_go) {
-                m_calib_on = false;
-                m_calib_complete = true;
-                Serial.print("AZ_CORR ");Serial.println(AZ_CORR*RadToDeg);
-                Serial.println("M_CAL, points collected");
-                Serial1.println("M_CAL, points collected");  // tell Raspberry that magnetometer calibration is completed
-            } else {
-                Serial.print(millis());Serial.print(" \tM Calibration togo ");Serial.println(to_go);
-            }            
-        }
-        m_calibrate(mag, acc, debug);                    // can call m_calibrate even if calibration is not completed, won't harm
+// MAGNETOMETER
+bool mag_task(unsigned long timestamp) {
+    if(!mag_readings(mag, false)) {
+        return false;
     }
+    mag_read_mus = micros();
+    if (m_calib_on && (timestamp - last_mag_cal_time) >= magCalLoopInterval_mus) {  // time to read mag calibration sample
+        last_mag_cal_time = timestamp;
 
+        int to_go = add_sample(mag, acc, debug);      // 3D calibration uses altitude acc
+        if(!to_go) {
+            m_calib_on = false;
+            m_calib_complete = true;
+            Serial.print("AZ_CORR ");Serial.println(AZ_CORR*RadToDeg);
+            Serial.println("M_CAL, points collected");
+            pi_link.println("M_CAL, points collected");  // tell Raspberry that magnetometer calibration is completed
+        } else {
+            Serial.print(millis());Serial.print(" \tM Calibration togo ");Serial.println(to_go);
+        }            
+    }
+    m_calibrate(mag, acc, debug);                    // can call m_calibrate even if calibration is not completed, won't harm
+    return true;
+}
 
-    // AZIMUTH
-    if ((timestamp - last_heading_time) >= headingLoopInterval_mus) {       // time to calculate ALT/AZ using most recent readings
-        altitude = elevation(acc, debug);
-        azimuth  = compass3D(acc, mag, debug);        
+// AZIMUTH
+bool heading_task(unsigned long timestamp) {       // calculates ALT/AZ using most recent readings
+    if(fusion_on) {                               // see fusion.h
+        altitude = raw_altitude = fusion_altitude();
+        azimuth = raw_azimuth = fusion_azimuth();
+        heading_time_mus = acc_read_mus;          // the gyro carries the estimate up to the last accelerometer sample
+    } else {
+        bool acc_older = (long)(acc_read_mus - mag_read_mus) < 0;
+        altitude = elevation(acc, acc_read_mus, debug);
+        azimuth  = compass3D(acc, mag, acc_older ? mag_read_mus : acc_read_mus, debug);
+        heading_time_mus = acc_older ? acc_read_mus : mag_read_mus;
     }
+    predict_rates(acc, mag, gyr);
+    return true;
+}
+
+// OUTPUTS
+bool output_task(unsigned long timestamp) {        // sends the streams due
+    streams_run(timestamp);
+    return true;
+}
 
-    // OUTPUTS
-    if ((timestamp - last_print_time) >= outputLoopInterval_mus) {          // time to send to serial ALT/AZ
-        last_print_time = timestamp;
-        snprintf(output_str, MAX_LEN_OUT_BUF, "SENSORS, AZ, %+3.3f, ALT, %+3.3f,", azimuth, altitude);
-        if(!m_calib_on) {
-            if((uint8_t)(debug | ~DEBUG_UNTILT_ACC)==255) {
-                Serial.print("UNT ");Serial.print(acc[0], 4);Serial.print(" ");Serial.print(acc[1], 4);Serial.print(" ");Serial.print(acc[2], 4);
-                Serial.print(" ");Serial.print(mag[0], 4);Serial.print(" ");Serial.print(mag[1], 4);Serial.print(" ");Serial.println(mag[2], 4);
-            }
-            if(!debug){  // don't print if debug is active (!= 0)
-                Serial.println(output_str);
-            }
+/*
+ * SENSORS message: azimuth and altitude with the acquisition time of their samples, the output sequence number and
+ * the count of the messages not sent (periods of the altaz stream skipped and messages refused by the link).
+ * Once the clocks are synchronised (tsync.h) the acquisition time is on the raspberry clock.
+ * Azimuth and altitude are moved forward to the time of the message by the gyro (predict.h), the time sent is then
+ * the time of the message
+ */
+void emit_altaz(unsigned long timestamp) {         // sends to serial ALT/AZ
+    uint16_t seq = telemetry_seq;                 // of this message, text or frame
+    uint16_t dropped = streams[altaz_stream_id].skipped + altaz_link_drops;
+    float az = azimuth;
+    float alt = altitude;
+    unsigned long t = micros();
+    bool predicted = !m_calib_on && predict(heading_time_mus, t, &az, &alt);
+    if(!predicted) {
+        t = heading_time_mus;
+    }
+    t = tsync_valid ? tsync_pi_time(t) : t;
+    if(!m_calib_on && (uint8_t)(debug | ~DEBUG_UNTILT_ACC)==255) {
+        Serial.print("UNT ");Serial.print(acc[0], 4);Serial.print(" ");Serial.print(acc[1], 4);Serial.print(" ");Serial.print(acc[2], 4);
+        Serial.print(" ");Serial.print(mag[0], 4);Serial.print(" ");Serial.print(mag[1], 4);Serial.print(" ");Serial.println(mag[2], 4);
+    }
+    if(telemetry_binary) {
+        uint8_t flags = (m_calib_on ? TELEMETRY_FLAG_M_CAL_ON : 0) | (m_calib_complete ? TELEMETRY_FLAG_M_CAL_DONE : 0);
+        flags |= (tsync_valid ? TELEMETRY_FLAG_PI_TIME : 0) | (predicted ? TELEMETRY_FLAG_PREDICTED : 0);
+        flags |= (motion_state << TELEMETRY_FLAG_MOTION_SHIFT) & TELEMETRY_FLAG_MOTION;
+        if(!send_sensors_frame(link_frames, t, az, alt, flags, dropped)) {   // send to Raspberry
+            altaz_link_drops++;
+        }
+        if(m_calib_on || debug) {
+            return;         // no SENSORS text for the console either, skip the formatting
         }
-        Serial1.println(output_str); // send to Raspberry
     }
+    int len = snprintf(output_str, MAX_LEN_OUT_BUF, "SENSORS, AZ, %+3.3f, ALT, %+3.3f, SEQ, %u, T, %lu, DROPPED, %u, SYNC, %d, MOTION, %d,",
+                       az, alt, seq, t, dropped, tsync_valid, motion_state);
+    if(!m_calib_on && !debug) {  // don't print if debug is active (!= 0)
+        Serial.println(output_str);
+    }
+    if(!telemetry_binary) {
+        telemetry_seq++;
+        if(pi_link.println(output_str) < (size_t)len + 2) { // send to Raspberry
+            altaz_link_drops++;
+        }
+    }
+}
+
+void emit_vector(const char* name, unsigned long timestamp, float v[3]) {
+    pi_link.print("STREAM, ");pi_link.print(name);pi_link.print(", ");pi_link.print(timestamp);
+    pi_link.print(", ");pi_link.print(v[0], 4);pi_link.print(", ");pi_link.print(v[1], 4);pi_link.print(", ");pi_link.println(v[2], 4);
+}
+
+void emit_mag(unsigned long timestamp) {           // calibrated magnetometer
+    emit_vector("MAG", timestamp, mag);
+}
+
+void emit_acc(unsigned long timestamp) {           // calibrated accelerometer
+    emit_vector("ACC", timestamp, acc);
+}
 
+void emit_gyro(unsigned long timestamp) {
+    emit_vector("GYRO", timestamp, gyr);
+}
+
+void emit_filter(unsigned long timestamp) {        // azimuth and altitude before and after the kalman filters, time constants in seconds
+    pi_link.print("STREAM, FILTER, ");pi_link.print(timestamp);
+    pi_link.print(", AZ, ");pi_link.print(raw_azimuth, 3);pi_link.print(", ");pi_link.print(azimuth, 3);
+    pi_link.print(", ");pi_link.print(kf_azimuth.getKalmanGain(), 5);pi_link.print(", ");pi_link.print(kf_azimuth.getEstimateError(), 5);
+    pi_link.print(", ALT, ");pi_link.print(raw_altitude, 3);pi_link.print(", ");pi_link.print(altitude, 3);
+    pi_link.print(", ");pi_link.print(kf_altitude.getKalmanGain(), 5);pi_link.print(", ");pi_link.print(kf_altitude.getEstimateError(), 5);
+    pi_link.print(", TAU, ");pi_link.print(kf_azimuth.getTimeConstant(), 4);pi_link.print(", ");pi_link.print(kf_altitude.getTimeConstant(), 4);
+    pi_link.print(", ");pi_link.print(acc_sensor.time_constant(), 4);pi_link.print(", ");pi_link.print(mag_sensor.time_constant(), 4);
+    pi_link.print(", MOTION, ");pi_link.print(motion_state);pi_link.print(", ");pi_link.println(motion_blend, 3);
+}
+
+void emit_loop(unsigned long timestamp) {          // deadline misses per task, since the last sched_stats
+    pi_link.print("STREAM, LOOP, ");pi_link.print(timestamp);
+    for(int i = 0; i < sched_count; i++) {
+        pi_link.print(", ");pi_link.print(sched_tasks[i].name);pi_link.print(", ");pi_link.print(sched_tasks[i].misses);
+    }
+    pi_link.println();
+}
+
+bool command_task(unsigned long timestamp) {
     checkSerial();        // manual commands
     checkSerial1();       // commands from raspberry
     checkJoystick(debug);
+    return true;
 }
 
 
@@ -187,152 +326,191 @@ void loop() {
  * in the specified time
  */
 
-void debug_on(String msg);
-void debug_off(String msg);
-void start_mag_calibration(String msg);
-void parse_acc_calibration(String msg);
+void cmd_m_calibration(int argc, char* argv[]);
+void cmd_B_mag(int argc, char* argv[]);
+void cmd_set_a_calibration(int argc, char* argv[]);
+void cmd_telemetry(int argc, char* argv[]);
+void cmd_baud(int argc, char* argv[]);
+void cmd_debug(int argc, char* argv[]);
+void cmd_nodebug(int argc, char* argv[]);
+void send_cal_type() {
+  pi_link.println("3D");
+}
+void block_v() {
+  set_block_vertical(true);
+}
+void block_h() {
+  set_block_vertical(false);
+}
+
+const Command commands[] = {
+  {"m_calibration", NULL, cmd_m_calibration},
+  {"B_mag", NULL, cmd_B_mag},
+  {"cal_type", send_cal_type, NULL},
+  {"block_v", block_v, NULL},
+  {"block_h", block_h, NULL},
+  {"a_calibration_h", read_horizontal_accel, NULL},
+  {"a_calibration_v", read_vertical_accel, NULL},
+  {"set_a_calibration", NULL, cmd_set_a_calibration},
+  {"export_a_calibration", export_a_calibration, NULL},
+  {"print_a_cal", print_a_cal, NULL},
+  {"analysis_carousel", print_carousel_data, NULL},
+  {"samples", SendSamples, NULL},
+  {"ellipse", SendEllipse, NULL},
+  {"show_m_cal", printIrons, NULL},
+  {"m_cal_bench", m_calibrate_bench, NULL},
+  {"mag_stats", mag_stats, NULL},
+  {"acc_stats", acc_stats, NULL},
+  {"i2c_stats", print_i2c_stats, NULL},
+  {"sched_stats", print_sched_stats, NULL},
+  {"profile", print_profile, NULL},
+  {"telemetry", NULL, cmd_telemetry},
+  {"baud", NULL, cmd_baud},
+  {"link_stats", print_link_stats, NULL},
+  {"stream", NULL, stream_command},
+  {"tsync", NULL, tsync_command},
+  {"tsync_stats", print_tsync, NULL},
+  {"predict", NULL, predict_command},
+  {"motion", NULL, motion_command},
+  {"heading", NULL, heading_command},
+  {"fusion_bench", NULL, fusion_bench},
+  {"debug", NULL, cmd_debug},            // valid debugs: MAG_CAL, MAG_RAW, UNTILT, ALT_ACC, ALTAZ, JOYSTICK, ALL
+  {"nodebug", NULL, cmd_nodebug},
+};
 
-void processCommand(String command) {
-  Serial.println(command);
-  if(command.startsWith("m_calibration")) {
-    if(!m_calib_complete) {
-      start_mag_calibration(command);
-    }
-  } else if(command.startsWith("B_mag")) {
-    set_bmag(command);
-  } else if(command=="cal_type") {
-    Serial1.println("3D");
-  } else if(command=="block_v") {
-    sensor_block_vertical = true;
-  } else if(command=="block_h") {
-    sensor_block_vertical = false;
-  } else if(command=="a_calibration_h") {
-    read_horizontal_accel();
-  } else if(command=="a_calibration_v") {
-    read_vertical_accel();
-  } else if(command.startsWith("set_a_calibration")) {
-    parse_acc_calibration(command);
-  } else if(command=="export_a_calibration") {
-    export_a_calibration();
-  } else if(command=="print_a_cal") {
-    print_a_cal();
-  } else if(command=="analysis_carousel") {
-    print_carousel_data();
-  } else if(command=="samples") {
-    SendSamples();
-  } else if(command=="ellipse") {
-    SendEllipse();    
-  } else if(command=="show_m_cal") {
-    printIrons();
-  } else if(command.startsWith("debug")) {  // valid debugs: MAG_CAL, MAG_RAW, UNTILT, ALT_ACC, ALTAZ, JOYSTICK, ALL
-    debug_on(command);
-  } else if(command.startsWith("nodebug")) {
-    debug_off(command);
-  } else {
-    Serial.println(command);Serial.println("To Serial: UNRECOGNIZED COMMAND");
-    Serial1.print("To Serial1: UNRECOGNIZED COMMAND ");Serial.println(command);
+// returns true if the command was recognised
+bool processCommand(char* line) {
+  Serial.println(line);
+  char* argv[CMD_MAX_ARGS];
+  int argc = tokenize(line, argv, CMD_MAX_ARGS);
+  if(!argc) {
+    return false;
+  }
+  if(!dispatch(commands, sizeof(commands) / sizeof(commands[0]), argc, argv)) {
+    Serial.println(argv[0]);Serial.println("To Serial: UNRECOGNIZED COMMAND");
+    pi_link.print("To Serial1: UNRECOGNIZED COMMAND ");pi_link.println(argv[0]);
+    return false;
   }
+  return true;
 }
 
+LineAssembler console_line;
+LineAssembler raspberry_line;
+
 // RECEIVES COMMANDS FROM CONSOLE - used during develoment and testing
 // Tipically commands to start calibrations or to turn on/off debugging
 void checkSerial(){
-  if(!Serial.available()){
-    return;
-  } else {
-    String command = Serial.readStringUntil('\n');
-    processCommand(command);
+  if(line_poll(Serial, &console_line)) {
+    processCommand(console_line.buf);
   }
 }
 
 // RECEIVES COMMANDS FROM RASPBERRY
 // Tipically commands to start calibrations
 void checkSerial1(){
-  if(!Serial1.available()){
-    return;
-  } else {
-    String command = Serial1.readStringUntil('\n');
-    processCommand(command);
+  PROFILE_SCOPE(PROF_CHECK_SERIAL1);
+  if(line_poll(Serial1, &raspberry_line) && processCommand(raspberry_line.buf)) {
+    link_received();
   }
+  link_watchdog();      // a line garbled by a baud mismatch is not recognised
 }
 
-void debug_on(String msg) {
-    String values = msg.substring(6, msg.length());    // extract second word, which is values to turn debugging on, from command string
-    if(values == "mag_raw")
-        debug |= DEBUG_MAG_RAW;
-    if(values == "mag_cal")
-        debug |= DEBUG_MAG_CAL;
-    if(values == "untilt")
-        debug |= DEBUG_UNTILT_ACC;
-    if(values == "alt_acc")
-        debug |= DEBUG_ALT_ACC;
-    if(values == "alt")
-        debug |= DEBUG_ALT;
-    if(values == "az")
-        debug |= DEBUG_AZ;
-    if(values == "joystick")
-        debug |= DEBUG_JOYSTICK;
-    if(values == "all")
-        debug = 255;
+struct DebugFlag {
+  const char* name;
+  uint8_t mask;
+};
+
+const DebugFlag debug_flags[] = {
+  {"mag_raw", DEBUG_MAG_RAW},
+  {"mag_cal", DEBUG_MAG_CAL},
+  {"untilt", DEBUG_UNTILT_ACC},
+  {"alt_acc", DEBUG_ALT_ACC},
+  {"alt", DEBUG_ALT},
+  {"az", DEBUG_AZ},
+  {"joystick", DEBUG_JOYSTICK},
+  {"all", 255},
+};
+
+// mask of the debug named in the second word of the command, 0 if unknown
+uint8_t debug_mask(int argc, char* argv[]) {
+  if(argc < 2) {
+    return 0;
+  }
+  for(unsigned int i = 0; i < sizeof(debug_flags) / sizeof(debug_flags[0]); i++) {
+    if(!strcmp(debug_flags[i].name, argv[1])) {
+      return debug_flags[i].mask;
+    }
+  }
+  return 0;
+}
+
+void cmd_debug(int argc, char* argv[]) {
+    debug |= debug_mask(argc, argv);
     Serial.print("Debug: ");Serial.println(debug);
 }
 
-void debug_off(String msg) {
-    String values = msg.substring(8, msg.length());    // extract second word, which is values to turn debugging on, from command string
-    if(values == "mag_raw")
-        debug &= ~DEBUG_MAG_RAW;
-    if(values == "mag_cal")
-        debug &= ~DEBUG_MAG_CAL;
-    if(values == "untilt")
-        debug &= ~DEBUG_UNTILT_ACC;
-    if(values == "alt_acc")
-        debug &= ~DEBUG_ALT_ACC;
-    if(values == "alt")
-        debug &= ~DEBUG_ALT;
-    if(values == "az")
-        debug &= ~DEBUG_AZ;
-    if(values == "joystick")
-        debug &= ~DEBUG_JOYSTICK;
-    if(values == "all")
-        debug = 0;
+void cmd_nodebug(int argc, char* argv[]) {
+    debug &= ~debug_mask(argc, argv);
     Serial.print("Debug: ");Serial.println(debug);
 }
 
-void start_mag_calibration(String msg) {
+/*
+ * m_calibration <seconds>
+ */
+void cmd_m_calibration(int argc, char* argv[]) {
+  if(m_calib_complete) {
+    return;
+  }
   m_calib_on = true;
-  // NOTE: substring below from X, where X is the length (base 1) of the 1st word of command: m_calibration
-  String seconds = msg.substring(13, msg.length());    // extract second word, which is duration in seconds, from command string
-  int duration_in_seconds = seconds.toInt();
+  int duration_in_seconds = argc > 1 ? atoi(argv[1]) : 0;
   magCalLoopInterval_mus = init_cal(duration_in_seconds * 1000)*1000; // result in milliseconds for 1000 calibration readings. converted to µseconds
 }
 
+/*
+ * B_mag <nT>
+ */
+void cmd_B_mag(int argc, char* argv[]) {
+  if(argc > 1) {
+    set_bmag(atof(argv[1]));
+  }
+}
+
+/*
+ * Telemetry handshake, see telemetry.h:
+ *    telemetry binary [hz]   binary SENSORS frames, at hz (1-100, default 10), the altaz stream rate
+ *    telemetry text          SENSORS text line at 10 Hz
+ */
+void cmd_telemetry(int argc, char* argv[]) {
+  if(argc > 1 && !strcmp(argv[1], "binary")) {
+    int hz = argc > 2 ? constrain(atoi(argv[2]), 1, STREAM_MAX_HZ) : 1000000 / outputLoopInterval_mus;
+    telemetry_binary = true;
+    stream_rate("altaz", hz);
+    pi_link.print("TELEMETRY, BINARY, ");pi_link.println(hz);
+  } else {
+    telemetry_binary = false;
+    stream_rate("altaz", 1000000 / outputLoopInterval_mus);
+    pi_link.println("TELEMETRY, TEXT");
+  }
+}
+
+/*
+ * baud <rate>, see link.h
+ */
+void cmd_baud(int argc, char* argv[]) {
+  link_set_baud(argc > 1 ? strtoul(argv[1], NULL, 10) : 0);
+}
+
 /*
  * Receives from Raspberry the last accel calibration saved
  * parses it and saves it making it unnecessary to calibrate
  * again the accelerometer.
+ *    set_a_calibration,ox,gx,oz,gz
  */
-void parse_acc_calibration(String msg) {
-  float ox = 0;
-  float oz = 0;
-  float gx = 1;
-  float gz = 1;
-  int ParCount = 0;
-  String pars[4];
-  String a_cal_pars = msg.substring(18, msg.length());
-  while(ParCount < 4){
-    int idx = a_cal_pars.indexOf(',');
-    if(idx == -1) {
-      pars[ParCount] = a_cal_pars;
-      break;
-    } else {
-      pars[ParCount++] = a_cal_pars.substring(0, idx);
-      a_cal_pars = a_cal_pars.substring(idx+1);
-    }
-  }
-  ox = pars[0].toFloat();
-  gx = pars[1].toFloat();
-  oz = pars[2].toFloat();
-  gz = pars[3].toFloat();
+void cmd_set_a_calibration(int argc, char* argv[]) {
+  float ox = argc > 1 ? atof(argv[1]) : 0;
+  float gx = argc > 2 ? atof(argv[2]) : 1;
+  float oz = argc > 3 ? atof(argv[3]) : 0;
+  float gz = argc > 4 ? atof(argv[4]) : 1;
   Serial.print("OX: ");Serial.print(ox);Serial.print("\tGX: ");Serial.print(gx);Serial.print("\tOZ: ");Serial.print(oz);Serial.print("\tGZ: ");Serial.println(gz);
   set_a_calibration(ox, gx, oz, gz);
   Serial.println("Acc calibration saved");
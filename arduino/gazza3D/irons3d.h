@@ -167,14 +167,51 @@ void refine_3D_fit(Vector3d& gain, Matrix3d& rotM) {
     }
 }
 
-void ellipsoid_fit(vector<vector<double>>& mag, vector<vector<double>>& MAT, vector<double>& CENTER) {
-    size_t N = mag.size();
+/*
+ * Streaming fit
+ * the least squares system of the fit only needs the 9x9 normal matrix D*D' and the 9-vector D*d2,
+ * where each sample adds a column to D and an element to d2. They are accumulated as the samples
+ * arrive, so the samples are not stored and the fit can be solved at any time, in constant memory.
+ */
+struct EllipsoidFit {
+    Matrix<double, 9, 9> DDt;   // D*D', lower triangle only
+    Matrix<double, 9, 1> Dd2;   // D*d2
+    long n;                     // samples accumulated
+};
+
+void ellipsoid_fit_reset(EllipsoidFit& fit) {
+    fit.DDt.setZero();
+    fit.Dd2.setZero();
+    fit.n = 0;
+}
+
+void ellipsoid_fit_add(EllipsoidFit& fit, double x, double y, double z) {
+    Matrix<double, 9, 1> d;
+    double x_sq = x * x;
+    double y_sq = y * y;
+    double z_sq = z * z;
+    d << x_sq + y_sq - 2 * z_sq,
+         x_sq + z_sq - 2 * y_sq,
+         2 * x * y,
+         2 * x * z,
+         2 * y * z,
+         2 * x,
+         2 * y,
+         2 * z,
+         1;
+    fit.DDt.selfadjointView<Lower>().rankUpdate(d);
+    fit.Dd2 += d * (x_sq + y_sq + z_sq);
+    fit.n++;
+}
+
+/*
+ * solves the fit from the accumulated sums, returns false if there are not enough samples yet
+ */
+bool ellipsoid_fit_solve(EllipsoidFit& fit, vector<vector<double>>& MAT, vector<double>& CENTER) {
     Vector3d center;
     Vector3d radii;
     Vector3d evals;
     Matrix3d evecs;
-    MatrixXd D(9, N);
-    VectorXd d2(N);
     double a, b, c;
     VectorXd u(9);
     VectorXd v(10);
@@ -186,32 +223,10 @@ void ellipsoid_fit(vector<vector<double>>& mag, vector<vector<double>>& MAT, vec
     Matrix3d dd;
     Matrix3d emat;
 
-    VectorXd x(N);  // input points x-values
-    VectorXd y(N);  // input points y-values
-    VectorXd z(N);  // input points z-values
-    for(size_t k=0;k<N; k++){
-        x(k) = mag[k][0];
-        y(k) = mag[k][1];
-        z(k) = mag[k][2];
+    if(fit.n < 9) {
+        return false;
     }
-
-    VectorXd x_sq = x.cwiseProduct(x).eval();
-    VectorXd y_sq = y.cwiseProduct(y).eval();
-    VectorXd z_sq = z.cwiseProduct(z).eval();
-
-    D.row(0) = x_sq + y_sq - 2 * z_sq;
-    D.row(1) = x_sq + z_sq - 2 * y_sq;
-    D.row(2) = 2 * x.cwiseProduct(y);
-    D.row(3) = 2 * x.cwiseProduct(z);
-    D.row(4) = 2 * y.cwiseProduct(z);
-    D.row(5) = 2 * x;
-    D.row(6) = 2 * y;
-    D.row(7) = 2 * z;
-    D.row(8) = Eigen::VectorXd::Ones(N);
-    
-    d2 = x_sq + y_sq + z_sq;
-
-    u = (D * D.transpose()).ldlt().solve(D * d2);
+    u = fit.DDt.ldlt().solve(fit.Dd2);   // LDLT reads the lower triangle only
 
     a = u.coeff(0) + u.coeff(1) - 1;
     b = u.coeff(0) - 2 * u.coeff(1) - 1;
@@ -267,4 +282,17 @@ void ellipsoid_fit(vector<vector<double>>& mag, vector<vector<double>>& MAT, vec
     CENTER[0] = center(0);
     CENTER[1] = center(1);
     CENTER[2] = center(2);
+    return true;
+}
+
+/*
+ * batch version, e.g. for samples collected elsewhere
+ */
+void ellipsoid_fit(vector<vector<double>>& mag, vector<vector<double>>& MAT, vector<double>& CENTER) {
+    EllipsoidFit fit;
+    ellipsoid_fit_reset(fit);
+    for(size_t k = 0; k < mag.size(); k++) {
+        ellipsoid_fit_add(fit, mag[k][0], mag[k][1], mag[k][2]);
+    }
+    ellipsoid_fit_solve(fit, MAT, CENTER);
 }
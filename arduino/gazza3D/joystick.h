@@ -6,7 +6,9 @@
  * Released under GPLv3 License - see LICENSE file for details.
  ******/
 
+#include "link.h"
 #include "defines.h"
+#include "profiler.h"
 
 #define JOYSTICK_X A0
 #define JOYSTICK_Y A1
@@ -82,12 +84,13 @@ String handleJoystick(){
 }
 
 void checkJoystick(uint8_t debug){
+  PROFILE_SCOPE(PROF_CHECK_JOYSTICK);
   String j_out = handleJoystick();
   if((j_out != "") && (p_j_out != j_out)){
     if((uint8_t)(debug | ~DEBUG_JOYSTICK)==255) {
       Serial.println("JOYSTICK"+j_out);
     }
-    Serial1.println("JOYSTICK"+j_out);
+    pi_link.println("JOYSTICK"+j_out);
     p_j_out = j_out;
   }
 };
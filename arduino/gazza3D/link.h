@@ -0,0 +1,222 @@
+/******
+ * Link to the Raspberry: Serial1 (LPUART6) with DMA transmission
+ *
+ * Everything sent to the Raspberry is copied into a ring buffer and never waits for the UART: an eDMA channel,
+ * triggered by the LPUART transmit requests, sends the ring one contiguous chunk at a time, the completion
+ * interrupt starts the next one. A message not fitting the free space is dropped whole, so frames and lines
+ * are never truncated, nor glued to the next one:
+ *    pi_link       text, a Print: the prints of a line are collected up to its end (the newline of println),
+ *                  then the line is queued in a single write
+ *    link_frames   binary frames, a Print too, queued one write() per frame
+ * The reception is left to the core Serial1 driver.
+ *
+ * The baud rate is negotiated by the raspberry with the command
+ *    baud <rate>
+ * the teensy answers "BAUD, <rate>" at the current rate, waits for the transmission to end and switches.
+ * If no command is recognised for LINK_RX_TIMEOUT_MUS the rate goes back to LINK_BAUD_DEFAULT: the raspberry
+ * restarted at the default rate, or lost the switch, and resends baud (it sends tsync every 2 s).
+ *
+ * Released under GPLv3 License - see LICENSE file for details.
+ ******/
+
+#ifndef PI_LINK
+#define PI_LINK
+
+#include <DMAChannel.h>
+
+#define LINK_BAUD_DEFAULT 115200
+#define LINK_BAUD_MAX 2000000        // the PL011 of the raspberry runs up to 4 Mbaud with a 48 MHz UART clock
+#define LINK_TX_RING 4096            // power of two
+#define LINK_LINE_LEN 256            // longest text line, a longer one is dropped
+#define LINK_DRAIN_MARGIN 1.25       // drain timeout over the time to send a full ring, see link_drain()
+#define LINK_RX_TIMEOUT_MUS 5000000
+
+// in DTCM: reachable by the eDMA and not cached, no cache maintenance needed before a transfer
+uint8_t link_tx_ring[LINK_TX_RING];
+volatile uint32_t link_head = 0;     // free running indexes
+volatile uint32_t link_tail = 0;
+volatile uint32_t link_dma_len = 0;  // bytes of the transfer in progress, 0 if idle
+uint32_t link_high_water = 0;
+uint32_t link_drops = 0;             // messages dropped
+uint32_t link_dropped_bytes = 0;
+uint8_t link_line[LINK_LINE_LEN];    // text line being printed
+size_t link_line_len = 0;            // above LINK_LINE_LEN if the line is too long
+unsigned long link_baud = LINK_BAUD_DEFAULT;
+unsigned long link_rx_mus = 0;       // last command recognised from the raspberry
+DMAChannel link_dma;
+
+// starts the transfer of the contiguous chunk at the tail, if the channel is idle. Interrupts disabled
+void link_kick() {
+  if(link_dma_len || link_head == link_tail) {
+    return;
+  }
+  uint32_t start = link_tail & (LINK_TX_RING - 1);
+  uint32_t len = min(link_head - link_tail, (uint32_t)LINK_TX_RING - start);
+  link_dma_len = len;
+  link_dma.sourceBuffer(link_tx_ring + start, len);
+  link_dma.enable();
+}
+
+void link_dma_isr() {
+  link_dma.clearInterrupt();
+  link_tail += link_dma_len;
+  link_dma_len = 0;
+  link_kick();
+  asm("dsb");
+}
+
+size_t link_write(const uint8_t* data, size_t len) {
+  uint32_t queued = link_head - link_tail;
+  if(len > LINK_TX_RING - queued) {
+    link_drops++;
+    link_dropped_bytes += len;
+    return 0;
+  }
+  uint32_t start = link_head & (LINK_TX_RING - 1);
+  size_t first = min(len, (size_t)(LINK_TX_RING - start));
+  memcpy(link_tx_ring + start, data, first);
+  memcpy(link_tx_ring, data + first, len - first);
+  link_head += len;
+  link_high_water = max(link_high_water, (uint32_t)(queued + len));
+  noInterrupts();
+  link_kick();
+  interrupts();
+  return len;
+}
+
+/*
+ * a text line ends: queued or dropped whole. Returns false if dropped
+ */
+bool link_line_end() {
+  size_t len = link_line_len;
+  link_line_len = 0;
+  if(len > LINK_LINE_LEN) {
+    link_drops++;
+    link_dropped_bytes += len;
+    return false;
+  }
+  return link_write(link_line, len) == len;
+}
+
+// text, see above. A write ending a line that is dropped returns 0
+class PiLink: public Print {
+  public:
+    virtual size_t write(uint8_t b) {
+      return write(&b, 1);
+    }
+    virtual size_t write(const uint8_t* buffer, size_t size) {
+      size_t written = size;
+      for(size_t i = 0; i < size; i++) {
+        if(link_line_len < LINK_LINE_LEN) {
+          link_line[link_line_len] = buffer[i];
+        }
+        link_line_len++;
+        if(buffer[i] == '\n' && !link_line_end()) {
+          written = 0;
+        }
+      }
+      return written;
+    }
+    using Print::write;
+};
+
+// binary frames, see above
+class LinkFrames: public Print {
+  public:
+    virtual size_t write(uint8_t b) {
+      return link_write(&b, 1);
+    }
+    virtual size_t write(const uint8_t* buffer, size_t size) {
+      return link_write(buffer, size);
+    }
+    using Print::write;
+};
+
+PiLink pi_link;
+LinkFrames link_frames;
+
+void link_uart_begin(unsigned long baud) {
+  Serial1.begin(baud);
+  LPUART6_BAUD |= LPUART_BAUD_TDMAE;   // transmit requests to the DMA, begin() resets the register
+}
+
+void link_begin() {
+  link_dma.destination(*(volatile uint8_t*)&LPUART6_DATA);
+  link_dma.triggerAtHardwareEvent(DMAMUX_SOURCE_LPUART6_TX);
+  link_dma.interruptAtCompletion();
+  link_dma.disableOnCompletion();
+  link_dma.attachInterrupt(link_dma_isr);
+  link_uart_begin(link_baud);
+}
+
+/*
+ * stops the transfer in progress, if any, and discards the bytes still queued
+ */
+void link_stop() {
+  noInterrupts();
+  link_dma.disable();
+  link_dma.clearInterrupt();
+  link_dropped_bytes += link_head - link_tail;
+  link_tail = link_head;
+  link_dma_len = 0;
+  interrupts();
+}
+
+/*
+ * waits, bounded, for the ring and the UART to be empty, then stops the DMA: the UART can be reinitialised.
+ * The bound is the time to send a full ring at the current rate (10 bits a byte), with a margin: 444 ms at 115200
+ */
+void link_drain() {
+  unsigned long timeout = LINK_DRAIN_MARGIN * LINK_TX_RING * 10 * 1e6 / link_baud;
+  unsigned long start = micros();
+  while((link_head != link_tail || !(LPUART6_STAT & LPUART_STAT_TC)) && micros() - start < timeout) {
+  }
+  link_stop();
+}
+
+void link_set_baud(unsigned long baud) {
+  if(baud < 9600 || baud > LINK_BAUD_MAX) {
+    pi_link.print("BAUD, ");pi_link.println(link_baud);  // refused, stays at the current rate
+    return;
+  }
+  pi_link.print("BAUD, ");pi_link.println(baud);
+  link_drain();
+  link_baud = baud;
+  link_uart_begin(link_baud);
+  link_rx_mus = micros();
+}
+
+// a command from the raspberry was recognised
+void link_received() {
+  link_rx_mus = micros();
+}
+
+/*
+ * back to LINK_BAUD_DEFAULT when the raspberry has been silent too long at another rate
+ */
+void link_watchdog() {
+  if(link_baud == LINK_BAUD_DEFAULT || micros() - link_rx_mus < LINK_RX_TIMEOUT_MUS) {
+    return;
+  }
+  link_stop();      // nobody is listening at this rate
+  link_baud = LINK_BAUD_DEFAULT;
+  link_uart_begin(link_baud);
+  Serial.print("LINK, BAUD, ");Serial.print(link_baud);Serial.println(", no command received");
+}
+
+/*
+ * Prints the baud rate, the bytes queued, the high water mark and the messages dropped since the previous report
+ */
+void print_link_stats() {
+  Serial.print("LINK, BAUD, ");Serial.print(link_baud);
+  Serial.print(", QUEUED, ");Serial.print(link_head - link_tail);
+  Serial.print(", HIGH_WATER, ");Serial.print(link_high_water);
+  Serial.print(", SIZE, ");Serial.print(LINK_TX_RING);
+  Serial.print(", DROPS, ");Serial.print(link_drops);
+  Serial.print(", DROPPED_BYTES, ");Serial.println(link_dropped_bytes);
+  link_high_water = link_head - link_tail;
+  link_drops = 0;
+  link_dropped_bytes = 0;
+}
+
+#endif
@@ -20,20 +20,32 @@
 #include "irons3d.h"
 #include <vector>
 #include "defines.h"
+#include "profiler.h"
 //#include "untilter.h"
 //#include "untilt_functions.h"
 
 #define SAMPLES 1000  // 500
 #define NUMBEROFAXIS 3
+#define CAL_KEEP_SAMPLES 0   // 1: keep the samples for the offline analysis commands (samples, analysis_carousel)
 
 /********** PARAMETERS FOR 3D CALIBRATION ***************/
 vector<vector<double>> cal_3d_mat = {{1,0,0}, {0,1,0}, {0,0,1}};;
 vector<double> cal_3d_center = {0,0,0};
+// the fit above compiled for the per sample correction: mag = M * raw - offset, where offset = M * center
+float cal_M[9] = {1, 0, 0,
+                  0, 1, 0,
+                  0, 0, 1};
+float cal_offset[3] = {0, 0, 0};
+// cal_M * mag_frame: from the chip axes to the calibrated frame in one multiply, see sensors.h
+float mag_A[9] = {1, 0, 0,
+                  0, 1, 0,
+                  0, 0, 1};
 
 /********** ELLIPSE STUFF FOR PLANAR CALIBRATION ********/
-vector<vector<double>> mag_samples(SAMPLES, vector<double>(3));
-vector<vector<double>> acc_samples(SAMPLES, vector<double>(3));
-vector<vector<double>> orig_mag_samples(SAMPLES, vector<double>(3));
+EllipsoidFit mag_fit;    // the samples are accumulated in the fit as they arrive, see irons3d.h
+#if CAL_KEEP_SAMPLES
+float cal_samples[SAMPLES][6];   // mag and acc, a single block
+#endif
 int last_entry = 0;
 
 double alfa = 0;              // ellipse -  x axis
@@ -47,8 +59,32 @@ double phi, a_axis, b_axis;
 void printIrons();
 void SendEllipse();
 
+/*
+ * Compiles cal_3d_mat/cal_3d_center into cal_M/cal_offset and composes mag_A.
+ * To be called every time the fit or mag_frame changes.
+ * The matrix is symmetric, as in calibrate(), only its upper triangle is read
+ */
+void compile_m_calibration() {
+    for(int r = 0; r < 3; r++) {
+        for(int c = 0; c < 3; c++) {
+            cal_M[3*r + c] = (float)(r <= c ? cal_3d_mat[r][c] : cal_3d_mat[c][r]);
+        }
+    }
+    for(int r = 0; r < 3; r++) {
+        cal_offset[r] = cal_M[3*r]   * (float)cal_3d_center[0]
+                      + cal_M[3*r+1] * (float)cal_3d_center[1]
+                      + cal_M[3*r+2] * (float)cal_3d_center[2];
+    }
+    for(int r = 0; r < 3; r++) {
+        for(int c = 0; c < 3; c++) {
+            mag_A[3*r + c] = cal_M[3*r] * mag_frame[c] + cal_M[3*r+1] * mag_frame[3+c] + cal_M[3*r+2] * mag_frame[6+c];
+        }
+    }
+}
+
 long init_cal(int duration) {
     last_entry = 0;
+    ellipsoid_fit_reset(mag_fit);
     return (long)(duration / SAMPLES);
 }
 
@@ -58,29 +94,72 @@ long init_cal(int duration) {
  */
 int add_sample(float *mag, float *acc, uint8_t debug) {
   if(last_entry < SAMPLES) {
-      orig_mag_samples[last_entry][0] = mag[0];
-      orig_mag_samples[last_entry][1] = mag[1];
-      orig_mag_samples[last_entry][2] = mag[2];
-      mag_samples[last_entry][0] = mag[0];
-      mag_samples[last_entry][1] = mag[1];
-      mag_samples[last_entry][2] = mag[2];
-      acc_samples[last_entry][0] = acc[0];
-      acc_samples[last_entry][1] = acc[1];
-      acc_samples[last_entry][2] = acc[2];
+      float s[3];
+      mat3_mul(mag_frame, mag, s);   // the fit is done in the rotated, B scaled frame
+      ellipsoid_fit_add(mag_fit, s[0], s[1], s[2]);
+#if CAL_KEEP_SAMPLES
+      for(int i = 0; i < 3; i++) {
+          cal_samples[last_entry][i] = s[i];
+          cal_samples[last_entry][i + 3] = acc[i];
+      }
+#endif
       last_entry++;
       return SAMPLES - last_entry +1;
   } else {
-      ellipsoid_fit(mag_samples, cal_3d_mat, cal_3d_center);
+      if(ellipsoid_fit_solve(mag_fit, cal_3d_mat, cal_3d_center)) {
+          compile_m_calibration();
+      }
       return 0;
   }
 }
 
-void m_calibrate(float *mag, float *acc, uint8_t debug) {
-    vector<double> vmag = {mag[0], mag[1], mag[2]};
-    vector<double> calibrated = calibrate(vmag, cal_3d_mat, cal_3d_center);
-    mag[0] = (float)calibrated[0];
-    mag[1] = (float)calibrated[1];
-    mag[2] = (float)calibrated[2];
+/*
+ * Axes remap, rotation, B scaling, hard and soft iron correction of a chip axes sample:
+ * 9 multiply-adds on single precision floats, no allocation
+ */
+inline void m_calibrate(float *mag, float *acc, uint8_t debug) {
+    PROFILE_SCOPE(PROF_M_CALIBRATE);
+    float x = mag[0];
+    float y = mag[1];
+    float z = mag[2];
+    mag[0] = mag_A[0]*x + mag_A[1]*y + mag_A[2]*z - cal_offset[0];
+    mag[1] = mag_A[3]*x + mag_A[4]*y + mag_A[5]*z - cal_offset[1];
+    mag[2] = mag_A[6]*x + mag_A[7]*y + mag_A[8]*z - cal_offset[2];
+}
+
+/*
+ * Compares, in CPU cycles, the correction above with the stages it replaces:
+ * axes remap, rotation, B scaling and calibrate() of irons3d.h
+ */
+void m_calibrate_bench() {
+    const int N = 1000;
+    float s[3] = {0.3, -0.2, 0.9};
+    float check_new[3] = {0, 0, 0};
+    double check_old[3] = {0, 0, 0};
+    uint32_t t0 = ARM_DWT_CYCCNT;
+    for(int i = 0; i < N; i++) {
+        float r[3] = {s[0], s[1], s[2]};
+        mag_sensor.axes(r);
+        rotate(r);
+        r[0] /= B;r[1] /= B;r[2] /= B;
+        vector<double> vmag = {r[0], r[1], r[2]};
+        vector<double> calibrated = calibrate(vmag, cal_3d_mat, cal_3d_center);
+        check_old[0] += calibrated[0];check_old[1] += calibrated[1];check_old[2] += calibrated[2];
+    }
+    uint32_t t1 = ARM_DWT_CYCCNT;
+    for(int i = 0; i < N; i++) {
+        float m[3] = {s[0], s[1], s[2]};
+        m_calibrate(m, NULL, false);
+        check_new[0] += m[0];check_new[1] += m[1];check_new[2] += m[2];
+    }
+    uint32_t t2 = ARM_DWT_CYCCNT;
+    Serial.print("calibrate() cycles/sample: ");Serial.println((float)(t1 - t0) / N);
+    Serial.print("m_calibrate() cycles/sample: ");Serial.println((float)(t2 - t1) / N);
+    Serial.print("check ");
+    for(int i = 0; i < 3; i++) {
+        Serial.print(check_old[i] / N, 5);Serial.print("/");Serial.print(check_new[i] / N, 5);Serial.print(" ");
+    }
+    Serial.println();
 }
 
 // FUNCTIONS FOR OFFLINE ANALYSIS
@@ -104,10 +183,14 @@ void printIrons() {
 
 
 void SendSamples() {
+#if CAL_KEEP_SAMPLES
     for(int i=0; i<SAMPLES; i++){
-        Serial.print("MAG_SAMPLE,");Serial.print(mag_samples[i][0]);Serial.print(",");Serial.println(mag_samples[i][1]);
-        Serial.print("ACC_SAMPLE,");Serial.print(acc_samples[i][0]);Serial.print(",");Serial.println(acc_samples[i][1]);
+        Serial.print("MAG_SAMPLE,");Serial.print(cal_samples[i][0]);Serial.print(",");Serial.println(cal_samples[i][1]);
+        Serial.print("ACC_SAMPLE,");Serial.print(cal_samples[i][3]);Serial.print(",");Serial.println(cal_samples[i][4]);
     }
+#else
+    Serial.println("Samples not kept, set CAL_KEEP_SAMPLES");
+#endif
     Serial.println("END,");
 }
 
@@ -121,23 +204,23 @@ void SendEllipse(){
 }
 
 void print_carousel_data() {
+#if CAL_KEEP_SAMPLES
     for(int i=0; i<SAMPLES; i++){
         // samples = uncalibrated carousel, samp = calibrated
         Serial.print("CAROUSEL,");
-        Serial.print(mag_samples[i][0],4);Serial.print(",");Serial.print(mag_samples[i][1],4);Serial.print(",");Serial.print(mag_samples[i][2],4);Serial.print(",");
-        Serial.print(acc_samples[i][0],4);Serial.print(",");Serial.print(acc_samples[i][1],4);Serial.print(",");Serial.print(acc_samples[i][2],4);Serial.print(",");
+        Serial.print(cal_samples[i][0],4);Serial.print(",");Serial.print(cal_samples[i][1],4);Serial.print(",");Serial.print(cal_samples[i][2],4);Serial.print(",");
+        Serial.print(cal_samples[i][3],4);Serial.print(",");Serial.print(cal_samples[i][4],4);Serial.print(",");Serial.print(cal_samples[i][5],4);Serial.print(",");
         float s[3];
-        s[0] = (float)mag_samples[i][0];
-        s[1] = (float)mag_samples[i][1];
-        s[2] = (float)mag_samples[i][2];
-        float a[3];
-        a[0] = (float)acc_samples[i][0];
-        a[1] = (float)acc_samples[i][1];
-        a[2] = (float)acc_samples[i][2];
-        m_calibrate(s, a, false);
+        mat3_mul(cal_M, cal_samples[i], s);   // samples are kept in the calibration frame
+        s[0] -= cal_offset[0];
+        s[1] -= cal_offset[1];
+        s[2] -= cal_offset[2];
         Serial.print(s[0],4);Serial.print(",");Serial.print(s[1],4);Serial.print(",");Serial.print(s[2],4);Serial.print(",");
-        Serial.print(orig_mag_samples[i][0],4);Serial.print(",");Serial.print(orig_mag_samples[i][1],4);Serial.print(",");Serial.print(orig_mag_samples[i][2],4);
+        Serial.print(cal_samples[i][0],4);Serial.print(",");Serial.print(cal_samples[i][1],4);Serial.print(",");Serial.print(cal_samples[i][2],4);
         Serial.println();
     }
+#else
+    Serial.println("Samples not kept, set CAL_KEEP_SAMPLES");
+#endif
     Serial.println("END");
 }
@@ -0,0 +1,92 @@
+/******
+ * Motion state and adaptive filter gains
+ *
+ * The kalman constants trade slew responsiveness against tracking smoothness. The gyro tells which one is
+ * needed: its rate, bias removed (predict.h) and low passed, classifies the telescope as
+ *    MOTION_IDLE       still
+ *    MOTION_TRACKING   sidereal tracking and small corrections
+ *    MOTION_SLEWING    above MOTION_SLEW_DPS, until it drops below MOTION_SLEW_EXIT_DPS
+ * Idle and tracking keep the tuned filters, the heavy smoothing. Slewing multiplies the process noise of the
+ * azimuth, altitude and sensor filters by MOTION_SLEW_NOISE: higher gains, lower latency.
+ * The multiplier is blended in and out (quickly at the start of a slew, slowly at its end) and the filters keep
+ * their estimates, so a change of profile makes no step in azimuth and altitude.
+ * The state is sent in the SENSORS message (telemetry.h).
+ * Command:
+ *    motion <0|1>      turns the adaptive gains off/on, on by default. Prints the state
+ *
+ * Released under GPLv3 License - see LICENSE file for details.
+ ******/
+
+#ifndef MOTION
+#define MOTION
+
+#define MOTION_IDLE 0
+#define MOTION_TRACKING 1
+#define MOTION_SLEWING 2
+
+#define MOTION_IDLE_DPS 0.02        // sidereal rate is 0.004 deg/s at most
+#define MOTION_SLEW_DPS 0.5
+#define MOTION_SLEW_EXIT_DPS 0.3
+#define MOTION_RATE_TAU_S 0.1       // low pass of the gyro rate, removes its noise
+#define MOTION_ATTACK_S 0.2         // blend time into the slewing profile
+#define MOTION_RELEASE_S 2.0        // and back to the smoothing one
+#define MOTION_SLEW_NOISE 20.0      // process noise multiplier of the slewing profile
+
+bool motion_on = true;
+uint8_t motion_state = MOTION_IDLE;
+float motion_rate = 0;              // deg/s, low passed
+float motion_blend = 0;             // 0 smoothing profile, 1 slewing profile
+unsigned long motion_last_mus = 0;
+
+void motion_apply() {
+  float scale = 1 + motion_blend * (MOTION_SLEW_NOISE - 1);
+  kf_azimuth.setNoiseScale(scale);
+  kf_altitude.setNoiseScale(scale);
+  acc_sensor.set_noise_scale(scale);
+  mag_sensor.set_noise_scale(scale);
+}
+
+/*
+ * to be called with each new gyro sample, deg/s, t_mus being its time
+ */
+void motion_update(float gyr[3], unsigned long t_mus) {
+  float dt = (t_mus - motion_last_mus) / 1e6;
+  motion_last_mus = t_mus;
+  if(dt <= 0 || dt > 1) {
+    return;         // first sample or after a pause
+  }
+  if(!gyr_bias_seeded) {
+    return;         // bias still being seeded (predict.h), the rate would be the bias
+  }
+  float w[3] = {gyr[0] - gyr_bias[0], gyr[1] - gyr_bias[1], gyr[2] - gyr_bias[2]};
+  motion_rate += (vector_mod(w) - motion_rate) * min(1.0f, dt / (float)MOTION_RATE_TAU_S);
+  if(motion_state == MOTION_SLEWING ? motion_rate > MOTION_SLEW_EXIT_DPS : motion_rate > MOTION_SLEW_DPS) {
+    motion_state = MOTION_SLEWING;
+  } else {
+    motion_state = motion_rate > MOTION_IDLE_DPS ? MOTION_TRACKING : MOTION_IDLE;
+  }
+  float target = motion_on && motion_state == MOTION_SLEWING ? 1 : 0;
+  if(motion_blend == target) {
+    return;
+  }
+  if(target > motion_blend) {
+    motion_blend = min(target, motion_blend + dt / (float)MOTION_ATTACK_S);
+  } else {
+    motion_blend = max(target, motion_blend - dt / (float)MOTION_RELEASE_S);
+  }
+  motion_apply();
+}
+
+/*
+ * motion command, see above
+ */
+void motion_command(int argc, char* argv[]) {
+  if(argc > 1) {
+    motion_on = atoi(argv[1]);
+  }
+  static const char* names[] = {"IDLE", "TRACKING", "SLEWING"};
+  Serial.print("MOTION, ");Serial.print(motion_on);Serial.print(", ");Serial.print(names[motion_state]);
+  Serial.print(", RATE, ");Serial.print(motion_rate, 4);Serial.print(", BLEND, ");Serial.println(motion_blend, 3);
+}
+
+#endif
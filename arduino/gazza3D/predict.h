@@ -0,0 +1,123 @@
+/******
+ * Gyro propagation of azimuth and altitude to the transmit time
+ *
+ * Azimuth and altitude are computed from the last accelerometer and magnetometer samples and then smoothed, so
+ * they are late when the telescope slews. The gyro gives the body rates at the same time: the gravity and the
+ * magnetic field, and the east and north vectors compass3D() builds from them, are fixed in the world, in the
+ * body frame they turn as dV/dt = V x w. Differentiating the azimuth and altitude formulas of compass.h gives
+ * their rates, and the SENSORS output moves the last azimuth and altitude forward to its own time.
+ *
+ * The gyro bias is seeded by the average of the gyro samples of the first PREDICT_SEED_S, the telescope being
+ * still at power on, whatever their rate: a bias above PREDICT_STILL_DPS would never be learnt otherwise.
+ * Afterwards it is learnt while the telescope is still (rates below PREDICT_STILL_DPS, sidereal tracking
+ * included), otherwise a still telescope would be reported drifting. Both are timed by the sample times, the gyro
+ * comes at the accelerometer task rate (FIFO batch means at 100 Hz, 500 Hz without the FIFO).
+ * Command:
+ *    predict <0|1>     turns the propagation off/on, on by default
+ *
+ * Released under GPLv3 License - see LICENSE file for details.
+ ******/
+
+#ifndef PREDICT
+#define PREDICT
+
+#define PREDICT_MAX_MUS 200000      // longest propagation, older samples are sent as they are
+#define PREDICT_STILL_DPS 0.1       // below this rate the gyro reading is taken as bias
+#define PREDICT_BIAS_TAU_S 0.5     // time constant of the bias learning
+#define PREDICT_SEED_S 1.0          // averaged into the seed
+
+bool predict_on = true;
+float gyr_bias[3] = {0, 0, 0};
+unsigned int gyr_bias_samples = 0;  // averaged into the seed
+float gyr_bias_seed_s = 0;          // seconds of samples in the seed
+bool gyr_bias_seeded = false;
+unsigned long predict_last_mus = 0;
+float az_rate = 0;                  // deg/s, at the last heading computation
+float alt_rate = 0;
+
+/*
+ * to be called with each new gyro sample, deg/s, t_mus being its time
+ */
+void predict_gyro(float gyr[3], unsigned long t_mus) {
+  float dt = (t_mus - predict_last_mus) / 1e6;
+  predict_last_mus = t_mus;
+  if(dt <= 0 || dt > 1) {
+    dt = 0;         // first sample or after a pause: averaged into the seed, not learnt
+  }
+  float w[3] = {gyr[0] - gyr_bias[0], gyr[1] - gyr_bias[1], gyr[2] - gyr_bias[2]};
+  if(!gyr_bias_seeded) {
+    gyr_bias_samples++;
+    for(int i = 0; i < 3; i++) {
+      gyr_bias[i] += w[i] / gyr_bias_samples;   // running average
+    }
+    gyr_bias_seed_s += dt;
+    gyr_bias_seeded = gyr_bias_seed_s >= PREDICT_SEED_S;
+    return;
+  }
+  if(vector_mod(w) < PREDICT_STILL_DPS) {
+    float gain = min(1.0f, dt / (float)PREDICT_BIAS_TAU_S);
+    for(int i = 0; i < 3; i++) {
+      gyr_bias[i] += gain * w[i];
+    }
+  }
+}
+
+/*
+ * azimuth and altitude rates from the body rates, with the same acc and mag compass3D() and elevation() use
+ */
+void predict_rates(float acc[3], float mag[3], float gyr[3]) {
+  az_rate = 0;
+  alt_rate = 0;
+  if((acc[0]==0) & (acc[1]==0) & (acc[2] ==0)) {
+    return;       // no accelerometer, no propagation
+  }
+  float w[3];
+  for(int i = 0; i < 3; i++) {
+    w[i] = (gyr[i] - gyr_bias[i]) * DegToRad;
+  }
+  float dD[3], E[3], N[3], dE[3], dN[3];
+  vector_cross(acc, w, dD);
+  // altitude = atan2(Dx, Dz)
+  float dxz = acc[0]*acc[0] + acc[2]*acc[2];
+  if(dxz > 0) {
+    alt_rate = (acc[2]*dD[0] - acc[0]*dD[2]) / dxz * RadToDeg;
+  }
+  // azimuth = -atan2(Ex, Nx), see compass3D()
+  vector_cross(acc, mag, E);
+  vector_normalize(E);
+  vector_cross(E, acc, N);
+  vector_normalize(N);
+  vector_cross(E, w, dE);
+  vector_cross(N, w, dN);
+  float exn = E[0]*E[0] + N[0]*N[0];
+  if(exn > 0) {
+    az_rate = -(N[0]*dE[0] - E[0]*dN[0]) / exn * RadToDeg;
+  }
+}
+
+/*
+ * az and alt, computed at from, moved forward to to. Returns false if they are left as they are
+ */
+bool predict(unsigned long from, unsigned long to, float* az, float* alt) {
+  long dt = to - from;
+  if(!predict_on || dt <= 0 || dt > PREDICT_MAX_MUS) {
+    return false;
+  }
+  *az = fmod(*az + az_rate * dt / 1e6 + 360, 360);
+  *alt = *alt + alt_rate * dt / 1e6;
+  return true;
+}
+
+/*
+ * predict command, see above
+ */
+void predict_command(int argc, char* argv[]) {
+  if(argc > 1) {
+    predict_on = atoi(argv[1]);
+  }
+  Serial.print("PREDICT, ");Serial.print(predict_on);
+  Serial.print(", AZ_RATE, ");Serial.print(az_rate, 4);Serial.print(", ALT_RATE, ");Serial.print(alt_rate, 4);
+  Serial.print(", BIAS, ");Serial.print(gyr_bias[0], 4);Serial.print(", ");Serial.print(gyr_bias[1], 4);Serial.print(", ");Serial.println(gyr_bias[2], 4);
+}
+
+#endif
@@ -0,0 +1,116 @@
+/******
+ * Hot path profiler on the Cortex-M7 DWT cycle counter
+ *
+ * PROFILE_SCOPE(id) at the top of a function, or of a block, measures it until the end of the scope:
+ * two reads of ARM_DWT_CYCCNT and a handful of integer operations, a few tens of cycles per probe.
+ * Every probe keeps count, min, mean, max and a log2 histogram of the cycles, printed and reset
+ * by the profile command. Set PROFILE to 0 to compile the probes out.
+ *
+ * Released under GPLv3 License - see LICENSE file for details.
+ ******/
+
+#ifndef PROFILER
+#define PROFILER
+
+#define PROFILE 1
+#define PROF_BUCKETS 10
+#define PROF_BUCKET0_LOG2 6      // first bucket: below 128 cycles, then doubling, the last one is open
+
+enum ProfProbe {
+  PROF_MAG_READINGS,
+  PROF_ACCEL_READINGS,
+  PROF_M_CALIBRATE,
+  PROF_COMPASS3D,
+  PROF_ELEVATION,
+  PROF_CHECK_SERIAL1,
+  PROF_CHECK_JOYSTICK,
+  PROF_FUSION,
+  PROF_COUNT
+};
+
+const char* prof_names[PROF_COUNT] = {"mag_readings", "accel_readings", "m_calibrate", "compass3D", "elevation",
+                                      "checkSerial1", "checkJoystick", "fusion"};
+
+struct ProfStats {
+  uint32_t count;
+  uint64_t sum;
+  uint32_t min;
+  uint32_t max;
+  uint32_t hist[PROF_BUCKETS];
+};
+
+ProfStats prof_stats[PROF_COUNT];
+
+void prof_reset() {
+  for(int p = 0; p < PROF_COUNT; p++) {
+    prof_stats[p] = ProfStats();
+    prof_stats[p].min = UINT32_MAX;
+  }
+}
+
+void prof_begin() {
+  ARM_DEMCR |= ARM_DEMCR_TRCENA;          // already on in the Teensy 4 core, harmless
+  ARM_DWT_CTRL |= ARM_DWT_CTRL_CYCCNTENA;
+  prof_reset();
+}
+
+inline void prof_record(uint8_t probe, uint32_t cycles) {
+  ProfStats* s = &prof_stats[probe];
+  s->count++;
+  s->sum += cycles;
+  if(cycles < s->min) {
+    s->min = cycles;
+  }
+  if(cycles > s->max) {
+    s->max = cycles;
+  }
+  int b = cycles ? 31 - __builtin_clz(cycles) - PROF_BUCKET0_LOG2 : 0;
+  s->hist[constrain(b, 0, PROF_BUCKETS - 1)]++;
+}
+
+class ProfScope {
+  public:
+    inline ProfScope(uint8_t probe) : probe(probe), start(ARM_DWT_CYCCNT) {
+    }
+    inline ~ProfScope() {
+      prof_record(probe, ARM_DWT_CYCCNT - start);
+    }
+  private:
+    uint8_t probe;
+    uint32_t start;
+};
+
+#if PROFILE
+#define PROFILE_SCOPE(probe) ProfScope prof_scope(probe)
+#else
+#define PROFILE_SCOPE(probe)
+#endif
+
+/*
+ * Prints, per probe, calls, min/mean/max in cycles and microseconds and the histogram counts
+ * (bucket n: below 2^(PROF_BUCKET0_LOG2 + 1 + n) cycles), then starts a new measurement
+ */
+void print_profile() {
+  const float cycles_per_mus = F_CPU_ACTUAL / 1000000.0;
+  for(int p = 0; p < PROF_COUNT; p++) {
+    ProfStats* s = &prof_stats[p];
+    Serial.print("PROFILE, ");Serial.print(prof_names[p]);
+    Serial.print(", CALLS, ");Serial.print(s->count);
+    if(s->count) {
+      float mean = (float)s->sum / s->count;
+      Serial.print(", MIN, ");Serial.print(s->min);
+      Serial.print(", MEAN, ");Serial.print(mean, 1);
+      Serial.print(", MAX, ");Serial.print(s->max);
+      Serial.print(", MEAN_MUS, ");Serial.print(mean / cycles_per_mus, 2);
+      Serial.print(", MAX_MUS, ");Serial.print(s->max / cycles_per_mus, 2);
+      Serial.print(", HIST");
+      for(int b = 0; b < PROF_BUCKETS; b++) {
+        Serial.print(", ");Serial.print(s->hist[b]);
+      }
+    }
+    Serial.println();
+  }
+  prof_reset();
+}
+
+#endif
@@ -3,26 +3,35 @@
  *   abstracted functions
  *   can handle either two separate sensors or a combined magnetometer/accelerator sensor
  * 
+ * The detected drivers (sensors/sensor.h framework) are bound once by sensors(): each reading
+ * function then calls a single function where driver, rotation and smoothing are inlined,
+ * with no per sample branching on the sensor type.
+ * The magnetometer samples stay in the chip axes: axes remap, block rotation and 1/B are linear and
+ * are composed in mag_frame, which m_calibration.h merges with the calibration in a single transform.
+ * 
  * Created by Massimo Tasso, January, 1, 2023
  * Released under GPLv3 License - see LICENSE file for details.
  ******/
 
+#include "sensors/i2c_async.h"
 #include "sensors/LIS3MDL.h"
 #include "sensors/RM3100.h"
 #include "sensors/MMA8451.h"
 #include "sensors/LSM6DSV.h"
 #include "sensors/MPU6050.h"
+#include "sensors/magLIS.h"
+#include "sensors/magRM3100.h"
+#include "sensors/magHub.h"
+#include "sensors/accLSM.h"
+#include "sensors/accMPU.h"
 #include "defines.h"
+#include "profiler.h"
 #include <Wire.h>
-#include <SimpleKalmanFilter.h>
 
 /*
  * Untilted MAG is a magnetometer sensor combined with an accelerometer/gyro to compensate for non complanarity with the horizontal plane
  */
-bool LIS3MDL_MAG = false;
-bool RM3100_MAG = false;
 bool LSM_ACCEL_GYRO = false;
-bool MPU6050_ACCEL_GYRO = false;
 
 int ACCEL_DATARATE = 0;
 int MAG_DATARATE = 0;
@@ -30,22 +39,39 @@ int GYRO_DATARATE = 0;
 
 bool sensor_block_vertical = true;
 
+unsigned long acc_time_mus = 0;   // chip timestamp of the last accelerometer sample, FIFO mode only
+unsigned long gyr_time_mus = 0;   // chip timestamp of the last gyro sample, FIFO mode only
+unsigned long mag_time_mus = 0;   // chip timestamp of the last magnetometer sample, sensor hub mode only
+
 float B = 46.8;  // magnitude of earth mag vector - to be received from raspberry
 
-// the untilting functions require as smooth as possible accelerometer readings
-SimpleKalmanFilter* kf_mag_x;
-SimpleKalmanFilter* kf_mag_y;
-SimpleKalmanFilter* kf_mag_z;
-SimpleKalmanFilter* kf_acc_x;
-SimpleKalmanFilter* kf_acc_y;
-SimpleKalmanFilter* kf_acc_z;
-SimpleKalmanFilter* kf_gyr_x;
-SimpleKalmanFilter* kf_gyr_y;
-SimpleKalmanFilter* kf_gyr_z;
+// the drivers, each holds its own kalman filters
+MagLIS mag_lis;
+MagRM3100 mag_rm3100;
+MagRM3100I2C mag_rm3100_i2c;
+MagRM3100SPI mag_rm3100_spi;
+MagHub<MagLIS> mag_hub_lis;
+MagHub<MagRM3100> mag_hub_rm3100;
+AccLSM acc_lsm;
+GyroLSM gyro_lsm;
+AccLSMFifo acc_lsm_fifo;
+GyroLSMFifo gyro_lsm_fifo;
+AccMPU acc_mpu;
+GyroMPU gyro_mpu;
+
+struct SensorBinding {
+  bool (*readings)(float raw[3], unsigned long* t_mus);
+  void (*stats)();
+  void (*axes)(float raw[3]);
+  float (*time_constant)();
+  void (*set_noise_scale)(float scale);
+  bool chip_frame;
+  int rate;
+};
 
-bool mag_smooth = false;
-bool acc_smooth = false;
-bool gyr_smooth = false;
+SensorBinding mag_sensor;
+SensorBinding acc_sensor;
+SensorBinding gyro_sensor;
 
 
 /*
@@ -57,136 +83,212 @@ float K_ERR_ALT = 0.01;  // default value
 float K_Q_ALT = 0.5;     // default value - meaning: how much we expect the measurement to vary. Even smaller than azimuth, the scope rotates at 1°/sec when slewing. Generally below 1"/sec
 */
 
+// magnetometer chip axes to the calibration frame: axes remap, block rotation and 1/B. Rebuilt by build_mag_frame()
+float mag_frame[9] = {1, 0, 0,
+                      0, 1, 0,
+                      0, 0, 1};
+
 void zero_untilt();
+void compile_m_calibration();
+
+// rotation for sensor rotated 90° on x axis, eg sensor block on OTA for 3D magnetometer
+void rotate(float raw[3]) {
+  if(sensor_block_vertical) {
+    float x = raw[0];
+    float y = raw[2];
+    float z = -raw[1];
+    raw[0] = x;
+    raw[1] = y;
+    raw[2] = z;
+  }
+}
+
+inline void mat3_mul(const float M[9], const float in[3], float out[3]) {
+  out[0] = M[0]*in[0] + M[1]*in[1] + M[2]*in[2];
+  out[1] = M[3]*in[0] + M[4]*in[1] + M[5]*in[2];
+  out[2] = M[6]*in[0] + M[7]*in[1] + M[8]*in[2];
+}
+
+/*
+ * Read path of a driver: every sample goes through rotation and filters in order.
+ * Batched drivers (FIFO) return the last filtered sample when smoothing, otherwise the mean of the batch.
+ * Returns false if no sample arrived since the previous call
+ */
+template <class S, S& s>
+bool sensor_readings(float raw[3], unsigned long* t_mus) {
+  float sample[3];
+  float sum[3] = {0, 0, 0};
+  int n = 0;
+  while(s.read(sample)) {
+    if(!S::CHIP_FRAME) {
+      rotate(sample);
+    }
+    s.smooth_readings(sample, s.time_mus ? s.time_mus : micros());   // the chip time of each sample of a batch
+    sum[0] += sample[0];
+    sum[1] += sample[1];
+    sum[2] += sample[2];
+    n++;
+    if(!S::BATCHED) {
+      break;
+    }
+  }
+  s.request();  // the next samples are acquired while the loop goes on
+  if(!n) {
+    return false;
+  }
+  for(int i = 0; i < 3; i++) {
+    raw[i] = S::SMOOTH ? sample[i] : sum[i] / n;
+  }
+  *t_mus = s.time_mus;
+  return true;
+}
+
+template <class S, S& s>
+void sensor_stats() {
+  s.stats();
+}
+
+template <class S, S& s>
+float sensor_time_constant() {
+  return s.time_constant();
+}
+
+template <class S, S& s>
+void sensor_set_noise_scale(float scale) {
+  s.set_noise_scale(scale);
+}
+
+/*
+ * initializes the driver and, if the sensor is found, binds its read path
+ */
+template <class S, S& s>
+bool bind_sensor(SensorBinding* binding) {
+  if(!s.init()) {
+    return false;
+  }
+  binding->readings = sensor_readings<S, s>;
+  binding->stats = sensor_stats<S, s>;
+  binding->axes = S::axes;
+  binding->time_constant = sensor_time_constant<S, s>;
+  binding->set_noise_scale = sensor_set_noise_scale<S, s>;
+  binding->chip_frame = S::CHIP_FRAME;
+  binding->rate = s.dataRate();
+  s.set_filter_rate(s.sampleRate());   // per sample, a batch is filtered sample by sample
+  Serial.print(S::NAME);Serial.println(" found");
+  return true;
+}
+
+/*
+ * mag_frame column c is the image of the chip unit vector c. The kalman filters of the three axes share
+ * their parameters and are updated together, so smoothing before the remap gives the same samples
+ */
+void build_mag_frame() {
+  for(int c = 0; c < 3; c++) {
+    float e[3] = {0, 0, 0};
+    e[c] = 1;
+    if(mag_sensor.chip_frame) {
+      mag_sensor.axes(e);
+      rotate(e);
+    }
+    for(int r = 0; r < 3; r++) {
+      mag_frame[3*r + c] = e[r] / B;   // scaled, not normalized: hard/soft irons are removed later
+    }
+  }
+  compile_m_calibration();
+}
+
+void set_block_vertical(bool vertical) {
+  sensor_block_vertical = vertical;
+  build_mag_frame();
+}
 
 bool sensors() {
-  float K_ERR_ACC;
-  float K_Q_ACC;
-  float K_ERR_MAG;
-  float K_Q_MAG;
   Wire.begin();
   // Search for Altitude Accelerometer - supported LSM6DSV and MPU6050
-  if(init_accelerometer_LSM()) {
-      Serial.println("LSM8DSV16X Accel/Gyro found");
+  if(LSM_FIFO ? bind_sensor<AccLSMFifo, acc_lsm_fifo>(&acc_sensor) && bind_sensor<GyroLSMFifo, gyro_lsm_fifo>(&gyro_sensor)
+              : bind_sensor<AccLSM, acc_lsm>(&acc_sensor) && bind_sensor<GyroLSM, gyro_lsm>(&gyro_sensor)) {
       LSM_ACCEL_GYRO = true;
-      ACCEL_DATARATE = ACCEL_DATARATE_LSM;
-      GYRO_DATARATE = GYRO_DATARATE_LSM;
-      K_ERR_ACC = K_ERR_A_LSM6;
-      K_Q_ACC = K_Q_A_LSM6;
-      acc_smooth = false;  // LSM6DSV does not require smoothing
-  } else if(init_accelerometer_MPU6050()) {
-      Serial.println("MPU6050 Accel/Gyro found");
-      MPU6050_ACCEL_GYRO = true;
-      ACCEL_DATARATE = ACCEL_DATARATE_MPU6050;
-      GYRO_DATARATE = ACCEL_DATARATE_MPU6050;
-      K_ERR_ACC = K_ERR_MPU_FAST;
-      K_Q_ACC = K_Q_MPU_FAST;
-      acc_smooth = true;
+  } else if(bind_sensor<AccMPU, acc_mpu>(&acc_sensor) && bind_sensor<GyroMPU, gyro_mpu>(&gyro_sensor)) {
+      LSM_ACCEL_GYRO = false;
   } else {
       Serial.println("Error, Accel/Gyro not found");
       return false;
   }
-  kf_gyr_x = new SimpleKalmanFilter(K_ERR_ACC, K_ERR_ACC, K_Q_ACC);
-  kf_gyr_y = new SimpleKalmanFilter(K_ERR_ACC, K_ERR_ACC, K_Q_ACC);
-  kf_gyr_z = new SimpleKalmanFilter(K_ERR_ACC, K_ERR_ACC, K_Q_ACC);
-  kf_acc_x = new SimpleKalmanFilter(K_ERR_ACC, K_ERR_ACC, K_Q_ACC);
-  kf_acc_y = new SimpleKalmanFilter(K_ERR_ACC, K_ERR_ACC, K_Q_ACC);
-  kf_acc_z = new SimpleKalmanFilter(K_ERR_ACC, K_ERR_ACC, K_Q_ACC);
-
-
-  // Search for Magnetometer - supported LIS3MDL and RM3100
-  if(init_magnetometer_LIS3MDL()) {
-      Serial.println("LIS3MDL Magnetometer found");
-      LIS3MDL_MAG = true;
-      MAG_DATARATE = MAGNET_DATARATE_LIS3MDL;
-      K_ERR_MAG = K_ERR_M_LIS;
-      K_Q_MAG = K_Q_M_LIS;
-      mag_smooth = true;  // LIS3MDL is best if smoothed
-  } else if(init_magnetometer_R3100()) {
-      Serial.println("RM3100 Magnetometer found");
-      RM3100_MAG = true;
-      MAG_DATARATE = dataRate_RM3100();
-      K_ERR_MAG = K_ERR_M_RM3100;
-      K_Q_MAG = K_Q_M_RM3100;
-      mag_smooth = true;
-  } else {
+  ACCEL_DATARATE = acc_sensor.rate;
+  GYRO_DATARATE = gyro_sensor.rate;
+
+  // Search for Magnetometer - supported LIS3MDL and RM3100, on the LSM6DSV16X sensor hub first if enabled
+  // the RM3100 is searched on SPI if enabled (RM3100_SPI), then at its native I2C address, then behind the bridge
+  LSM_SENSOR_HUB = LSM_SENSOR_HUB && LSM_ACCEL_GYRO && LSM_FIFO &&
+                   (bind_sensor<MagHub<MagLIS>, mag_hub_lis>(&mag_sensor) || bind_sensor<MagHub<MagRM3100>, mag_hub_rm3100>(&mag_sensor));
+  if(!LSM_SENSOR_HUB && !bind_sensor<MagLIS, mag_lis>(&mag_sensor) && !(RM3100_SPI && bind_sensor<MagRM3100SPI, mag_rm3100_spi>(&mag_sensor))
+                     && !bind_sensor<MagRM3100I2C, mag_rm3100_i2c>(&mag_sensor) && !bind_sensor<MagRM3100, mag_rm3100>(&mag_sensor)) {
       Serial.println("Error, magnetometer not found");
       return false;
   }
-  kf_mag_x = new SimpleKalmanFilter(K_ERR_MAG, K_ERR_MAG, K_Q_MAG);
-  kf_mag_y = new SimpleKalmanFilter(K_ERR_MAG, K_ERR_MAG, K_Q_MAG);
-  kf_mag_z = new SimpleKalmanFilter(K_ERR_MAG, K_ERR_MAG, K_Q_MAG);
+  MAG_DATARATE = mag_sensor.rate;
+  // all the supported sensors are fast mode capable. Set after the inits, the libraries' begin() reset the clock to 100 kHz
+  Wire.setClock(400000);
+  i2c_async_begin();
+  build_mag_frame();
   return true;
 }
 
-// rotation for sensor rotated 90° on x axis, eg sensor block on OTA for 3D magnetometer
-void rotate(float raw[3]) {
-  if(sensor_block_vertical) {
-    float x = raw[0];
-    float y = raw[2];
-    float z = -raw[1];
-    raw[0] = x;
-    raw[1] = y;
-    raw[2] = z;
-  }
-}
-
-void mag_readings(float mag_raw[3], uint8_t debug) {
-  if(LIS3MDL_MAG){
-    mag_readings_LIS(mag_raw);
-  } else if(RM3100_MAG) {
-    mag_readings_RM3100(mag_raw);
-  }
-  rotate(mag_raw);
-  if(mag_smooth) {
-      mag_raw[0] = kf_mag_x->updateEstimate(mag_raw[0]);
-      mag_raw[1] = kf_mag_y->updateEstimate(mag_raw[1]);
-      mag_raw[2] = kf_mag_z->updateEstimate(mag_raw[2]);
+/*
+ * returns false if the magnetometer has no new sample, mag_raw is then left untouched
+ * the magnetometers are read asynchronously: a call queues the transfer, a later one returns the sample
+ * mag_raw is the smoothed sample in the chip axes, m_calibrate() maps it to the calibrated NED frame
+ */
+bool mag_readings(float mag_raw[3], uint8_t debug) {
+  PROFILE_SCOPE(PROF_MAG_READINGS);
+  if(!mag_sensor.readings(mag_raw, &mag_time_mus)) {
+    return false;
   }
-  mag_raw[0] /= B;  // non ho ancora tolto HI/SI ma va bene lo stesso
-  mag_raw[1] /= B;  // perchè sto solo riscalando, non normalizzando
-  mag_raw[2] /= B;
   if((uint8_t)(debug | ~DEBUG_MAG_RAW)==255) {
-    Serial.print("MAG ");Serial.print(mag_raw[0], 4);Serial.print(" ");Serial.print(mag_raw[1], 4);Serial.print(" ");Serial.println(mag_raw[2], 4);
+    float m[3];
+    mat3_mul(mag_frame, mag_raw, m);
+    Serial.print("MAG ");Serial.print(m[0], 4);Serial.print(" ");Serial.print(m[1], 4);Serial.print(" ");Serial.println(m[2], 4);
   }
+  return true;
 }
 
-void accel_readings(float accel_raw[3], uint8_t debug) {
-    if(LSM_ACCEL_GYRO){
-        accel_readings_LSM(accel_raw);
-    } else if(MPU6050_ACCEL_GYRO){
-       accel_readings_MPU6050(accel_raw);
-    }
-    rotate(accel_raw);
-    if(acc_smooth) {
-        accel_raw[0] = kf_acc_x->updateEstimate(accel_raw[0]);
-        accel_raw[1] = kf_acc_y->updateEstimate(accel_raw[1]);
-        accel_raw[2] = kf_acc_z->updateEstimate(accel_raw[2]);
+void mag_stats() {
+  mag_sensor.stats();
+}
+
+/*
+ * returns false if there is no new sample, accel_raw is then left untouched
+ */
+bool accel_readings(float accel_raw[3], uint8_t debug) {
+    PROFILE_SCOPE(PROF_ACCEL_READINGS);
+    if(!acc_sensor.readings(accel_raw, &acc_time_mus)) {
+        return false;
     }
     if((uint8_t)(debug | ~DEBUG_ALT_ACC)==255) {
        Serial.print("ACC ");Serial.print(accel_raw[0]);Serial.print(" ");Serial.print(accel_raw[1]);Serial.print(" ");Serial.println(accel_raw[2]);
     }
+    return true;
 }
 
-void gyro_readings(float gyro_raw[3], uint8_t debug) {
-    if(LSM_ACCEL_GYRO){
-        gyro_readings_LSM(gyro_raw);
-    } else if(MPU6050_ACCEL_GYRO) {
-        gyro_readings_MPU6050(gyro_raw);
-    }
-    rotate(gyro_raw);
-    if(gyr_smooth) {
-            gyro_raw[0] = kf_acc_x->updateEstimate(gyro_raw[0]);
-            gyro_raw[1] = kf_acc_y->updateEstimate(gyro_raw[1]);
-            gyro_raw[2] = kf_acc_z->updateEstimate(gyro_raw[2]);
+/*
+ * returns false if there is no new sample, gyro_raw is then left untouched
+ */
+bool gyro_readings(float gyro_raw[3], uint8_t debug) {
+    if(!gyro_sensor.readings(gyro_raw, &gyr_time_mus)) {
+        return false;
     }
     if((uint8_t)(debug | ~DEBUG_ALT_ACC)==255) {
         Serial.print("GYRO ");Serial.print(gyro_raw[0]);Serial.print(" ");Serial.print(gyro_raw[1]);Serial.print(" ");Serial.println(gyro_raw[2]);
     }
+    return true;
+}
+
+void acc_stats() {
+    acc_sensor.stats();
 }
 
-void set_bmag(String msg) {
+void set_bmag(float b_nT) {
     // raspberry sends something like 46781.68 nT. Has to be divided by 1000 because we need uTesla
-    String bs = msg.substring(5, msg.length());    // extract second word, which is duration in seconds, from command string
-    B = bs.toFloat()/1000;
+    B = b_nT/1000;
+    build_mag_frame();
 }
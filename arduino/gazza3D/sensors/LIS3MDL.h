@@ -34,7 +34,7 @@
  
 #include <Wire.h>
 #include <Adafruit_LIS3MDL.h>
-#include <SimpleKalmanFilter.h>
+#include "i2c_async.h"
 
 #define MAG_DATARATE_STRING LIS3MDL_DATARATE_155_HZ  // could be faster but not Ultra High Performance Mode
 #define MAGNET_DATARATE_LIS3MDL 155
@@ -47,8 +47,19 @@
 // SimpleKalmanFilter kf_my = SimpleKalmanFilter(K_ERR_M_L, K_ERR_M_L, K_Q_M_L);
 // SimpleKalmanFilter kf_mz = SimpleKalmanFilter(K_ERR_M_L, K_ERR_M_L, K_Q_M_L);
 
+// registers for the asynchronous readings - the library is used for the configuration only
+#define LIS3MDL_ADDRESS      0x1C    // default address of the Adafruit breakout board
+#define LIS3MDL_OUT_X_L      0x28
+#define LIS3MDL_AUTO_INC     0x80    // MSB of the register address enables the address auto increment
+#define LIS3MDL_LSB_GAUSS_4  6842.0  // sensitivity at 4 gauss full scale
+#define GAUSS_TO_MICROTESLA  100.0   // same unit returned by Adafruit getEvent()
+
 Adafruit_LIS3MDL magnet_LIS3MDL;
 
+uint8_t lis_reg = LIS3MDL_OUT_X_L | LIS3MDL_AUTO_INC;
+uint8_t lis_data[6];
+I2CTransaction lis_txn = {LIS3MDL_ADDRESS, I2C_DEV_MAG, &lis_reg, 1, lis_data, 6, NULL, I2C_TXN_IDLE, 0};
+
 bool init_magnetometer_LIS3MDL() {
   magnet_LIS3MDL = Adafruit_LIS3MDL();
   if (!magnet_LIS3MDL.begin_I2C()) {
@@ -82,15 +93,32 @@ void mag_axes_LIS(float raw[3]) {
   raw[2] = down;  // -z;
 }
 
-void mag_readings_LIS(float mag_raw[3]) {
-   sensors_event_t mevent;
-   magnet_LIS3MDL.getEvent(&mevent);
+/*
+ * data holds the 6 output bytes, OUT_X_L first
+ * chip axes: mag_axes_LIS() is folded in the magnetometer transform, see sensors.h
+ */
+void decode_LIS(const uint8_t* data, float mag_raw[3]) {
+   mag_raw[0] = (int16_t)(data[1] << 8 | data[0]) / LIS3MDL_LSB_GAUSS_4 * GAUSS_TO_MICROTESLA;
+   mag_raw[1] = (int16_t)(data[3] << 8 | data[2]) / LIS3MDL_LSB_GAUSS_4 * GAUSS_TO_MICROTESLA;
+   mag_raw[2] = (int16_t)(data[5] << 8 | data[4]) / LIS3MDL_LSB_GAUSS_4 * GAUSS_TO_MICROTESLA;
+}
+
+/*
+ * asynchronous reading: the first call queues the transfer and returns false,
+ * the sample is returned by the first call after the transfer is completed
+ */
+bool mag_readings_LIS(float mag_raw[3]) {
+   if(i2c_async_pending(&lis_txn)) {
+     return false;
+   }
+   if(lis_txn.status != I2C_TXN_OK) {
+     i2c_async_submit(&lis_txn);
+     return false;
+   }
+   lis_txn.status = I2C_TXN_IDLE;   // consumed
   //  mag_raw[0] = kf_mx.updateEstimate(mevent.magnetic.x);  // gauss
   //  mag_raw[1] = kf_my.updateEstimate(mevent.magnetic.y);  // gauss
   //  mag_raw[2] = kf_mz.updateEstimate(mevent.magnetic.z);  // gauss
-   mag_raw[0] = mevent.magnetic.x;  // gauss
-   mag_raw[1] = mevent.magnetic.y;  // gauss
-   mag_raw[2] = mevent.magnetic.z;  // gauss
-
-   mag_axes_LIS(mag_raw);
+   decode_LIS(lis_data, mag_raw);
+   return true;
 }
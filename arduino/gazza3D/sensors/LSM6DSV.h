@@ -9,6 +9,8 @@
  ******/
 
 #include "SparkFun_LSM6DSV16X.h"
+#include <Wire.h>
+#include "i2c_async.h"
 
 #define SENSORS_GRAVITY_EARTH    (9.80665F)  //< Earth's gravity in m/s^2
 #define SENSORS_DPS_TO_RADS  (0.017453293F)  //< Degrees/s to rad/s multiplier
@@ -21,8 +23,226 @@
 #define ACCEL_DATARATE_LSM 500  // should not be faster than the datarate e.g. 500 vs 1000
 #define GYRO_DATARATE_LSM  500  // should not be faster than the datarate e.g. 500 vs 1000
 
+/*
+ * FIFO mode
+ * the chip batches every accel and gyro sample (1 kHz) together with its timestamp in the hardware FIFO.
+ * At each accelerometer tick a single asynchronous transaction reads the FIFO level and, from its
+ * callback, the words are drained in bursts and unpacked into the sample rings below, which the
+ * readings functions empty. Two transactions every LSM_FIFO_DRAIN_HZ instead of a status polling
+ * loop plus a register read for each sample, and no sample is discarded.
+ */
+bool LSM_FIFO = true;                       // false: one sample per reading, polling the status register
+
+#define LSM6DSV_ADDRESS          0x6B       // default address of the Sparkfun breakout board
+#define LSM6DSV_FIFO_CTRL1       0x07       // watermark, in FIFO words
+#define LSM6DSV_FIFO_CTRL3       0x09       // batch data rates
+#define LSM6DSV_FIFO_CTRL4       0x0A       // fifo mode and timestamp batching
+#define LSM6DSV_FIFO_STATUS1     0x1B       // fifo level, status2 follows
+#define LSM6DSV_FUNCTIONS_ENABLE 0x50
+#define LSM6DSV_FIFO_DATA_OUT    0x78       // tag and 6 data bytes, the address rolls back to 0x78 after 0x7E
+
+#define LSM6DSV_BDR_960HZ        0x09       // batches every sample at the HA01 1 kHz ODR
+#define LSM_FIFO_BATCH_HZ        960        // accel and gyro samples in the FIFO
+#define LSM6DSV_FIFO_CONTINUOUS  0x06       // the newest samples overwrite the oldest ones when full
+#define LSM6DSV_TS_BATCH_1       0x40       // a timestamp word at every batch event
+#define LSM6DSV_TIMESTAMP_EN     0x40
+#define LSM6DSV_FIFO_OVR         0x40       // in FIFO_STATUS2
+
+#define LSM6DSV_TAG_GYRO         0x01
+#define LSM6DSV_TAG_ACCEL        0x02
+#define LSM6DSV_TAG_TIMESTAMP    0x04
+
+#define LSM_FIFO_DRAIN_HZ        100        // accelerometer tick in FIFO mode
+#define LSM_FIFO_WORD            7
+#define LSM_FIFO_WATERMARK       30         // one tick of data: 10 accel + 10 gyro + 10 timestamp words
+#define LSM_FIFO_BURST_WORDS     32         // words per transaction, the receive length is 8 bit
+#define LSM_RING_LEN             64         // must be a power of 2
+#define LSM_TS_LSB_MUS           21.75      // timestamp resolution
+
+#define LSM_ACCEL_MG_LSB         0.061      // sensitivity at 2g full scale
+#define LSM_GYRO_MDPS_LSB        4.375      // sensitivity at 125 dps full scale
+
+struct LSMSample {
+    int16_t xyz[3];
+    uint32_t ts;                            // chip timestamp of the batch
+};
+
+struct LSMRing {
+    LSMSample s[LSM_RING_LEN];
+    volatile uint8_t head;
+    volatile uint8_t tail;
+    unsigned long dropped;                  // oldest samples overwritten because the readings were late
+};
+
+LSMRing lsm_acc_ring;
+LSMRing lsm_gyr_ring;
+uint32_t lsm_fifo_ts = 0;                   // last timestamp word
+
+/*
+ * Sensor hub mode (FIFO mode only)
+ * the magnetometer is wired to the LSM6DSV16X auxiliary bus (SDx/SCx) and read by the chip's own
+ * I2C master at every SHUB_ODR event. Its words are batched in the same FIFO as the accel and gyro
+ * words, under the same timestamps: a single aligned stream, drained by the same bursts.
+ * A slave read fits a FIFO word only up to 6 bytes, the 9 bytes of an RM3100 measurement take two slaves.
+ */
+bool LSM_SENSOR_HUB = false;                // true: the magnetometer is searched on the auxiliary bus
+
+#define LSM6DSV_FUNC_CFG_ACCESS  0x01
+#define LSM6DSV_SHUB_REG_ACCESS  0x40       // switches to the sensor hub register bank
+#define LSM6DSV_MASTER_CONFIG    0x14       // sensor hub bank
+#define LSM6DSV_SLV0_ADD         0x15       // sensor hub bank, slave n registers at SLV0_ADD + 3 * n
+#define LSM6DSV_STATUS_MASTER    0x22       // sensor hub bank
+#define LSM6DSV_MASTER_ON        0x04
+#define LSM6DSV_PASS_THROUGH     0x10
+#define LSM6DSV_SHUB_ODR_120HZ   0x80       // SLV0_CONFIG bits 7:5
+#define LSM_SHUB_HZ              120        // magnetometer samples in the FIFO
+#define LSM6DSV_BATCH_EXT_SENS   0x08
+#define LSM6DSV_SENS_HUB_ENDOP   0x01
+#define LSM6DSV_SLAVE_NACK       0x78       // a NACK from any of the four slaves
+
+#define LSM6DSV_TAG_HUB_SLAVE0   0x0E
+#define LSM6DSV_TAG_HUB_SLAVE1   0x0F
+
+#define LSM_HUB_BYTES            12         // two slave words
+
+struct LSMHubSample {
+    uint8_t data[LSM_HUB_BYTES];
+    uint32_t ts;
+};
+
+struct LSMHubRing {
+    LSMHubSample s[LSM_RING_LEN];
+    volatile uint8_t head;
+    volatile uint8_t tail;
+    unsigned long dropped;
+};
+
+LSMHubRing lsm_hub_ring;
+uint8_t lsm_hub_slaves = 0;
+uint8_t lsm_hub_pending[LSM_HUB_BYTES];    // slave words of the sample being assembled
+
+uint8_t lsm_status_reg = LSM6DSV_FIFO_STATUS1;
+uint8_t lsm_status[2];
+uint8_t lsm_data_reg = LSM6DSV_FIFO_DATA_OUT;
+uint8_t lsm_data[LSM_FIFO_BURST_WORDS * LSM_FIFO_WORD];
+volatile uint16_t lsm_fifo_left = 0;        // words still to drain, written by the completion callbacks
+
+unsigned long lsm_fifo_words = 0;
+unsigned long lsm_fifo_bursts = 0;
+unsigned long lsm_fifo_overruns = 0;
+
+void lsm_status_done(I2CTransaction* t);
+void lsm_data_done(I2CTransaction* t);
+I2CTransaction lsm_status_txn = {LSM6DSV_ADDRESS, I2C_DEV_ACC, &lsm_status_reg, 1, lsm_status, 2, lsm_status_done, I2C_TXN_IDLE, 0};
+I2CTransaction lsm_data_txn = {LSM6DSV_ADDRESS, I2C_DEV_ACC, &lsm_data_reg, 1, lsm_data, 0, lsm_data_done, I2C_TXN_IDLE, 0};
+
 SparkFun_LSM6DSV16X LSM6D;
 
+void writeReg_LSM(uint8_t reg, uint8_t value) {
+    Wire.beginTransmission(LSM6DSV_ADDRESS);
+    Wire.write(reg);
+    Wire.write(value);
+    Wire.endTransmission();
+}
+
+uint8_t readReg_LSM(uint8_t reg) {
+    Wire.beginTransmission(LSM6DSV_ADDRESS);
+    Wire.write(reg);
+    Wire.endTransmission(false);
+    Wire.requestFrom(LSM6DSV_ADDRESS, 1);
+    return Wire.read();
+}
+
+void init_fifo_LSM() {
+    writeReg_LSM(LSM6DSV_FIFO_CTRL1, LSM_FIFO_WATERMARK);
+    writeReg_LSM(LSM6DSV_FIFO_CTRL3, (LSM6DSV_BDR_960HZ << 4) | LSM6DSV_BDR_960HZ);
+    writeReg_LSM(LSM6DSV_FUNCTIONS_ENABLE, readReg_LSM(LSM6DSV_FUNCTIONS_ENABLE) | LSM6DSV_TIMESTAMP_EN);
+    writeReg_LSM(LSM6DSV_FIFO_CTRL4, LSM6DSV_TS_BATCH_1 | LSM6DSV_FIFO_CONTINUOUS);
+}
+
+void lsm_ring_push(LSMRing* r, const uint8_t* data) {
+    LSMSample* s = &r->s[r->tail];
+    s->xyz[0] = (int16_t)(data[1] << 8 | data[0]);
+    s->xyz[1] = (int16_t)(data[3] << 8 | data[2]);
+    s->xyz[2] = (int16_t)(data[5] << 8 | data[4]);
+    s->ts = lsm_fifo_ts;
+    r->tail = (r->tail + 1) & (LSM_RING_LEN - 1);
+    if(r->tail == r->head) {
+        r->head = (r->head + 1) & (LSM_RING_LEN - 1);
+        r->dropped++;
+    }
+}
+
+void lsm_hub_push(const uint8_t* data, uint8_t slave) {
+    memcpy(lsm_hub_pending + 6 * slave, data, 6);
+    if(slave < lsm_hub_slaves - 1) {
+        return;                             // the word of the next slave follows
+    }
+    LSMHubSample* s = &lsm_hub_ring.s[lsm_hub_ring.tail];
+    memcpy(s->data, lsm_hub_pending, LSM_HUB_BYTES);
+    s->ts = lsm_fifo_ts;
+    lsm_hub_ring.tail = (lsm_hub_ring.tail + 1) & (LSM_RING_LEN - 1);
+    if(lsm_hub_ring.tail == lsm_hub_ring.head) {
+        lsm_hub_ring.head = (lsm_hub_ring.head + 1) & (LSM_RING_LEN - 1);
+        lsm_hub_ring.dropped++;
+    }
+}
+
+void lsm_fifo_next_burst() {
+    uint16_t words = min((uint16_t)lsm_fifo_left, (uint16_t)LSM_FIFO_BURST_WORDS);
+    lsm_fifo_left -= words;
+    lsm_data_txn.rx_len = words * LSM_FIFO_WORD;
+    i2c_async_submit(&lsm_data_txn);
+}
+
+/*
+ * interrupt context - both callbacks
+ */
+void lsm_status_done(I2CTransaction* t) {
+    if(t->status != I2C_TXN_OK) {
+        return;
+    }
+    if(lsm_status[1] & LSM6DSV_FIFO_OVR) {
+        lsm_fifo_overruns++;
+    }
+    lsm_fifo_left = ((lsm_status[1] & 0x01) << 8) | lsm_status[0];
+    if(lsm_fifo_left) {
+        lsm_fifo_next_burst();
+    }
+}
+
+void lsm_data_done(I2CTransaction* t) {
+    if(t->status != I2C_TXN_OK) {
+        lsm_fifo_left = 0;
+        return;
+    }
+    for(int i = 0; i < t->rx_len; i += LSM_FIFO_WORD) {
+        const uint8_t* word = &lsm_data[i];
+        switch(word[0] >> 3) {
+            case LSM6DSV_TAG_TIMESTAMP:
+                lsm_fifo_ts = (uint32_t)word[4] << 24 | (uint32_t)word[3] << 16 | (uint32_t)word[2] << 8 | word[1];
+                break;
+            case LSM6DSV_TAG_ACCEL:
+                lsm_ring_push(&lsm_acc_ring, &word[1]);
+                break;
+            case LSM6DSV_TAG_GYRO:
+                lsm_ring_push(&lsm_gyr_ring, &word[1]);
+                break;
+            case LSM6DSV_TAG_HUB_SLAVE0:
+                lsm_hub_push(&word[1], 0);
+                break;
+            case LSM6DSV_TAG_HUB_SLAVE1:
+                lsm_hub_push(&word[1], 1);
+                break;
+        }
+    }
+    lsm_fifo_words += t->rx_len / LSM_FIFO_WORD;
+    lsm_fifo_bursts++;
+    if(lsm_fifo_left) {
+        lsm_fifo_next_burst();
+    }
+}
+
 bool init_accelerometer_LSM(void) {
     if (!LSM6D.begin()) {
         return false;
@@ -68,6 +288,124 @@ void axes_LSM(float raw[3]) {
     raw[2] = down;        // signs are defined accordingly to NED reference frame
 }
 
+void hub_bank_LSM(bool on) {
+    writeReg_LSM(LSM6DSV_FUNC_CFG_ACCESS, on ? LSM6DSV_SHUB_REG_ACCESS : 0);
+}
+
+/*
+ * connects the auxiliary bus to the main one, so that the magnetometer can be configured
+ * by the Teensy with its usual init function. The I2C master must be off.
+ */
+void pass_through_LSM(bool on) {
+    hub_bank_LSM(true);
+    writeReg_LSM(LSM6DSV_MASTER_CONFIG, on ? LSM6DSV_PASS_THROUGH : 0);
+    hub_bank_LSM(false);
+}
+
+/*
+ * slave n reads len (max 6) bytes from reg of the device at address, the result is batched in the FIFO
+ */
+void hub_slave_LSM(uint8_t slave, uint8_t address, uint8_t reg, uint8_t len) {
+    uint8_t base = LSM6DSV_SLV0_ADD + 3 * slave;
+    hub_bank_LSM(true);
+    writeReg_LSM(base, address << 1 | 0x01);  // read operation
+    writeReg_LSM(base + 1, reg);
+    writeReg_LSM(base + 2, (slave == 0 ? LSM6DSV_SHUB_ODR_120HZ : 0) | LSM6DSV_BATCH_EXT_SENS | len);
+    hub_bank_LSM(false);
+}
+
+/*
+ * turns the I2C master on, returns false if the slaves do not answer on the auxiliary bus
+ */
+bool start_hub_LSM(uint8_t slaves) {
+    hub_bank_LSM(true);
+    writeReg_LSM(LSM6DSV_MASTER_CONFIG, LSM6DSV_MASTER_ON | (slaves - 1));
+    hub_bank_LSM(false);
+    delay(20);                                // a few SHUB_ODR cycles
+    hub_bank_LSM(true);
+    uint8_t status = readReg_LSM(LSM6DSV_STATUS_MASTER);
+    if(!(status & LSM6DSV_SENS_HUB_ENDOP) || (status & LSM6DSV_SLAVE_NACK)) {
+        writeReg_LSM(LSM6DSV_MASTER_CONFIG, 0);
+        hub_bank_LSM(false);
+        return false;
+    }
+    hub_bank_LSM(false);
+    lsm_hub_slaves = slaves;
+    return true;
+}
+
+/*
+ * FIFO mode: queues the reading of the next batch, unless the previous one is still in progress
+ */
+void fifo_request_LSM() {
+    if(!i2c_async_pending(&lsm_status_txn) && !i2c_async_pending(&lsm_data_txn) && !lsm_fifo_left) {
+        i2c_async_submit(&lsm_status_txn);
+    }
+}
+
+// chip timestamp to microseconds, modulo 2^32 like micros(): wraps after about 71 minutes, consumers take unsigned
+// differences. The tick counter itself wraps after 2^32 ticks, about 26 hours, one interval is wrong then
+unsigned long ts_mus_LSM(uint32_t ts) {
+    return (unsigned long)((uint64_t)ts * (uint64_t)(LSM_TS_LSB_MUS * 100) / 100);
+}
+
+bool fifo_pop_LSM(LSMRing* r, float raw[3], float lsb, unsigned long* t_mus) {
+    uint32_t primask = i2c_lock();
+    if(r->head == r->tail) {
+        i2c_unlock(primask);
+        return false;
+    }
+    LSMSample s = r->s[r->head];
+    r->head = (r->head + 1) & (LSM_RING_LEN - 1);
+    i2c_unlock(primask);
+    raw[0] = s.xyz[0] * lsb / 1000;
+    raw[1] = s.xyz[1] * lsb / 1000;
+    raw[2] = s.xyz[2] * lsb / 1000;
+    axes_LSM(raw);
+    *t_mus = ts_mus_LSM(s.ts);
+    return true;
+}
+
+/* oldest batched sensor hub sample, the raw bytes of the slaves in order, false if none is left */
+bool hub_fifo_LSM(uint8_t data[LSM_HUB_BYTES], unsigned long* t_mus) {
+    uint32_t primask = i2c_lock();
+    if(lsm_hub_ring.head == lsm_hub_ring.tail) {
+        i2c_unlock(primask);
+        return false;
+    }
+    LSMHubSample* s = &lsm_hub_ring.s[lsm_hub_ring.head];
+    memcpy(data, s->data, LSM_HUB_BYTES);
+    *t_mus = ts_mus_LSM(s->ts);
+    lsm_hub_ring.head = (lsm_hub_ring.head + 1) & (LSM_RING_LEN - 1);
+    i2c_unlock(primask);
+    return true;
+}
+
+/* oldest batched accel sample, in gravity, false if none is left */
+bool accel_fifo_LSM(float raw[3], unsigned long* t_mus) {
+    return fifo_pop_LSM(&lsm_acc_ring, raw, LSM_ACCEL_MG_LSB, t_mus);
+}
+
+/* oldest batched gyro sample, in deg per second, false if none is left */
+bool gyro_fifo_LSM(float raw[3], unsigned long* t_mus) {
+    return fifo_pop_LSM(&lsm_gyr_ring, raw, LSM_GYRO_MDPS_LSB, t_mus);
+}
+
+void print_fifo_stats_LSM() {
+    Serial.print("LSM6DSV, FIFO, WORDS, ");Serial.print(lsm_fifo_words);
+    Serial.print(", BURSTS, ");Serial.print(lsm_fifo_bursts);
+    Serial.print(", OVR, ");Serial.print(lsm_fifo_overruns);
+    Serial.print(", ACC_DROPPED, ");Serial.print(lsm_acc_ring.dropped);
+    Serial.print(", GYRO_DROPPED, ");Serial.print(lsm_gyr_ring.dropped);
+    Serial.print(", HUB_DROPPED, ");Serial.println(lsm_hub_ring.dropped);
+    lsm_hub_ring.dropped = 0;
+    lsm_fifo_words = 0;
+    lsm_fifo_bursts = 0;
+    lsm_fifo_overruns = 0;
+    lsm_acc_ring.dropped = 0;
+    lsm_gyr_ring.dropped = 0;
+}
+
 /* returns values in gravity */
 void accel_readings_LSM(float raw[3]) {
     sfe_lsm_data_t accelData;
@@ -10,6 +10,7 @@
  * should be.
  *
  * I'm considering to add a SPI interface to the main GAZER board and move to the 5 wires cable
+ * (supported: direct SPI with DMA transfers, selected by sensors() when the chip answers on SPI)
  *
  * Created by Massimo Tasso, July, 13, 2023
  * Released under GPLv3 License - see LICENSE file for details.
@@ -26,11 +27,16 @@
  *       the kalman smoothing is entirely optional (even if we use it)
  * 
  *       i2c module for this sensor can be found on github
+ *
+ *       The native I2C interface of the PNI board is supported too: sensors() selects it
+ *       when the chip answers at RM3100_I2C_ADDRESS, the bridge is then not used at all.
  ******/
 
 #include <Arduino.h>
 #include <SimpleKalmanFilter.h>
 //#include "SimpleKalmanFilter.h"
+#include <SPI.h>
+#include "i2c_async.h"
 
 // SC18IS601B bridge values
 #define BRIDGE_SPICLK_1843_kHz 0B00  // 1.8 MBit/s -- too fast for RM3100
@@ -59,6 +65,18 @@
 #define RM3100_CCY0_REG   0x07   // Hexadecimal address for the Cycle Count X0 internal register
 #define RM3100_CCZ1_REG   0x08   // Hexadecimal address for the Cycle Count X1 internal register
 #define RM3100_CCZ0_REG   0x09   // Hexadecimal address for the Cycle Count X0 internal register
+#define RM3100_MX2_REG    0x24   // Hexadecimal address for the first Measurement Results internal register
+
+/*
+ * Measurement burst: one autoincrement read of the 9 bytes MX2..MZ0 (0x24..0x2C).
+ * When polling, STATUS (0x34) is read first, in a transfer of its own, and the burst follows only if
+ * DRDY is set: a read of the measurement result registers clears DRDY (RM3100 User Manual, STATUS
+ * register 0x34), so a STATUS byte clocked out after them could not tell a new measurement.
+ */
+#define RM3100_MEAS_LEN     9
+#define RM3100_DRDY_BIT     0x80     // in STATUS
+enum rm3100_phase { RM3100_PHASE_STATUS, RM3100_PHASE_MEAS };
+#define BRIDGE_TIMEOUT_MUS  3000   // the longest burst takes less than 1 ms on the wires
 //options
 #define initialCC 200  // Cycle count default = 200 (lower cycle count = higher data rates but lower resolution)
 /*
@@ -67,22 +85,55 @@
  * 100      26 nT        20 nT         850/3
  * 200      13 nT        15 nT         440/3
  * 400     (8 nT)?      (10 nT)?       200/3
+ * i.e. a 3 axis measurement takes about RM3100_MEAS_BASE_MUS + RM3100_MEAS_CC_MUS * CC
  */
+#define RM3100_MEAS_BASE_MUS 227.0
+#define RM3100_MEAS_CC_MUS   33.0
+#define RM3100_MEAS_MARGIN   0.9    // the measurement takes at most 90% of the TMRC period
 
 // this magnetometer is not very noisy. Kalman smoothing may not even be required.
 #define K_ERR_M_RM3100 0.08   // kalman filter error estimate - value defined observing plots of raw mag axis reading and kalman smoothed
 #define K_Q_M_RM3100   0.01   // kalman filter process variance - value defined observing plots of raw mag axis reading and kalman smoothed
 
+/*
+ * DRDY acquisition
+ * The RM3100 raises its DRDY line when a measurement is completed. If the line is wired to the Teensy
+ * the ISR latches the time and raises a flag, and loop() reads the data bytes only when a sample exists.
+ * If the line is not wired (no edge seen at init) the driver falls back to polling the status register.
+ */
+#define RM3100_DRDY_PIN 2            // Teensy pin wired to the RM3100 DRDY line - set to -1 if not wired
+#define RM3100_DRDY_TIMEOUT_MS 100   // slowest TMRC setting (37 Hz) completes a measurement every 27 ms
+
+#define RM3100_DATARATE 150          // the single transaction burst makes 150 Hz affordable even through the bridge
+
 uint8_t revid;
 uint16_t cycleCount;
 float gain;
 
+bool RM3100_DRDY = false;                         // true when DRDY has been detected at init
+volatile bool rm3100_data_ready = false;          // set by the ISR, cleared when the sample is read
+volatile unsigned long rm3100_drdy_time = 0;      // micros() of the last DRDY edge
+unsigned long rm3100_due_time = 0;                // micros() of the first request of a sample that was not yet ready
+unsigned long rm3100_poll_cost_mus = 0;           // cost of a single status register poll through the bridge
+unsigned long rm3100_saved_mus = 0;               // wait time removed by DRDY since last report
+unsigned long rm3100_waited_mus = 0;              // wait time spent polling the status register since last report
+unsigned long rm3100_stats_time = 0;              // micros() of the last report
+
 void initSPI();
+void initDRDY();
+bool bridgeWrite(const uint8_t* data, uint8_t len);
+bool bridgeRead(uint8_t* data, uint8_t len);
 uint8_t readReg(uint8_t reg);
 void changeCycleCount(uint16_t newCC);
+uint16_t cycleCount_RM3100(int rate);
 void writeReg(uint8_t reg, uint8_t value);
 void setDataRate_RM3100(int rate);
 
+void rm3100_drdy_isr() {
+  rm3100_drdy_time = micros();
+  rm3100_data_ready = true;
+}
+
 
 bool init_magnetometer_R3100(void) {
   Serial.println("Starting RM3100");
@@ -92,22 +143,70 @@ bool init_magnetometer_R3100(void) {
   if(revid!=0x22) {
     return false;
   }
-  changeCycleCount(initialCC); //set the cycle count;
+  changeCycleCount(cycleCount_RM3100(RM3100_DATARATE)); //set the cycle count;
   cycleCount = readReg(RM3100_CCX1_REG);
   cycleCount = (cycleCount << 8) | readReg(RM3100_CCX0_REG);
   
   gain = (0.3671 * (float)cycleCount) + 1.5; //linear equation to calculate the gain from cycle count
-  Serial.print("Gain = "); //display gain; default gain should be around 75 for the default cycle count of 200
+  Serial.print("Gain = "); //display gain; about 65 for the cycle count of 174 at 150 Hz
   Serial.println(gain);
   Serial.println();
-  setDataRate_RM3100(75); // this is the fastest that the shity chinese board can tolerate :-(
+  setDataRate_RM3100(RM3100_DATARATE); // 75 was the fastest the shity chinese board could tolerate with two bridged transfers per sample :-(
+
+  unsigned long t0 = micros();
+  readReg(RM3100_STATUS_REG);
+  rm3100_poll_cost_mus = micros() - t0;
 
   // Enable transmission to take continuous measurement with Alarm functions off
   writeReg(RM3100_CMM_REG, 0x79);
+  initDRDY();
+  rm3100_stats_time = micros();
 
   return true;
 }
 
+/*
+ * Attaches the DRDY interrupt and waits for the first measurement of the continuous mode.
+ * If no edge comes within RM3100_DRDY_TIMEOUT_MS the line is considered not wired.
+ */
+void initDRDY() {
+#if RM3100_DRDY_PIN >= 0
+  pinMode(RM3100_DRDY_PIN, INPUT_PULLDOWN);
+  attachInterrupt(digitalPinToInterrupt(RM3100_DRDY_PIN), rm3100_drdy_isr, RISING);
+  unsigned long start = millis();
+  while(!rm3100_data_ready && (millis() - start) < RM3100_DRDY_TIMEOUT_MS);
+  if(rm3100_data_ready || digitalRead(RM3100_DRDY_PIN)) {
+    RM3100_DRDY = true;
+    Serial.println("RM3100 DRDY interrupt acquisition");
+  } else {
+    detachInterrupt(digitalPinToInterrupt(RM3100_DRDY_PIN));
+    Serial.println("RM3100 DRDY not wired, polling status register");
+  }
+#endif
+}
+
+/*
+ * DRDY mode: true if a measurement is waiting to be read.
+ * The pin level is checked too, an edge lost while the previous sample was pending would stall the acquisition
+ */
+bool rm3100_sample_ready() {
+#if RM3100_DRDY_PIN >= 0
+  if(rm3100_data_ready || digitalRead(RM3100_DRDY_PIN)) {
+    if(rm3100_due_time && (long)(rm3100_drdy_time - rm3100_due_time) > 0) {
+      rm3100_saved_mus += rm3100_drdy_time - rm3100_due_time;  // time the polling loop would have spun
+    }
+    rm3100_saved_mus += rm3100_poll_cost_mus;                   // at least one status poll is never issued
+    rm3100_due_time = 0;
+    rm3100_data_ready = false;
+    return true;
+  }
+  if(!rm3100_due_time) {
+    rm3100_due_time = micros();
+  }
+#endif
+  return false;
+}
+
 /*
 * RM3100 adopts the NED convention
 * when X (the arrow) is pointing North, Y points at East and Z points Down
@@ -116,6 +215,7 @@ bool init_magnetometer_R3100(void) {
 * however the lousy chinese board seems to be erroneously assembled, therefore
 * axes are inverted so that azimut direction is computed as required
 *   E : 90°, S : 180°, W : 270°, N : 0/360°
+* the readings functions return the chip axes, this remap is folded in the magnetometer transform, see sensors.h
 */
 void mag_axes_RM3100(float raw[3]) {
   float north = -raw[0];  // right direction becomes front
@@ -127,41 +227,48 @@ void mag_axes_RM3100(float raw[3]) {
   raw[2] = down;
 }
 
-// void mag_readings_RM3100(float mag_raw[3], bool smooth=true) {
-void mag_readings_RM3100(float mag_raw[3]) {
+/*
+ * Asynchronous burst: the command transaction starts the SPI transfer on the bridge, the read
+ * transaction fetches the bridge buffer. The bridge does not acknowledge while the SPI transfer
+ * is in progress, the read is then resubmitted from its completion callback until it succeeds.
+ */
+uint8_t rm3100_burst_cmd[RM3100_MEAS_LEN + 2];
+uint8_t rm3100_burst_rx[RM3100_MEAS_LEN + 1];   // 1st byte is dummy data generated by the bridge
+I2CTransaction rm3100_cmd_txn = {I2CAddress, I2C_DEV_MAG, rm3100_burst_cmd, RM3100_MEAS_LEN + 2, NULL, 0, NULL, I2C_TXN_IDLE, 0};
+I2CTransaction rm3100_rx_txn;
+uint8_t rm3100_phase = RM3100_PHASE_MEAS;
+
+void rm3100_rx_done(I2CTransaction* t) {
+  if(t->status == I2C_TXN_NACK && (micros() - rm3100_cmd_txn.submit_time) < BRIDGE_TIMEOUT_MUS) {
+    i2c_async_submit(t);
+  }
+}
+
+/*
+ * Queues the reading, in a single bridged transfer, of
+ * X/Y/Z (phase RM3100_PHASE_MEAS) or STATUS (RM3100_PHASE_STATUS)
+ */
+bool requestBurst_RM3100(uint8_t phase) {
+  uint8_t len = phase == RM3100_PHASE_STATUS ? 1 : RM3100_MEAS_LEN;
+  rm3100_phase = phase;
+  rm3100_burst_cmd[0] = 0x01;                  // function to send to SS0 of bridge
+  rm3100_burst_cmd[1] = (phase == RM3100_PHASE_STATUS ? RM3100_STATUS_REG : RM3100_MX2_REG) | 0x80; // first register to be read, 0x80 sets the read bit
+  memset(rm3100_burst_cmd + 2, 0xFF, len);
+  rm3100_cmd_txn.tx_len = len + 2;
+  rm3100_rx_txn = {I2CAddress, I2C_DEV_MAG, NULL, 0, rm3100_burst_rx, (uint8_t)(len + 1), rm3100_rx_done, I2C_TXN_IDLE, 0};
+  return i2c_async_submit(&rm3100_cmd_txn) && i2c_async_submit(&rm3100_rx_txn);
+}
+
+/*
+ * data holds the 9 measurement bytes, MX2 first
+ */
+void decode_RM3100(const uint8_t* data, float mag_raw[3]) {
   long x = 0;
   long y = 0;
   long z = 0;
-  uint8_t x2,x1,x0,y2,y1,y0,z2,z1,z0;
-  //wait until data is ready using polling method
-  while((readReg(RM3100_STATUS_REG) & 0x80) != 0x80); //read internal status register
-
-  //read measurements
-  Wire.beginTransmission(I2CAddress);
-  Wire.write(0x01);         // function to send to SS0 of bridge
-  Wire.write(0xA4);         // data payload 1 byte --> address of register to be read  or 0x80 to set the read bit
-  Wire.write(0xFF);
-  Wire.write(0xFF);
-  Wire.write(0xFF);
-  Wire.write(0xFF);
-  Wire.write(0xFF);
-  Wire.write(0xFF);
-  Wire.write(0xFF);
-  Wire.write(0xFF);
-  Wire.write(0xFF);
-  Wire.endTransmission();
-  delay(1);
-  Wire.requestFrom(I2CAddress, 10);
-  Wire.read(); // consume dummy data generated by the bridge
-  x2 = Wire.read();  // receive a byte as character
-  x1 = Wire.read();  // receive a byte as character
-  x0 = Wire.read();  // receive a byte as character
-  y2 = Wire.read();  // receive a byte as character
-  y1 = Wire.read();  // receive a byte as character
-  y0 = Wire.read();  // receive a byte as character
-  z2 = Wire.read();  // receive a byte as character
-  z1 = Wire.read();  // receive a byte as character
-  z0 = Wire.read();  // receive a byte as character
+  uint8_t x2 = data[0], x1 = data[1], x0 = data[2];
+  uint8_t y2 = data[3], y1 = data[4], y0 = data[5];
+  uint8_t z2 = data[6], z1 = data[7], z0 = data[8];
   // Serial.print("READINGS Z  - z2: ");Serial.print(z2, HEX);Serial.print(" z1: ");Serial.print(z1, HEX);Serial.print(" z0: ");Serial.println(z0, HEX);
 
   //special bit manipulation since there is not a 24 bit signed int data type
@@ -189,13 +296,321 @@ void mag_readings_RM3100(float mag_raw[3]) {
   mag_raw[0] = (float)(x)/gain;
   mag_raw[1] = (float)(y)/gain;
   mag_raw[2] = (float)(z)/gain;
+}
+
+/*
+ * returns false, without touching mag_raw, if no new measurement is available yet
+ * - DRDY mode: no bus traffic at all until the DRDY interrupt has fired
+ * - polling mode: STATUS is read first, the burst is queued when it tells a new measurement exists
+ * The transfers are asynchronous: the call that queues one returns false, the sample is
+ * returned by the first call after the burst is completed.
+ */
+// void mag_readings_RM3100(float mag_raw[3], bool smooth=true) {
+bool mag_readings_RM3100(float mag_raw[3]) {
+  if(i2c_async_pending(&rm3100_cmd_txn) || i2c_async_pending(&rm3100_rx_txn)) {
+    return false;
+  }
+  if(rm3100_rx_txn.status == I2C_TXN_IDLE) {
+    if(!RM3100_DRDY) {
+      requestBurst_RM3100(RM3100_PHASE_STATUS);
+    } else if(rm3100_sample_ready()) {
+      requestBurst_RM3100(RM3100_PHASE_MEAS);
+    }
+    return false;
+  }
+  bool completed = rm3100_cmd_txn.status == I2C_TXN_OK && rm3100_rx_txn.status == I2C_TXN_OK;
+  rm3100_rx_txn.status = I2C_TXN_IDLE;   // consumed
+  if(!completed) {
+    return false;
+  }
+  const uint8_t* burst = rm3100_burst_rx + 1;
+  if(rm3100_phase == RM3100_PHASE_STATUS) {
+    if(burst[0] & RM3100_DRDY_BIT) {
+      requestBurst_RM3100(RM3100_PHASE_MEAS);
+    } else {
+      rm3100_waited_mus += micros() - rm3100_cmd_txn.submit_time;   // bus time spent on a sample that was not ready
+    }
+    return false;
+  }
+  decode_RM3100(burst, mag_raw);
 
   // if(smooth) {
   //   mag_raw[0] = kf_r_mx.updateEstimate(mag_raw[0]);
   //   mag_raw[1] = kf_r_my.updateEstimate(mag_raw[1]);
   //   mag_raw[2] = kf_r_mz.updateEstimate(mag_raw[2]);
   // }
-  mag_axes_RM3100(mag_raw);
+  return true;
+}
+
+/*
+ * Prints the acquisition wait time, in microseconds per second, since the previous report
+ * - saved:  wait time removed by the DRDY acquisition
+ * - waited: bus time spent on STATUS reads telling the sample is not ready (polling mode)
+ */
+void print_stats_RM3100() {
+  unsigned long now = micros();
+  float seconds = (now - rm3100_stats_time) / 1000000.0;
+  Serial.print("RM3100, ");Serial.print(RM3100_DRDY ? "DRDY" : "POLL");
+  Serial.print(", SAVED_MUS_S, ");Serial.print(rm3100_saved_mus / seconds, 0);
+  Serial.print(", WAITED_MUS_S, ");Serial.println(rm3100_waited_mus / seconds, 0);
+  rm3100_saved_mus = 0;
+  rm3100_waited_mus = 0;
+  rm3100_stats_time = now;
+}
+
+/*
+ * Native I2C board (PNI breakout)
+ * plain register accesses, no bridge: the configuration writes the cycle counts in a single
+ * transaction and a sample is a single asynchronous burst read, 9 bytes from MX2, when DRDY
+ * or, polling, a STATUS read tells a sample is there. The same functions configure the board
+ * when it is wired to the LSM6DSV16X auxiliary bus (sensor hub mode).
+ *
+ * The measurement time depends on the cycle count, the rate is reachable only with a low
+ * enough cycle count (see the table above): cycleCount_RM3100() picks the highest cycle
+ * count, i.e. the lowest noise, whose measurement fits in the TMRC period (174 at 150 Hz, 84 at 300 Hz,
+ * 38 at 600 Hz). rate_RM3100() reports the rate actually achieved with the cycle count in use.
+ */
+#define RM3100_I2C_ADDRESS  0x20     // SA0 and SA1 tied low
+#define RM3100_I2C_DATARATE 150      // 150, 300 or 600 Hz
+
+uint8_t rm3100_i2c_reg = RM3100_MX2_REG;
+uint8_t rm3100_i2c_rx[RM3100_MEAS_LEN];
+I2CTransaction rm3100_i2c_txn = {RM3100_I2C_ADDRESS, I2C_DEV_MAG, &rm3100_i2c_reg, 1, rm3100_i2c_rx, RM3100_MEAS_LEN, NULL, I2C_TXN_IDLE, 0};
+
+// STATUS (1 byte) or X/Y/Z (9 bytes from MX2)
+bool request_I2C_RM3100(uint8_t phase) {
+  rm3100_i2c_reg = phase == RM3100_PHASE_STATUS ? RM3100_STATUS_REG : RM3100_MX2_REG;
+  rm3100_i2c_txn.rx_len = phase == RM3100_PHASE_STATUS ? 1 : RM3100_MEAS_LEN;
+  return i2c_async_submit(&rm3100_i2c_txn);
+}
+
+uint8_t tmrc_RM3100(int rate);
+
+void writeReg_I2C_RM3100(uint8_t reg, const uint8_t* data, uint8_t len) {
+  Wire.beginTransmission(RM3100_I2C_ADDRESS);
+  Wire.write(reg);
+  Wire.write(data, len);
+  Wire.endTransmission();
+}
+
+uint8_t readReg_I2C_RM3100(uint8_t reg) {
+  Wire.beginTransmission(RM3100_I2C_ADDRESS);
+  Wire.write(reg);
+  if(Wire.endTransmission(false) != 0 || Wire.requestFrom(RM3100_I2C_ADDRESS, 1) != 1) {
+    return 0;
+  }
+  return Wire.read();
+}
+
+uint16_t cycleCount_RM3100(int rate) {
+  float cc = (RM3100_MEAS_MARGIN * 1e6 / rate - RM3100_MEAS_BASE_MUS) / RM3100_MEAS_CC_MUS;
+  return constrain((int)cc, 1, initialCC);
+}
+
+// Hz, highest 3 axis rate with the cycle count cc
+int maxRate_RM3100(uint16_t cc) {
+  return 1e6 / (RM3100_MEAS_BASE_MUS + RM3100_MEAS_CC_MUS * cc);
+}
+
+/*
+ * continuous measurement at rate, returns false if the chip does not answer
+ * write and read are the register accessors of the interface (native I2C or SPI)
+ */
+bool config_RM3100(int rate, void (*write)(uint8_t reg, const uint8_t* data, uint8_t len), uint8_t (*read)(uint8_t reg)) {
+  if(read(RM3100_REVID_REG) != 0x22) {
+    return false;
+  }
+  cycleCount = cycleCount_RM3100(rate);
+  uint8_t CCMSB = cycleCount >> 8;
+  uint8_t CCLSB = cycleCount & 0xFF;
+  uint8_t cc[6] = {CCMSB, CCLSB, CCMSB, CCLSB, CCMSB, CCLSB};
+  write(RM3100_CCX1_REG, cc, 6);
+  gain = (0.3671 * (float)cycleCount) + 1.5;
+  uint8_t tmrc = tmrc_RM3100(rate);
+  write(RM3100_TMRC_REG, &tmrc, 1);
+  uint8_t cmm = 0x79;                // continuous measurement of the three axes
+  write(RM3100_CMM_REG, &cmm, 1);
+  return true;
+}
+
+bool config_I2C_RM3100(int rate) {
+  return config_RM3100(rate, writeReg_I2C_RM3100, readReg_I2C_RM3100);
+}
+
+bool init_hub_RM3100(void) {
+  return config_I2C_RM3100(RM3100_DATARATE);
+}
+
+bool init_magnetometer_RM3100_I2C(void) {
+  if(!config_I2C_RM3100(RM3100_I2C_DATARATE)) {
+    return false;
+  }
+  Serial.println("Starting RM3100, native I2C");
+  Serial.print("Gain = ");
+  Serial.println(gain);
+
+  unsigned long t0 = micros();
+  readReg_I2C_RM3100(RM3100_STATUS_REG);
+  rm3100_poll_cost_mus = micros() - t0;
+
+  initDRDY();
+  rm3100_stats_time = micros();
+  return true;
+}
+
+/*
+ * same contract as mag_readings_RM3100(), with single burst reads at the native address
+ */
+bool mag_readings_RM3100_I2C(float mag_raw[3]) {
+  if(i2c_async_pending(&rm3100_i2c_txn)) {
+    return false;
+  }
+  if(rm3100_i2c_txn.status == I2C_TXN_IDLE) {
+    if(!RM3100_DRDY) {
+      request_I2C_RM3100(RM3100_PHASE_STATUS);
+    } else if(rm3100_sample_ready()) {
+      request_I2C_RM3100(RM3100_PHASE_MEAS);
+    }
+    return false;
+  }
+  bool completed = rm3100_i2c_txn.status == I2C_TXN_OK;
+  rm3100_i2c_txn.status = I2C_TXN_IDLE;   // consumed
+  if(!completed) {
+    return false;
+  }
+  if(rm3100_i2c_reg == RM3100_STATUS_REG) {
+    if(rm3100_i2c_rx[0] & RM3100_DRDY_BIT) {
+      request_I2C_RM3100(RM3100_PHASE_MEAS);
+    } else {
+      rm3100_waited_mus += micros() - rm3100_i2c_txn.submit_time;
+    }
+    return false;
+  }
+  decode_RM3100(rm3100_i2c_rx, mag_raw);
+  return true;
+}
+
+int rate_RM3100(uint8_t tmrc);
+
+int dataRate_I2C_RM3100(void) {
+  return rate_RM3100(readReg_I2C_RM3100(RM3100_TMRC_REG));
+}
+
+/*
+ * Direct SPI (LPSPI4: pins 11 MOSI, 12 MISO, 13 SCK, RM3100_SPI_CS)
+ * the configuration uses plain register transfers, a sample is a single DMA transfer started by
+ * mag_readings_RM3100_SPI() and completed by the EventResponder callback, which also releases
+ * CS: the CPU is not involved while the bytes are clocked. Without the bridge 600 Hz is affordable.
+ * Opt-in: SPI.begin() takes pin 13, the joystick button on the standard board, and drives pin 10.
+ * Set RM3100_SPI to 1 only on a board with the RM3100 on LPSPI4 and the button moved off pin 13.
+ */
+#define RM3100_SPI          0        // 1: the RM3100 is searched on SPI first
+#define RM3100_SPI_CS       10
+#define RM3100_SPI_CLOCK    1000000  // RM3100 max SPI clock is 1 MHz
+#define RM3100_SPI_DATARATE 600      // 150, 300 or 600 Hz
+
+enum rm3100_spi_state { RM3100_SPI_IDLE, RM3100_SPI_BUSY, RM3100_SPI_DONE };
+
+SPISettings rm3100_spi_settings(RM3100_SPI_CLOCK, MSBFIRST, SPI_MODE0);
+EventResponder rm3100_spi_event;
+uint8_t rm3100_spi_tx[RM3100_MEAS_LEN + 1];   // register address, then dummy bytes
+uint8_t rm3100_spi_rx[RM3100_MEAS_LEN + 1];   // 1st byte is clocked in while sending the address
+volatile uint8_t rm3100_spi_state = RM3100_SPI_IDLE;
+unsigned long rm3100_spi_start = 0;
+
+void writeReg_SPI_RM3100(uint8_t reg, const uint8_t* data, uint8_t len) {
+  SPI.beginTransaction(rm3100_spi_settings);
+  digitalWriteFast(RM3100_SPI_CS, LOW);
+  SPI.transfer(reg & 0x7F);           // read/write bit low for write
+  for(uint8_t i = 0; i < len; i++) {
+    SPI.transfer(data[i]);
+  }
+  digitalWriteFast(RM3100_SPI_CS, HIGH);
+  SPI.endTransaction();
+}
+
+uint8_t readReg_SPI_RM3100(uint8_t reg) {
+  SPI.beginTransaction(rm3100_spi_settings);
+  digitalWriteFast(RM3100_SPI_CS, LOW);
+  SPI.transfer(reg | 0x80);           // read bit
+  uint8_t value = SPI.transfer(0);
+  digitalWriteFast(RM3100_SPI_CS, HIGH);
+  SPI.endTransaction();
+  return value;
+}
+
+// interrupt context
+void rm3100_spi_done(EventResponderRef event) {
+  digitalWriteFast(RM3100_SPI_CS, HIGH);
+  SPI.endTransaction();
+  rm3100_spi_state = RM3100_SPI_DONE;
+}
+
+bool init_magnetometer_RM3100_SPI(void) {
+  pinMode(RM3100_SPI_CS, OUTPUT);
+  digitalWriteFast(RM3100_SPI_CS, HIGH);
+  SPI.begin();
+  if(!config_RM3100(RM3100_SPI_DATARATE, writeReg_SPI_RM3100, readReg_SPI_RM3100)) {
+    SPI.end();                        // no chip: the pins go back to the other drivers
+    pinMode(RM3100_SPI_CS, INPUT);
+    return false;
+  }
+  Serial.println("Starting RM3100, SPI");
+  Serial.print("Gain = ");
+  Serial.println(gain);
+
+  unsigned long t0 = micros();
+  readReg_SPI_RM3100(RM3100_STATUS_REG);
+  rm3100_poll_cost_mus = micros() - t0;
+
+  initDRDY();
+  memset(rm3100_spi_tx, 0, sizeof(rm3100_spi_tx));
+  rm3100_spi_event.attachImmediate(rm3100_spi_done);
+  rm3100_stats_time = micros();
+  return true;
+}
+
+// STATUS (1 byte) or X/Y/Z (9 bytes from MX2), as a DMA transfer
+void request_SPI_RM3100(uint8_t phase) {
+  rm3100_spi_tx[0] = (phase == RM3100_PHASE_STATUS ? RM3100_STATUS_REG : RM3100_MX2_REG) | 0x80;
+  rm3100_spi_state = RM3100_SPI_BUSY;
+  rm3100_spi_start = micros();
+  SPI.beginTransaction(rm3100_spi_settings);
+  digitalWriteFast(RM3100_SPI_CS, LOW);
+  SPI.transfer(rm3100_spi_tx, rm3100_spi_rx, 1 + (phase == RM3100_PHASE_STATUS ? 1 : RM3100_MEAS_LEN), rm3100_spi_event);
+}
+
+/*
+ * same contract as mag_readings_RM3100(), with DMA transfers on the SPI bus
+ */
+bool mag_readings_RM3100_SPI(float mag_raw[3]) {
+  if(rm3100_spi_state == RM3100_SPI_BUSY) {
+    return false;
+  }
+  if(rm3100_spi_state == RM3100_SPI_IDLE) {
+    if(!RM3100_DRDY) {
+      request_SPI_RM3100(RM3100_PHASE_STATUS);
+    } else if(rm3100_sample_ready()) {
+      request_SPI_RM3100(RM3100_PHASE_MEAS);
+    }
+    return false;
+  }
+  rm3100_spi_state = RM3100_SPI_IDLE;   // consumed
+  const uint8_t* burst = rm3100_spi_rx + 1;
+  if((rm3100_spi_tx[0] & 0x7F) == RM3100_STATUS_REG) {
+    if(burst[0] & RM3100_DRDY_BIT) {
+      request_SPI_RM3100(RM3100_PHASE_MEAS);
+    } else {
+      rm3100_waited_mus += micros() - rm3100_spi_start;
+    }
+    return false;
+  }
+  decode_RM3100(burst, mag_raw);
+  return true;
+}
+
+int dataRate_SPI_RM3100(void) {
+  return rate_RM3100(readReg_SPI_RM3100(RM3100_TMRC_REG));
 }
 
 /*
@@ -208,23 +623,51 @@ void initSPI(){
   Wire.endTransmission();
 }
 
+/*
+ * The SC18IS602B does not acknowledge its address while an SPI transfer is in progress.
+ * Rather than sleeping a fixed time after each transfer, the next I2C transaction is
+ * retried until the bridge acknowledges it, i.e. as soon as the previous transfer is completed.
+ */
+bool bridgeWrite(const uint8_t* data, uint8_t len) {
+  i2c_async_wait();
+  unsigned long start = micros();
+  do {
+    Wire.beginTransmission(I2CAddress);
+    Wire.write(data, len);
+    if(Wire.endTransmission() == 0) {
+      return true;
+    }
+  } while((micros() - start) < BRIDGE_TIMEOUT_MUS);
+  return false;
+}
+
+/*
+ * Reads back len bytes from the bridge buffer, as soon as the SPI transfer is completed
+ */
+bool bridgeRead(uint8_t* data, uint8_t len) {
+  i2c_async_wait();
+  unsigned long start = micros();
+  while(Wire.requestFrom(I2CAddress, (int)len) != len) {
+    if((micros() - start) >= BRIDGE_TIMEOUT_MUS) {
+      return false;
+    }
+  }
+  for(uint8_t i = 0; i < len; i++) {
+    data[i] = Wire.read();
+  }
+  return true;
+}
+
 /*
  * reg is the 7 bit value of the RM3100 register's address (without the R/W bit)
  */
 uint8_t readReg(uint8_t reg){
-  uint8_t data=0;
-  Wire.beginTransmission(I2CAddress);
-  Wire.write(0x01);         // function to send to SS0 of bridge
-  Wire.write(reg | 0x80);   // data payload 1 byte --> address of register to be read  or 0x80 to set the read bit
-  Wire.write(0xFF);
-  Wire.write(0xFF);
-  Wire.endTransmission();
-  delay(1);
-  Wire.requestFrom(I2CAddress, 2);  // 2 reads, 1st is dummy, 2nd is value
-  while (Wire.available()) {        // peripheral may send less than requested
-    data = Wire.read();             // receive a byte as character
+  uint8_t cmd[3] = {0x01, (uint8_t)(reg | 0x80), 0xFF};  // function to send to SS0 of bridge, register with read bit, dummy byte
+  uint8_t data[2] = {0, 0};                              // 2 reads, 1st is dummy, 2nd is value
+  if(bridgeWrite(cmd, 3)) {
+    bridgeRead(data, 2);
   }
-  return data;
+  return data[1];
 }
 
 /*
@@ -232,11 +675,8 @@ uint8_t readReg(uint8_t reg){
  * value is the 8 bit data being written
  */
 void writeReg(uint8_t reg, uint8_t value){
-  Wire.beginTransmission(I2CAddress);
-  Wire.write(0x01);       // function to send to SS0 of bridge
-  Wire.write(reg & 0x7F); //AND with 0x7F to make first bit(read/write bit) low for write
-  Wire.write(value);
-  Wire.endTransmission();
+  uint8_t cmd[3] = {0x01, (uint8_t)(reg & 0x7F), value};  // function to send to SS0 of bridge, AND with 0x7F to make first bit(read/write bit) low for write
+  bridgeWrite(cmd, 3);
 }
 
 /*
@@ -254,19 +694,19 @@ void changeCycleCount(uint16_t newCC){
   writeReg(RM3100_CCX1_REG, CCMSB);
   delay(1);
 
-  Wire.beginTransmission(I2CAddress);
-  Wire.write(0x01);  // function to send to SS0
-  Wire.write(RM3100_CCX1_REG & 0x7F); // data payload 1 byte --> AND with 0x7F to make first bit(read/write bit) low for write
-  Wire.write(CCMSB);  //write new cycle count to ccx1
-  Wire.write(CCLSB);  //write new cycle count to ccx0
-  Wire.write(CCMSB);  //write new cycle count to ccy1
-  Wire.write(CCLSB);  //write new cycle count to ccy0
-  Wire.write(CCMSB);  //write new cycle count to ccz1
-  Wire.write(CCLSB);  //write new cycle count to ccz0
-  Wire.endTransmission();
+  uint8_t cmd[8] = {0x01,                      // function to send to SS0
+                    RM3100_CCX1_REG & 0x7F,    // AND with 0x7F to make first bit(read/write bit) low for write
+                    CCMSB, CCLSB,              // new cycle count to ccx1, ccx0
+                    CCMSB, CCLSB,              // new cycle count to ccy1, ccy0
+                    CCMSB, CCLSB};             // new cycle count to ccz1, ccz0
+  bridgeWrite(cmd, 8);
 }
 
 void setDataRate_RM3100(int rate) {
+  writeReg(RM3100_TMRC_REG, tmrc_RM3100(rate));
+}
+
+uint8_t tmrc_RM3100(int rate) {
   uint8_t hexval = 0x96;
   switch(rate) {
     case 600:
@@ -294,25 +734,40 @@ void setDataRate_RM3100(int rate) {
       hexval = 0x96;
       break;
   }
-  writeReg(RM3100_TMRC_REG, hexval);
+  return hexval;
 }
 
 int dataRate_RM3100(void) {
   uint8_t tmrc = readReg(RM3100_TMRC_REG);
   Serial.print("TMRC = 0x"); //REVID ID should be 0x22
   Serial.println(tmrc, HEX);
+  return rate_RM3100(tmrc);
+}
+
+/*
+ * rate of the TMRC setting, or lower if the cycle count in use cannot deliver it
+ */
+int rate_RM3100(uint8_t tmrc) {
+  int rate;
   switch(tmrc) {
     case 0x92:
-      return 600;
+      rate = 600;
+      break;
     case 0x93:
-      return 300;
+      rate = 300;
+      break;
     case 0x94:
-      return 150;
+      rate = 150;
+      break;
     case 0x95:
-      return 75;
+      rate = 75;
+      break;
     case 0x96:
-      return 37;
+      rate = 37;
+      break;
     default:
-      return 37;
+      rate = 37;
+      break;
   }
+  return cycleCount ? min(rate, maxRate_RM3100(cycleCount)) : rate;
 }
@@ -0,0 +1,53 @@
+/******
+ * InvenSense MPU6050 gyro/accelerometer driver classes, see MPU6050.h
+ * 
+ * Released under GPLv3 License - see LICENSE file for details.
+ ******/
+#include "sensor.h"
+
+class AccMPU: public Sensor<AccMPU> {
+
+    public:
+        static constexpr float K_ERR = K_ERR_MPU_FAST;
+        static constexpr float K_Q   = K_Q_MPU_FAST;
+        static constexpr bool SMOOTH = true;         // very noisy
+        static constexpr const char* NAME = "MPU6050 Accel/Gyro";
+
+        bool init(void) {
+            return init_accelerometer_MPU6050();
+        }
+
+        int dataRate(void) {
+            return ACCEL_DATARATE_MPU6050;
+        }
+
+        // values required to be expressed in gravity units
+        inline bool read(float raw[3]) {
+            i2c_async_wait();  // the library uses the blocking Wire calls
+            accel_readings_MPU6050(raw);
+            return true;
+        }
+};
+
+class GyroMPU: public Sensor<GyroMPU> {
+
+    public:
+        static constexpr float K_ERR = K_ERR_MPU_FAST;
+        static constexpr float K_Q   = K_Q_MPU_FAST;
+        static constexpr bool SMOOTH = false;
+        static constexpr const char* NAME = "MPU6050 Gyro";
+
+        bool init(void) {
+            return true;   // configured together with the accelerometer
+        }
+
+        int dataRate(void) {
+            return ACCEL_DATARATE_MPU6050;
+        }
+
+        inline bool read(float raw[3]) {
+            i2c_async_wait();
+            gyro_readings_MPU6050(raw);
+            return true;
+        }
+};
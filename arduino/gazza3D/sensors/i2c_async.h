@@ -0,0 +1,277 @@
+/******
+ * Asynchronous I2C transactions on the Teensy 4.0 LPI2C1 peripheral (the Wire bus, pins 18/19)
+ *
+ * A driver describes a transfer with an I2CTransaction (device address, bytes to write, buffer
+ * to read into, completion callback) and submits it to the queue. The LPI2C interrupt runs the
+ * queued transactions one after the other, so loop() carries on filtering and formatting the
+ * output while the bus is busy. The driver finds the result in the transaction status, or in
+ * its callback, which is called in interrupt context and may resubmit the transaction.
+ *
+ * The sensor libraries (SparkFun, Adafruit, MPU6050_light) keep using the blocking Wire calls on
+ * the same peripheral: i2c_async_wait() must be called before any of them, it returns as soon as
+ * the queue is drained.
+ *
+ * Counters: queue depth per device (current and max), completed and failed transactions, retries (failed
+ * transactions resubmitted by their callback, e.g. the NACKs of the busy RM3100 bridge) and bus utilisation,
+ * i.e. the fraction of time the bus is busy with asynchronous transactions.
+ *
+ * Released under GPLv3 License - see LICENSE file for details.
+ ******/
+
+#ifndef I2C_ASYNC
+#define I2C_ASYNC
+
+#include <Arduino.h>
+
+#define I2C_QUEUE_LEN        8     // must be a power of 2
+#define I2C_TX_FIFO          4     // LPI2C transmit fifo depth on the iMXRT1062
+#define I2C_WAIT_TIMEOUT_MUS 5000  // a stuck transaction is aborted after this time
+#define I2C_NO_COMMAND       0xFFFF
+
+enum i2c_device { I2C_DEV_MAG, I2C_DEV_ACC, I2C_DEV_COUNT };
+const char* i2c_device_name[I2C_DEV_COUNT] = {"MAG", "ACC"};
+
+enum i2c_status { I2C_TXN_IDLE, I2C_TXN_QUEUED, I2C_TXN_BUSY, I2C_TXN_OK, I2C_TXN_NACK, I2C_TXN_ERROR };
+
+struct I2CTransaction {
+    uint8_t address;                    // 7 bit device address
+    uint8_t device;                     // i2c_device the transaction is accounted to
+    const uint8_t* tx;                  // bytes to write, typically the register address - may be NULL
+    uint8_t tx_len;
+    uint8_t* rx;                        // buffer for the bytes read after a repeated start - may be NULL
+    uint8_t rx_len;
+    void (*done)(I2CTransaction* t);    // completion callback, interrupt context - may be NULL
+    volatile uint8_t status;
+    unsigned long submit_time;          // micros() of the submission
+};
+
+struct I2CDeviceStats {
+    volatile uint8_t depth;             // transactions queued or running
+    uint8_t max_depth;
+    unsigned long completed;
+    unsigned long errors;
+    unsigned long retries;
+};
+
+I2CTransaction* volatile i2c_queue[I2C_QUEUE_LEN];
+volatile uint8_t i2c_head = 0;          // next transaction to run
+volatile uint8_t i2c_tail = 0;          // next free slot
+I2CTransaction* volatile i2c_current = NULL;
+uint8_t i2c_cmd_index = 0;              // commands of the current transaction already in the transmit fifo
+uint8_t i2c_rx_index = 0;               // bytes of the current transaction already received
+bool i2c_in_callback = false;           // a completion callback is running, i2c_finish() starts the next transaction
+
+I2CDeviceStats i2c_stats[I2C_DEV_COUNT];
+unsigned long i2c_txn_start = 0;
+volatile unsigned long i2c_busy_mus = 0;
+unsigned long i2c_stats_time = 0;
+
+void i2c_isr();
+
+// interrupts must be masked also when submitting from a completion callback
+static inline uint32_t i2c_lock() {
+    uint32_t primask;
+    __asm__ volatile("mrs %0, primask\n" "cpsid i\n" : "=r" (primask) :: "memory");
+    return primask;
+}
+
+static inline void i2c_unlock(uint32_t primask) {
+    __asm__ volatile("msr primask, %0\n" :: "r" (primask) : "memory");
+}
+
+/*
+ * to be called after Wire.begin() and Wire.setClock(), which configure the peripheral
+ */
+void i2c_async_begin() {
+    LPI2C1_MIER = 0;
+    attachInterruptVector(IRQ_LPI2C1, i2c_isr);
+    NVIC_SET_PRIORITY(IRQ_LPI2C1, 64);
+    NVIC_ENABLE_IRQ(IRQ_LPI2C1);
+    i2c_stats_time = micros();
+}
+
+/*
+ * i-th command word of the transaction
+ * START+W, register bytes, [repeated START+R, RECEIVE n], STOP
+ */
+uint16_t i2c_command(I2CTransaction* t, uint8_t i) {
+    uint8_t n = 0;
+    if(t->tx_len || !t->rx_len) {
+        if(i == 0) return LPI2C_MTDR_CMD_START | (t->address << 1);
+        if(i <= t->tx_len) return LPI2C_MTDR_CMD_TRANSMIT | t->tx[i - 1];
+        n = t->tx_len + 1;
+    }
+    if(t->rx_len) {
+        if(i == n) return LPI2C_MTDR_CMD_START | (t->address << 1) | 1;
+        if(i == n + 1) return LPI2C_MTDR_CMD_RECEIVE | (t->rx_len - 1);
+        n += 2;
+    }
+    if(i == n) return LPI2C_MTDR_CMD_STOP;
+    return I2C_NO_COMMAND;
+}
+
+void i2c_start_next() {
+    if(i2c_head == i2c_tail) {
+        LPI2C1_MIER = 0;
+        return;
+    }
+    I2CTransaction* t = i2c_queue[i2c_head];
+    i2c_head = (i2c_head + 1) & (I2C_QUEUE_LEN - 1);
+    i2c_cmd_index = 0;
+    i2c_rx_index = 0;
+    t->status = I2C_TXN_BUSY;
+    i2c_current = t;
+    i2c_txn_start = micros();
+    LPI2C1_MSR = LPI2C_MSR_EPF | LPI2C_MSR_SDF | LPI2C_MSR_NDF | LPI2C_MSR_ALF | LPI2C_MSR_FEF | LPI2C_MSR_PLTF;
+    // TDF is set as long as the transmit fifo has room: the interrupt fires right away and loads the commands
+    LPI2C1_MIER = LPI2C_MIER_TDIE | LPI2C_MIER_RDIE | LPI2C_MIER_SDIE | LPI2C_MIER_NDIE | LPI2C_MIER_ALIE | LPI2C_MIER_FEIE;
+}
+
+void i2c_finish(I2CTransaction* t, uint8_t status) {
+    I2CDeviceStats* s = &i2c_stats[t->device];
+    i2c_busy_mus += micros() - i2c_txn_start;
+    s->depth--;
+    i2c_current = NULL;
+    t->status = status;
+    if(t->done) {
+        i2c_in_callback = true;
+        t->done(t);
+        i2c_in_callback = false;
+    }
+    if(status == I2C_TXN_OK) {
+        s->completed++;
+    } else if(t->status == I2C_TXN_QUEUED) {
+        s->retries++;                   // resubmitted by the callback, an expected failure
+    } else {
+        s->errors++;
+    }
+    if(!i2c_current) {
+        i2c_start_next();
+    }
+}
+
+void i2c_isr() {
+    uint32_t msr = LPI2C1_MSR;
+    I2CTransaction* t = i2c_current;
+    if(!t) {
+        LPI2C1_MIER = 0;
+        return;
+    }
+    if(msr & (LPI2C_MSR_NDF | LPI2C_MSR_ALF | LPI2C_MSR_FEF)) {
+        // the master sends the STOP on its own after a NACK, the commands left in the fifos are dropped
+        LPI2C1_MCR |= LPI2C_MCR_RTF | LPI2C_MCR_RRF;
+        LPI2C1_MSR = LPI2C_MSR_NDF | LPI2C_MSR_ALF | LPI2C_MSR_FEF;
+        i2c_finish(t, (msr & LPI2C_MSR_NDF) ? I2C_TXN_NACK : I2C_TXN_ERROR);
+        return;
+    }
+    while((LPI2C1_MFSR >> 16) & 0x07) {   // RXCOUNT
+        uint8_t data = LPI2C1_MRDR;
+        if(i2c_rx_index < t->rx_len) {
+            t->rx[i2c_rx_index++] = data;
+        }
+    }
+    while((LPI2C1_MFSR & 0x07) < I2C_TX_FIFO) {   // TXCOUNT
+        uint16_t cmd = i2c_command(t, i2c_cmd_index);
+        if(cmd == I2C_NO_COMMAND) {
+            LPI2C1_MIER &= ~LPI2C_MIER_TDIE;      // all commands loaded, only receive and stop are left
+            break;
+        }
+        LPI2C1_MTDR = cmd;
+        i2c_cmd_index++;
+    }
+    if(msr & LPI2C_MSR_SDF) {
+        LPI2C1_MSR = LPI2C_MSR_SDF;
+        i2c_finish(t, I2C_TXN_OK);
+    }
+}
+
+/*
+ * Queues the transaction, returns false if the queue is full
+ * the transaction and its buffers must stay valid until it is completed
+ */
+bool i2c_async_submit(I2CTransaction* t) {
+    uint32_t primask = i2c_lock();
+    uint8_t next = (i2c_tail + 1) & (I2C_QUEUE_LEN - 1);
+    if(next == i2c_head) {
+        i2c_unlock(primask);
+        return false;
+    }
+    I2CDeviceStats* s = &i2c_stats[t->device];
+    t->status = I2C_TXN_QUEUED;
+    t->submit_time = micros();
+    i2c_queue[i2c_tail] = t;
+    i2c_tail = next;
+    s->depth++;
+    if(s->depth > s->max_depth) {
+        s->max_depth = s->depth;
+    }
+    if(!i2c_current && !i2c_in_callback) {
+        i2c_start_next();
+    }
+    i2c_unlock(primask);
+    return true;
+}
+
+bool i2c_async_pending(I2CTransaction* t) {
+    return t->status == I2C_TXN_QUEUED || t->status == I2C_TXN_BUSY;
+}
+
+bool i2c_async_busy() {
+    return i2c_current != NULL || i2c_head != i2c_tail;
+}
+
+/*
+ * Waits until the queue is drained, so that the blocking Wire calls can use the bus.
+ * A transaction still running after I2C_WAIT_TIMEOUT_MUS is aborted together with the queue.
+ */
+bool i2c_async_wait() {
+    unsigned long start = micros();
+    while(i2c_async_busy()) {
+        if((micros() - start) >= I2C_WAIT_TIMEOUT_MUS) {
+            uint32_t primask = i2c_lock();
+            LPI2C1_MIER = 0;
+            LPI2C1_MCR |= LPI2C_MCR_RTF | LPI2C_MCR_RRF;
+            if(i2c_current) {
+                i2c_current->status = I2C_TXN_ERROR;
+                i2c_stats[i2c_current->device].errors++;
+                i2c_current = NULL;
+            }
+            while(i2c_head != i2c_tail) {
+                i2c_queue[i2c_head]->status = I2C_TXN_ERROR;
+                i2c_head = (i2c_head + 1) & (I2C_QUEUE_LEN - 1);
+            }
+            for(int d = 0; d < I2C_DEV_COUNT; d++) {
+                i2c_stats[d].depth = 0;
+            }
+            i2c_unlock(primask);
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * Prints bus utilisation and per device counters since the previous report
+ */
+void print_i2c_stats() {
+    unsigned long now = micros();
+    float elapsed = now - i2c_stats_time;
+    Serial.print("I2C, BUS_UTIL, ");Serial.print(100.0 * i2c_busy_mus / elapsed, 1);Serial.print("%");
+    for(int d = 0; d < I2C_DEV_COUNT; d++) {
+        Serial.print(", ");Serial.print(i2c_device_name[d]);
+        Serial.print(", DEPTH, ");Serial.print(i2c_stats[d].depth);
+        Serial.print(", MAX, ");Serial.print(i2c_stats[d].max_depth);
+        Serial.print(", DONE, ");Serial.print(i2c_stats[d].completed);
+        Serial.print(", ERR, ");Serial.print(i2c_stats[d].errors);
+        Serial.print(", RETRY, ");Serial.print(i2c_stats[d].retries);
+        i2c_stats[d].max_depth = i2c_stats[d].depth;
+        i2c_stats[d].completed = 0;
+        i2c_stats[d].errors = 0;
+        i2c_stats[d].retries = 0;
+    }
+    Serial.println();
+    i2c_busy_mus = 0;
+    i2c_stats_time = now;
+}
+
+#endif
@@ -0,0 +1,63 @@
+/******
+ * Magnetometer read by the LSM6DSV16X sensor hub, see LSM6DSV.h
+ * Mag is the driver class of the magnetometer wired to the auxiliary bus.
+ *
+ * Released under GPLv3 License - see LICENSE file for details.
+ ******/
+#include "sensor.h"
+
+template <class Mag>
+class MagHub: public Sensor<MagHub<Mag>> {
+
+    public:
+        static constexpr float K_ERR = Mag::K_ERR;
+        static constexpr float K_Q   = Mag::K_Q;
+        static constexpr bool SMOOTH = Mag::SMOOTH;
+        static constexpr const char* NAME = Mag::NAME;
+        static constexpr bool BATCHED = true;
+        static constexpr bool CHIP_FRAME = Mag::CHIP_FRAME;
+
+        /*
+         * the magnetometer is configured through the pass-through with its usual init function,
+         * then the accelerometer's I2C master reads it
+         */
+        bool init() {
+            pass_through_LSM(true);
+            bool found = Mag::init_aux();
+            pass_through_LSM(false);
+            if(!found) {
+                return false;
+            }
+            Mag::hub_slaves();
+            return start_hub_LSM(Mag::HUB_SLAVES);
+        }
+
+        int dataRate(void) {
+            return LSM_FIFO_DRAIN_HZ;   // drained together with the accelerometer
+        }
+
+        int sampleRate(void) {
+            return LSM_SHUB_HZ;         // filtered one by one, at their chip time
+        }
+
+        inline bool read(float *mag_raw) {
+            uint8_t data[LSM_HUB_BYTES];
+            if(!hub_fifo_LSM(data, &this->time_mus)) {
+                return false;
+            }
+            Mag::decode(data, mag_raw);
+            return true;
+        }
+
+        static void axes(float raw[3]) {
+            Mag::axes(raw);
+        }
+
+        inline void request() {
+            fifo_request_LSM();
+        }
+
+        void stats() {
+            Serial.println("Magnetometer read by the LSM6DSV16X sensor hub, see acc_stats");
+        }
+};
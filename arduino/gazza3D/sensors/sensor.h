@@ -1,27 +1,89 @@
-#include <SimpleKalmanFilter.h>
+/******
+ * Sensor driver framework
+ *
+ * A concrete driver derives from Sensor<Driver> (CRTP) and wraps the function driver of its chip.
+ * It provides
+ *   K_ERR, K_Q      kalman filter parameters, per sample at sampleRate() (sensors/timed_kalman.h)
+ *   SMOOTH          true if the readings are kalman smoothed
+ *   NAME            printed when the sensor is found
+ *   init()          detection and configuration, false if the sensor is not there
+ *   dataRate()      Hz, of the reads
+ *   read(raw)       next sample, NED axes, in the driver units. false if there is none
+ * and may override the defaults below (BATCHED, CHIP_FRAME, sampleRate(), axes(), request(), stats()).
+ *
+ * Every call is resolved at compile time and the filters are members, not heap objects:
+ * sensors() binds the detected drivers once, afterwards the read path of a driver is a single
+ * function with the driver, rotation and smoothing inlined.
+ *
+ * Released under GPLv3 License - see LICENSE file for details.
+ ******/
 
+#ifndef SENSOR_FRAMEWORK
+#define SENSOR_FRAMEWORK
+
+#include "timed_kalman.h"
+
+template <class Driver>
 class Sensor {
     public:
-        void initSensor(float K_ERR, float K_Q) {
-            kf_x = SimpleKalmanFilter(K_ERR, K_ERR, K_Q);
-            kf_y = SimpleKalmanFilter(K_ERR, K_ERR, K_Q);
-            kf_z = SimpleKalmanFilter(K_ERR, K_ERR, K_Q);
+        static constexpr bool BATCHED = false;  // true if a read() pops one of several samples collected by the chip
+        static constexpr bool CHIP_FRAME = false;  // true if read() returns the chip axes, axes() then maps them to NED
+        unsigned long time_mus = 0;             // chip timestamp of the last sample, 0 if the driver has none
+
+        Sensor() : kf_x(Driver::K_ERR, Driver::K_ERR, Driver::K_Q),
+                   kf_y(Driver::K_ERR, Driver::K_ERR, Driver::K_Q),
+                   kf_z(Driver::K_ERR, Driver::K_ERR, Driver::K_Q) {
+        }
+
+        // t_mus is the time of the sample
+        inline void smooth_readings(float raw[3], unsigned long t_mus) {
+            if(Driver::SMOOTH) {
+                raw[0] = kf_x.updateEstimate(raw[0], t_mus);
+                raw[1] = kf_y.updateEstimate(raw[1], t_mus);
+                raw[2] = kf_z.updateEstimate(raw[2], t_mus);
+            }
+        }
+
+        void set_filter_rate(int hz) {
+            if(hz > 0) {
+                kf_x.setNominalInterval(1000000 / hz);
+                kf_y.setNominalInterval(1000000 / hz);
+                kf_z.setNominalInterval(1000000 / hz);
+            }
+        }
+
+        void set_noise_scale(float scale) {
+            kf_x.setNoiseScale(scale);
+            kf_y.setNoiseScale(scale);
+            kf_z.setNoiseScale(scale);
+        }
+
+        // seconds, 0 if the readings are not smoothed
+        float time_constant() {
+            return Driver::SMOOTH ? kf_x.getTimeConstant() : 0;
+        }
+
+        // Hz, of the samples the filters see: a BATCHED driver filters each sample of a batch
+        int sampleRate() {
+            return static_cast<Driver*>(this)->dataRate();
+        }
+
+        // chip axes to NED, linear. Only called to build the transform of a CHIP_FRAME driver
+        static void axes(float raw[3]) {
         }
 
-        void swap_axes(float north, float east, float down, float *raw) {
-            raw[0] = north; // -x;
-            raw[1] = east;  //  y;
-            raw[2] = down;  // -z;
+        // queues the acquisition of the next samples, if the driver needs it
+        inline void request() {
         }
 
-        void smooth_readings(float mag_raw) {
-            raw[0] = kf_x.updateEstimate(raw[0]);  // gauss
-            raw[1] = kf_y.updateEstimate(raw[1]);  // gauss
-            raw[2] = kf_z.updateEstimate(raw[2]);  // gauss
+        void stats() {
+            Serial.print("No acquisition stats for ");Serial.println(Driver::NAME);
         }
 
     private:
-        SimpleKalmanFilter kf_x;
-        SimpleKalmanFilter kf_y;
-        SimpleKalmanFilter kf_z;
-}
+        TimedKalmanFilter kf_x;
+        TimedKalmanFilter kf_y;
+        TimedKalmanFilter kf_z;
+};
+
+#endif
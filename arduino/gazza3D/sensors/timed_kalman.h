@@ -0,0 +1,81 @@
+/******
+ * Kalman filter driven by the sample timestamps
+ *
+ * SimpleKalmanFilter adds its process noise once per update, so its smoothing depends on how often it is called.
+ * Here the process noise grows with the time elapsed since the previous sample: the parameters keep their
+ * SimpleKalmanFilter meaning at the nominal interval (the sensor or task period), a late sample gets more process
+ * noise and more weight, a sample already seen (same timestamp) is not filtered again.
+ * setNoiseScale() multiplies the process noise, the adaptive profiles of motion.h.
+ * The smoothing is reported as the time constant of the equivalent first order low pass, seconds.
+ *
+ * Released under GPLv3 License - see LICENSE file for details.
+ ******/
+
+#ifndef TIMED_KALMAN
+#define TIMED_KALMAN
+
+#include <math.h>
+
+#define TK_MAX_SCALE 100.0      // a gap longer than 100 nominal intervals counts as 100
+
+class TimedKalmanFilter {
+  public:
+    TimedKalmanFilter(float mea_e, float est_e, float q, unsigned long nominal_mus = 10000) :
+      err_measure(mea_e), err_estimate(est_e), q(q), nominal_mus(nominal_mus) {}
+
+    float updateEstimate(float mea, unsigned long t_mus) {
+      return correct(mea - last_estimate, t_mus);
+    }
+
+    void setMeasurementError(float mea_e) { err_measure = mea_e; }
+    void setEstimateError(float est_e) { err_estimate = est_e; }
+    void setProcessNoise(float q) { this->q = q; }
+    void setNominalInterval(unsigned long mus) { nominal_mus = mus; }
+    void setNoiseScale(float scale) { noise_scale = scale; }
+    float getKalmanGain() { return kalman_gain; }
+    float getEstimateError() { return err_estimate; }
+
+    // seconds, time constant of the low pass with the last gain and interval
+    float getTimeConstant() {
+      if(kalman_gain <= 0 || kalman_gain >= 1) {
+        return 0;
+      }
+      return -dt / log(1 - kalman_gain);
+    }
+
+  protected:
+    float last_estimate = 0;
+
+    // one step with the given innovation, the new estimate is last_estimate + gain * innovation
+    float correct(float innovation, unsigned long t_mus) {
+      long elapsed = started ? (long)(t_mus - last_mus) : (long)nominal_mus;
+      if(elapsed <= 0) {
+        return last_estimate;               // nothing new
+      }
+      started = true;
+      last_mus = t_mus;
+      dt = elapsed / 1e6;
+      float scale = min((float)elapsed / nominal_mus, (float)TK_MAX_SCALE);
+      err_estimate += noise * scale * noise_scale;    // process noise of the elapsed interval
+      kalman_gain = err_estimate / (err_estimate + err_measure);
+      float step = kalman_gain * innovation;
+      err_estimate = (1.0 - kalman_gain) * err_estimate;
+      noise = fabs(step) * q;               // per nominal interval, as SimpleKalmanFilter
+      last_estimate += step;
+      return last_estimate;
+    }
+
+  private:
+    float err_measure;
+    float err_estimate;
+    float q;
+    unsigned long nominal_mus;
+    float noise = 0;
+    float noise_scale = 1;
+    float kalman_gain = 0;
+    float dt = 0;                           // seconds, last interval
+    unsigned long last_mus = 0;
+    bool started = false;
+};
+
+#endif
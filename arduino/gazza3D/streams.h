@@ -0,0 +1,128 @@
+/******
+ * Telemetry streams
+ *
+ * Each stream is a periodic output with its own rate, subscribed with the command
+ *    stream <name> <hz>      hz 0 stops the stream
+ *    stream                  lists the streams and their rates on the console
+ * The streams are emitted by the output task, whose period follows the fastest active stream
+ * (at most STREAM_MAX_HZ): a stream is emitted at the first run of the task after its period elapsed,
+ * its average rate is kept. The periods a late stream could not catch up with are counted as skipped.
+ *
+ * Released under GPLv3 License - see LICENSE file for details.
+ ******/
+
+#ifndef STREAMS
+#define STREAMS
+
+#define STREAM_MAX 8
+#define STREAM_MAX_HZ 100
+#define STREAM_IDLE_MUS 100000    // output task period with no stream active
+
+struct TelemetryStream {
+  const char* name;
+  void (*emit)(unsigned long now);
+  unsigned long period_mus;       // 0 if not active
+  unsigned long last_mus;
+  unsigned long skipped;          // periods not emitted, the task ran too late
+};
+
+TelemetryStream streams[STREAM_MAX];
+int stream_count = 0;
+int stream_task_id = -1;          // the scheduler task emitting the streams
+
+/*
+ * Sets the output task period to the period of the fastest active stream
+ */
+void stream_schedule() {
+  unsigned long period = STREAM_IDLE_MUS;
+  for(int i = 0; i < stream_count; i++) {
+    if(streams[i].period_mus && streams[i].period_mus < period) {
+      period = streams[i].period_mus;
+    }
+  }
+  if(stream_task_id >= 0) {
+    sched_set_period(stream_task_id, period);
+  }
+}
+
+int stream_find(const char* name) {
+  for(int i = 0; i < stream_count; i++) {
+    if(!strcmp(streams[i].name, name)) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+/*
+ * Sets the rate of a stream, 0 stops it. Returns false if there is no such stream
+ */
+bool stream_rate(const char* name, int hz) {
+  int i = stream_find(name);
+  if(i < 0) {
+    return false;
+  }
+  hz = constrain(hz, 0, STREAM_MAX_HZ);
+  streams[i].period_mus = hz ? 1000000 / hz : 0;
+  streams[i].last_mus = micros();
+  stream_schedule();
+  return true;
+}
+
+int stream_add(const char* name, void (*emit)(unsigned long now), int hz) {
+  if(stream_count == STREAM_MAX) {
+    return -1;
+  }
+  streams[stream_count].name = name;
+  streams[stream_count].emit = emit;
+  streams[stream_count].period_mus = 0;
+  streams[stream_count].skipped = 0;
+  stream_count++;
+  stream_rate(name, hz);
+  return stream_count - 1;
+}
+
+// binds the streams to the scheduler task emitting them
+void streams_begin(int task_id) {
+  stream_task_id = task_id;
+  stream_schedule();
+}
+
+// to be called by the output task
+void streams_run(unsigned long now) {
+  for(int i = 0; i < stream_count; i++) {
+    TelemetryStream* s = &streams[i];
+    if(!s->period_mus || now - s->last_mus < s->period_mus) {
+      continue;
+    }
+    s->last_mus += s->period_mus;
+    if(now - s->last_mus >= s->period_mus) {   // more than a period late: realign instead of bursting
+      s->skipped += (now - s->last_mus) / s->period_mus;
+      s->last_mus = now;
+    }
+    s->emit(now);
+  }
+}
+
+void print_streams() {
+  for(int i = 0; i < stream_count; i++) {
+    Serial.print("STREAM, ");Serial.print(streams[i].name);
+    Serial.print(", HZ, ");Serial.print(streams[i].period_mus ? 1000000.0 / streams[i].period_mus : 0, 1);
+    Serial.print(", SKIPPED, ");Serial.println(streams[i].skipped);
+  }
+}
+
+/*
+ * stream command, see above. argv[0] is the command
+ */
+void stream_command(int argc, char* argv[]) {
+  if(argc < 3) {
+    print_streams();
+    return;
+  }
+  if(!stream_rate(argv[1], atoi(argv[2]))) {
+    Serial.print("Unknown stream ");Serial.println(argv[1]);
+  }
+}
+
+#endif
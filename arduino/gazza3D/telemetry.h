@@ -0,0 +1,113 @@
+/******
+ * Binary SENSORS telemetry
+ *
+ * Negotiated by the raspberry with the command
+ *    telemetry binary [hz]
+ * (telemetry text goes back to the SENSORS text line). The teensy answers with the text line
+ *    TELEMETRY, BINARY, <hz>
+ * and from then on sends each SENSORS sample as a frame:
+ *
+ *    0x00 | COBS(payload | crc16) | 0x00
+ *
+ * payload, little endian:
+ *    type    u8    TELEMETRY_SENSORS
+ *    seq     u16   incremented at each message, text or frame: a gap is a message lost on the line
+ *    t_mus   u32   micros() of the acquisition of the older sample azimuth and altitude come from, or of the
+ *                  frame with TELEMETRY_FLAG_PREDICTED. The raspberry clock instead with TELEMETRY_FLAG_PI_TIME
+ *    az      i32   millidegrees
+ *    alt     i32   millidegrees
+ *    flags   u8    TELEMETRY_FLAG_*
+ *    dropped u16   SENSORS messages not sent since the start, wraps
+ * crc16: CRC-16/CCITT-FALSE of the payload, little endian.
+ * COBS leaves no 0 inside the frame, so the receiver splits frames on the 0 delimiters. The leading 0 also
+ * tells a frame from the text lines (M_CAL, JOYSTICK...), which are still sent as they are.
+ * The SENSORS text line carries the same fields:
+ *    SENSORS, AZ, <az>, ALT, <alt>, SEQ, <seq>, T, <t_mus>, DROPPED, <dropped>, SYNC, <1 with the raspberry clock>,
+ *    MOTION, <motion state>,
+ *
+ * Released under GPLv3 License - see LICENSE file for details.
+ ******/
+
+#ifndef TELEMETRY
+#define TELEMETRY
+
+#define TELEMETRY_SENSORS 0x01
+#define TELEMETRY_PAYLOAD_LEN 18
+#define TELEMETRY_FRAME_LEN (TELEMETRY_PAYLOAD_LEN + 2 + 1 + 2)   // crc, COBS overhead, delimiters
+
+#define TELEMETRY_FLAG_M_CAL_ON   0x01
+#define TELEMETRY_FLAG_M_CAL_DONE 0x02
+#define TELEMETRY_FLAG_PI_TIME    0x04    // t_mus is the raspberry clock, low 32 bits, see tsync.h
+#define TELEMETRY_FLAG_PREDICTED  0x08    // az and alt moved forward to t_mus by the gyro, see predict.h
+#define TELEMETRY_FLAG_MOTION     0x30    // bits 4-5, motion state: idle, tracking, slewing, see motion.h
+#define TELEMETRY_FLAG_MOTION_SHIFT 4
+
+bool telemetry_binary = false;
+uint16_t telemetry_seq = 0;
+
+uint16_t crc16_ccitt(const uint8_t* data, size_t len) {
+  uint16_t crc = 0xFFFF;
+  for(size_t i = 0; i < len; i++) {
+    crc ^= (uint16_t)data[i] << 8;
+    for(int b = 0; b < 8; b++) {
+      crc = crc & 0x8000 ? (crc << 1) ^ 0x1021 : crc << 1;
+    }
+  }
+  return crc;
+}
+
+/*
+ * Consistent Overhead Byte Stuffing, len < 254. Returns the encoded length, len + 1
+ */
+size_t cobs_encode(const uint8_t* in, size_t len, uint8_t* out) {
+  size_t code_pos = 0;
+  size_t o = 1;
+  uint8_t code = 1;
+  for(size_t i = 0; i < len; i++) {
+    if(in[i]) {
+      out[o++] = in[i];
+      code++;
+    } else {
+      out[code_pos] = code;
+      code_pos = o++;
+      code = 1;
+    }
+  }
+  out[code_pos] = code;
+  return o;
+}
+
+inline void put_u16(uint8_t* p, uint16_t v) {
+  p[0] = v;
+  p[1] = v >> 8;
+}
+
+inline void put_u32(uint8_t* p, uint32_t v) {
+  p[0] = v;
+  p[1] = v >> 8;
+  p[2] = v >> 16;
+  p[3] = v >> 24;
+}
+
+/*
+ * Returns false if the frame was refused by out
+ */
+bool send_sensors_frame(Print& out, unsigned long t_mus, float az, float alt, uint8_t flags, uint16_t dropped) {
+  uint8_t payload[TELEMETRY_PAYLOAD_LEN + 2];
+  payload[0] = TELEMETRY_SENSORS;
+  put_u16(payload + 1, telemetry_seq++);
+  put_u32(payload + 3, t_mus);
+  put_u32(payload + 7, (int32_t)lroundf(az * 1000));
+  put_u32(payload + 11, (int32_t)lroundf(alt * 1000));
+  payload[15] = flags;
+  put_u16(payload + 16, dropped);
+  put_u16(payload + TELEMETRY_PAYLOAD_LEN, crc16_ccitt(payload, TELEMETRY_PAYLOAD_LEN));
+
+  uint8_t frame[TELEMETRY_FRAME_LEN];
+  frame[0] = 0;
+  size_t n = cobs_encode(payload, sizeof(payload), frame + 1);
+  frame[n + 1] = 0;
+  return out.write(frame, n + 2) == n + 2;
+}
+
+#endif
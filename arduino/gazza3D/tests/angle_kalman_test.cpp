@@ -0,0 +1,135 @@
+/******
+ * Host regression test of AngleKalmanFilter (angle_kalman.h), azimuth crossing north
+ *
+ * Same filter and tuning as kf_azimuth (compass.h), one sample every 10 ms:
+ *  - a 3°/s slew from 340° through 359° -> 1°: the error peaks at about 0.29°, at the start of the slew (a filter
+ *    unaware of the wrap is off by tens of degrees), and the estimate stays in [0, 360)
+ *  - a 359.5° -> 0.5° step settles within 0.01° in 20 samples
+ *  - seeded noise replays, ±0.1° uniform (0.058° rms) on the measurements, still at 359.9° and slewing at 3°/s
+ *    through north: after 2 s, the mean error (the lag) is about 0° still and 0.12° slewing, the spread of the
+ *    error around it about 0.012° still and 0.024° slewing
+ * The bounds below leave a margin over those values, so that a retune of the filter that keeps its behaviour
+ * passes; the margins are documented with each bound.
+ * Build and run from this directory, plain g++, the exit status is 0 on success:
+ *    g++ -I.. -o angle_kalman_test angle_kalman_test.cpp && ./angle_kalman_test
+ *
+ * Released under GPLv3 License - see LICENSE file for details.
+ ******/
+
+#include <stdio.h>
+#include <math.h>
+#include <algorithm>
+using std::min;
+
+#define PI 3.14159265358979f    // Arduino.h on the target
+#include "angle_kalman.h"
+
+#define K_ERR_AZ 0.01           // as compass.h
+#define K_Q_AZ 1.0
+#define SAMPLE_MUS 10000UL
+#define SLEW_DPS 3.0f
+#define MAX_SLEW_ERR 0.35f      // 0.29 observed, +20%
+#define SETTLE_ERR 0.01f
+#define MAX_SETTLE_SAMPLES 25   // 20 observed, +25%
+#define NOISE_DEG 0.1f          // half width of the uniform measurement noise
+#define NOISE_SEED 1
+#define STEADY_SKIP 200         // samples before the steady state, 2 s
+#define STEADY_SAMPLES 3000
+#define MAX_STILL_BIAS 0.01f    // |mean error| still, 0.001 observed: the wrap must not bias the estimate
+#define MAX_STILL_SPREAD 0.03f  // 0.012 observed: the filter at least halves the 0.058 rms of the noise
+#define MAX_SLEW_LAG 0.18f      // 0.12 observed, +50%
+#define MAX_SLEW_SPREAD 0.04f   // 0.024 observed
+
+const float DegToRad = PI / 180;
+
+// (-180, 180]
+float wrap_deg(float a) {
+  a = fmod(a, 360);
+  if(a > 180) a -= 360;
+  if(a <= -180) a += 360;
+  return a;
+}
+
+// deterministic noise in [-NOISE_DEG, NOISE_DEG), the same on every host
+unsigned long noise_seed = NOISE_SEED;
+
+float noise() {
+  noise_seed = (noise_seed * 1103515245UL + 12345UL) & 0x7FFFFFFFUL;
+  return ((noise_seed >> 16) % 1000 / 1000.0f - 0.5f) * 2 * NOISE_DEG;
+}
+
+/*
+ * noisy replay from 359.9° at rate deg/s, returns false if the steady state error is out of its bounds
+ */
+bool steady_state(const char* name, float rate, float max_lag, float max_spread) {
+  AngleKalmanFilter f(K_ERR_AZ, K_ERR_AZ, K_Q_AZ);
+  unsigned long t = 0;
+  for(int i = 0; i < 200; i++, t += SAMPLE_MUS) {
+    f.updateEstimate(fmod(359.9f + noise() + 360, 360) * DegToRad, t);
+  }
+  double sum = 0, sum_sq = 0;
+  for(int i = 0; i < STEADY_SKIP + STEADY_SAMPLES; i++, t += SAMPLE_MUS) {
+    float az = fmod(359.9f + rate * i * SAMPLE_MUS / 1e6f, 360);
+    float mea = fmod(az + noise() + 360, 360);
+    float err = wrap_deg(f.updateEstimate(mea * DegToRad, t) / DegToRad - az);
+    if(i >= STEADY_SKIP) {
+      sum += err;
+      sum_sq += err * err;
+    }
+  }
+  double lag = -sum / STEADY_SAMPLES;          // the estimate trails the truth
+  double spread = sqrt(sum_sq / STEADY_SAMPLES - lag * lag);
+  printf("noisy replay %s: lag %.4f deg, spread %.4f deg\n", name, lag, spread);
+  if(fabs(lag) > max_lag || spread > max_spread) {
+    printf("FAILED: lag above %.3f deg or spread above %.3f deg\n", max_lag, max_spread);
+    return false;
+  }
+  return true;
+}
+
+int main() {
+  int failures = 0;
+
+  AngleKalmanFilter slew(K_ERR_AZ, K_ERR_AZ, K_Q_AZ);
+  float az = 340;
+  unsigned long t = 0;
+  for(int i = 0; i < 200; i++, t += SAMPLE_MUS) {
+    slew.updateEstimate(az * DegToRad, t);     // settled before the slew
+  }
+  float max_err = 0;
+  int out_of_range = 0;
+  for(int i = 0; i < 2000; i++, t += SAMPLE_MUS) {   // 20 s, 340° -> 40°
+    az = fmod(340 + SLEW_DPS * i * SAMPLE_MUS / 1e6f, 360);
+    float est = slew.updateEstimate(az * DegToRad, t) / DegToRad;
+    if(est < 0 || est >= 360) {
+      out_of_range++;
+    }
+    max_err = std::max(max_err, (float)fabs(wrap_deg(est - az)));
+  }
+  printf("slew through north: max error %.3f deg, %d estimates out of [0, 360)\n", max_err, out_of_range);
+  if(max_err > MAX_SLEW_ERR || out_of_range) {
+    printf("FAILED: max error above %.2f deg or estimate out of range\n", MAX_SLEW_ERR);
+    failures++;
+  }
+
+  AngleKalmanFilter step(K_ERR_AZ, K_ERR_AZ, K_Q_AZ);
+  t = 0;
+  for(int i = 0; i < 200; i++, t += SAMPLE_MUS) {
+    step.updateEstimate(359.5f * DegToRad, t);
+  }
+  int n = 0;
+  while(fabs(wrap_deg(step.updateEstimate(0.5f * DegToRad, t) / DegToRad - 0.5f)) > SETTLE_ERR && n < 1000) {
+    n++;
+    t += SAMPLE_MUS;
+  }
+  printf("359.5 -> 0.5 deg step: settled within %.2f deg in %d samples\n", SETTLE_ERR, n);
+  if(n > MAX_SETTLE_SAMPLES) {
+    printf("FAILED: more than %d samples\n", MAX_SETTLE_SAMPLES);
+    failures++;
+  }
+
+  failures += !steady_state("still at 359.9", 0, MAX_STILL_BIAS, MAX_STILL_SPREAD);
+  failures += !steady_state("slewing through north", SLEW_DPS, MAX_SLEW_LAG, MAX_SLEW_SPREAD);
+
+  return failures ? 1 : 0;
+}
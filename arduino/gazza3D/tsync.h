@@ -0,0 +1,107 @@
+/******
+ * Clock synchronisation with the Raspberry
+ *
+ * NTP-like exchange over Serial1, driven by the raspberry:
+ *    tsync <t1> [<t1 prev> <t4 prev>]
+ * t1 is the raspberry clock (microseconds) when the command is sent. The teensy answers at once with
+ *    TSYNC, <t1>, <t2>, <t3>
+ * t2 being micros() when the line was received and t3 micros() when the answer is queued. The raspberry notes
+ * t4, its clock at the answer, and sends it back with its t1 in the next tsync: the teensy then has the four
+ * timestamps of the previous exchange and computes
+ *    delay  = (t4 - t1) - (t3 - t2)
+ *    offset = t1 - t2 + delay / 2            raspberry clock - micros()
+ * Exchanges slower than the fastest one seen (plus a margin) have been delayed in some queue and are discarded,
+ * the others correct the offset and the drift of the two clocks, a second order loop.
+ * Everything is modulo 2^32: the raspberry clock is only known by its 32 low bits, enough for the raspberry to
+ * rebuild the full time of any recent sample.
+ *
+ * Released under GPLv3 License - see LICENSE file for details.
+ ******/
+
+#ifndef TSYNC
+#define TSYNC
+
+#define TSYNC_DELAY_MARGIN_MUS 500    // accepted round trip above the fastest one
+#define TSYNC_DELAY_LEAK_MUS 20       // the fastest round trip is forgotten slowly, the path can change
+#define TSYNC_OFFSET_GAIN 0.5
+#define TSYNC_DRIFT_GAIN 0.1
+
+bool tsync_valid = false;
+uint32_t tsync_offset = 0;            // raspberry clock - micros() at tsync_ref
+unsigned long tsync_ref = 0;
+float tsync_drift = 0;                // offset change per microsecond
+uint32_t tsync_min_delay = 0xFFFFFFFF;
+uint32_t tsync_delay = 0;             // round trip of the last exchange
+uint32_t tsync_samples = 0;           // exchanges accepted
+uint32_t tsync_rejects = 0;
+
+// the last exchange answered, waiting for its t4
+int64_t tsync_t1 = 0;
+unsigned long tsync_t2 = 0;
+unsigned long tsync_t3 = 0;
+
+/*
+ * raspberry clock, low 32 bits, at micros() t. Meaningful only if tsync_valid
+ */
+uint32_t tsync_pi_time(unsigned long t) {
+  return t + tsync_offset + (int32_t)lroundf(tsync_drift * (long)(t - tsync_ref));
+}
+
+void tsync_sample(int64_t t1, unsigned long t2, unsigned long t3, int64_t t4) {
+  uint32_t delay = (uint32_t)(t4 - t1) - (t3 - t2);
+  tsync_delay = delay;
+  if(tsync_min_delay < 0xFFFFFFFF - TSYNC_DELAY_LEAK_MUS) {
+    tsync_min_delay += TSYNC_DELAY_LEAK_MUS;
+  }
+  tsync_min_delay = min(tsync_min_delay, delay);
+  if(delay > tsync_min_delay + TSYNC_DELAY_MARGIN_MUS) {
+    tsync_rejects++;
+    return;
+  }
+  unsigned long mid = t2 + (t3 - t2) / 2;
+  uint32_t offset = (uint32_t)t1 - t2 + delay / 2;
+  if(!tsync_valid) {
+    tsync_offset = offset;
+    tsync_ref = mid;
+    tsync_valid = true;
+  } else {
+    long dt = mid - tsync_ref;
+    uint32_t predicted = tsync_pi_time(mid) - mid;
+    int32_t err = offset - predicted;
+    if(dt > 0) {
+      tsync_drift += TSYNC_DRIFT_GAIN * err / dt;
+    }
+    tsync_offset = predicted + (int32_t)lroundf(TSYNC_OFFSET_GAIN * err);
+    tsync_ref = mid;
+  }
+  tsync_samples++;
+}
+
+/*
+ * tsync command, see above. t2 is when the command line was received (commands.h)
+ */
+void tsync_command(int argc, char* argv[]) {
+  if(argc < 2) {
+    return;
+  }
+  unsigned long t2 = command_time_mus;
+  if(argc > 3 && strtoll(argv[2], NULL, 10) == tsync_t1) {
+    tsync_sample(tsync_t1, tsync_t2, tsync_t3, strtoll(argv[3], NULL, 10));
+  }
+  tsync_t1 = strtoll(argv[1], NULL, 10);
+  tsync_t2 = t2;
+  tsync_t3 = micros();
+  pi_link.print("TSYNC, ");pi_link.print(argv[1]);pi_link.print(", ");pi_link.print(tsync_t2);pi_link.print(", ");pi_link.println(tsync_t3);
+}
+
+void print_tsync() {
+  Serial.print("TSYNC, VALID, ");Serial.print(tsync_valid);
+  Serial.print(", OFFSET, ");Serial.print(tsync_offset);
+  Serial.print(", DRIFT_PPM, ");Serial.print(tsync_drift * 1e6, 2);
+  Serial.print(", DELAY, ");Serial.print(tsync_delay);
+  Serial.print(", MIN_DELAY, ");Serial.print(tsync_min_delay);
+  Serial.print(", SAMPLES, ");Serial.print(tsync_samples);
+  Serial.print(", REJECTS, ");Serial.println(tsync_rejects);
+}
+
+#endif
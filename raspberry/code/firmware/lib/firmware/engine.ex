@@ -31,9 +31,15 @@ defmodule Engine do
 
   require Logger
   require Useful
+  import Bitwise
   alias Phoenix.PubSub
 
   @gui_interval 200  # 100 milliseconds between gui messages
+  @sensors_rate 10    # Hz, SENSORS frames requested to the teensy, see sensors_rate/1 for the rate by status
+  @link_baud 1_000_000  # requested to the teensy, the port is switched when it confirms
+  @tsync_interval 2000  # milliseconds between clock synchronisations with the teensy
+  @link_timeout 3000    # milliseconds without a valid message before the link is set up again at 115200
+  @link_messages ~w(SENSORS JOYSTICK A_CAL A_CAL_FAILED TELEMETRY STREAM TSYNC BAUD M_CAL MOUNT_LEVEL M_COMP)
 
   defstruct site_lat: 0,        # latitude of observing site
             site_long: 0,       # longitude of observing site
@@ -53,7 +59,19 @@ defmodule Engine do
                   dec: 0,      # declination target of goto in degrees - stays fixed
             },
 
+            sensors: %{seq: nil,        # sequence number of the last SENSORS message
+                       t_mus: 0,        # teensy micros() of the acquisition of the last SENSORS sample
+                       t_pi: nil,       # same, on the pi_clock, once the teensy is synchronised
+                       lost: 0,         # SENSORS messages lost on the line, from the sequence gaps
+                       dropped: 0,      # SENSORS messages the teensy could not send
+            },
+
+            tsync: %{t1: 0, t4: 0},  # last clock synchronisation exchanged with the teensy, see handle_info(:tsync)
+            slew: %{speed_alt: 0, speed_az: 0},  # motor speeds of the goto in progress, degrees/sec
+
             serial_pid: 0,      # uart genserver pid to message back to sensors
+            link_rx: 0,         # monotonic milliseconds of the last valid message from the teensy
+            stream_rate: 0,     # SENSORS rate last requested to the teensy, see follow_status/1
             tts: 0,             # tracking timestamp
             ttg: 0,             # gui sending timestamp
             sid_alt_speed: 0,   # current sidereal speed, when tracking in progress
@@ -91,7 +109,7 @@ defmodule Engine do
     {:ok, pid} = Circuits.UART.start_link
     status = Circuits.UART.open(pid, "ttyAMA0", speed: 115200, active: true)
     case status do
-      :ok -> Circuits.UART.configure(pid, framing: {Circuits.UART.Framing.Line, separator: "\n"})
+      :ok -> Circuits.UART.configure(pid, framing: Engine.Framing)
       {:error, what} -> Logger.error("UART ERROR #{what}")
     end
 
@@ -100,9 +118,11 @@ defmodule Engine do
     Gps.start_link()
     # if Astrex is launched by the Ui Application
     # Astrex.Server.start_link()    # initialized with default coordinates (Greenwich) until GPD is read
-    upload_accel_calibration(pid)
+    link_setup(pid, :Idle)
+    Process.send_after(self(), :tsync, @tsync_interval)
+    Process.send_after(self(), :link_watchdog, @link_timeout)
     Logger.info("Launched Engine GenServer")
-    {:ok, %Engine{serial_pid: pid}}
+    {:ok, %Engine{serial_pid: pid, link_rx: System.monotonic_time(:millisecond), stream_rate: sensors_rate(:Idle)}}
   end
 
   def handle_call(:ok, _from, state) do
@@ -134,7 +154,7 @@ defmodule Engine do
     Astrex.Server.set_ll(%{lat: msg.lat, long: msg.lon})
     {mag_dec, _dip, mag_field, _gv} = Astrex.mag_declination()
     send_to_gui(state, %{site_lat: msg.lat, site_long: msg.lon, mag_dec: mag_dec, mag_field: mag_field, tz: Engine.Config.get_config(:tz)})
-    {:noreply, %{state | site_lat: msg.lat, site_long: msg.lon, mag_dec: mag_dec, mag_field: mag_field}}
+    noreply(%{state | site_lat: msg.lat, site_long: msg.lon, mag_dec: mag_dec, mag_field: mag_field})
   end
 
   def handle_cast({:gui, msg}, state) do
@@ -161,11 +181,11 @@ defmodule Engine do
 
         _                    -> apply(:"Elixir.Engine.#{state.status}", :gui, [msg, state])  # any goto request goes to the status modules
       end
-    {:noreply, state}
+    noreply(state)
   end
 
   def handle_cast(_, state) do
-    {:noreply, state}
+    noreply(state)
   end
 
   @doc """
@@ -180,8 +200,11 @@ defmodule Engine do
           SENSORS: changed ALT/AZ coordinates to which the telescope aims
           JOYSTICK: manual commands, corrections etc
           A_CAL: saves in configuration file the current accelerometer calibration, read from the teensy board
+          TELEMETRY: reply to the telemetry handshake
+          BAUD: the teensy switches the link to the baud rate received, the port follows
+          TSYNC: answer to the clock synchronisation request
 
-    All messages are comma separated
+    All messages are comma separated, except the binary SENSORS frames delivered by Engine.Framing as {:frame, payload}
   """
   def handle_info({:calibration, msg}, state) do
     state =
@@ -191,24 +214,74 @@ defmodule Engine do
         "second step completed" -> state
         "compensation completed" -> state
       end
-    {:noreply, state}
+    noreply(state)
+  end
+
+  # NTP-like clock synchronisation, see tsync.h in the teensy sketch. Each request carries the timestamps of the
+  # previous exchange, the teensy computes the offset between the clocks
+  def handle_info(:tsync, state) do
+    t1 = pi_clock()
+    previous = if state.tsync.t4 != 0, do: " #{state.tsync.t1} #{state.tsync.t4}", else: ""   # unanswered
+    Circuits.UART.write(state.serial_pid, "tsync #{t1}" <> previous)
+    Process.send_after(self(), :tsync, @tsync_interval)
+    noreply(%{state | tsync: %{t1: t1, t4: 0}})
+  end
+
+  # the baud switch is requested only once: when nothing valid comes from the teensy for @link_timeout (teensy
+  # reset back at 115200, or a lost BAUD answer) the port goes back to 115200 and the link is set up again.
+  # The teensy falls back to 115200 too when it receives no command, see link.h
+  def handle_info(:link_watchdog, state) do
+    state =
+      if System.monotonic_time(:millisecond) - state.link_rx > @link_timeout do
+        Logger.info("Teensy link silent, setting it up again at 115200 baud")
+        Circuits.UART.configure(state.serial_pid, speed: 115200)
+        link_setup(state.serial_pid, state.status)
+        %{state | stream_rate: sensors_rate(state.status)}
+      else
+        state
+      end
+    Process.send_after(self(), :link_watchdog, @link_timeout)
+    noreply(state)
+  end
+
+  def handle_info({:circuits_uart, "ttyAMA0", {:frame, frame}}, state) do
+    case frame do
+      # type 1: SENSORS - seq, acquisition timestamp, az and alt in millidegrees, flags, dropped
+      <<1, seq::little-16, t_mus::little-32, az::little-signed-32, alt::little-signed-32, flags, dropped::little-16>> ->
+        state = sensors_sequence(link_alive(state), seq, t_mus, dropped, (flags &&& 0x04) != 0)
+        noreply(apply(:"Elixir.Engine.#{state.status}", :sensors, [%{az: az / 1000, alt: alt / 1000}, state]))
+      _ -> Logger.info("Received unknown frame from UART")
+           noreply(state)
+    end
   end
 
   def handle_info({:circuits_uart, "ttyAMA0", msg}, state) do
-    case parse_uart(msg) do
+    {code, _} = parsed = parse_uart(msg)
+    state = if code in @link_messages, do: link_alive(state), else: state
+    case parsed do
       # applies the function corresponding to the message (sensors, calibration etc)
       # from the module corresponding to the status (idle, calibration, tracking etc)
       # TODO handle teensy messages like "Acc cal horizontal reading acquired"
-      {"SENSORS", payload}  -> {:noreply, apply(:"Elixir.Engine.#{state.status}", :sensors, [payload, state])}
-      {"JOYSTICK", payload} -> {:noreply, apply(:"Elixir.Engine.#{state.status}", :joystick, [payload, state])}
-      {"A_CAL", payload}    -> {:noreply, save_accel_calibration(payload, state)}
+      {"SENSORS", payload}  -> state = sensors_sequence(state, payload)
+                               noreply(apply(:"Elixir.Engine.#{state.status}", :sensors, [payload, state]))
+      {"JOYSTICK", payload} -> noreply(apply(:"Elixir.Engine.#{state.status}", :joystick, [payload, state]))
+      {"A_CAL", payload}    -> noreply(save_accel_calibration(payload, state))
+      {"A_CAL_FAILED", [position | _]} -> Logger.info("Teensy accelerometer calibration failed, #{position}: no reading")
+                                          noreply(send_to_gui(state, "a_calibration failed #{position}"))
+      {"TELEMETRY", mode}   -> Logger.info("Teensy telemetry #{Enum.join(mode, " ")}")
+                               noreply(state)
+      {"STREAM", _payload}  -> noreply(state)    # diagnostic streams, subscribed from the console
+      {"TSYNC", [t1 | _]}   -> noreply(tsync_reply(state, String.to_integer(String.trim(t1))))
+      {"BAUD", [baud]}      -> Circuits.UART.configure(state.serial_pid, speed: String.to_integer(String.trim(baud)))
+                               Logger.info("Teensy link at #{baud} baud")
+                               noreply(state)
       # {"M_CAL", ["points collected"]}    -> {:noreply, Engine.Calibration.m_calibrate(:third_step, state)}
-      {"M_CAL", ["points collected"]}    -> {:noreply, send_to_gui(%{state | status: :Idle, m_calibrated: true}, "m_calibration completed")}
+      {"M_CAL", ["points collected"]}    -> noreply(send_to_gui(%{state | status: :Idle, m_calibrated: true}, "m_calibration completed"))
       {"MOUNT_LEVEL", theta}    ->  Logger.debug("Received THETA #{theta}")
-                                    {:noreply, send_to_gui(state, "mount_level #{theta}")}
-      {"M_COMP", ["compensation map completed"]}    -> {:noreply, send_to_gui(%{state | status: :Idle, m_calibrated: true}, "m_compensation completed")}
+                                    noreply(send_to_gui(state, "mount_level #{theta}"))
+      {"M_COMP", ["compensation map completed"]}    -> noreply(send_to_gui(%{state | status: :Idle, m_calibrated: true}, "m_compensation completed"))
       _ -> Logger.info("Received unknown message from UART: .#{msg}.")
-           {:noreply, state}
+           noreply(state)
     end
   end
 
@@ -255,6 +328,17 @@ defmodule Engine do
     Engine.Config.get_config(key)
   end
 
+  @doc """
+  The clock the teensy synchronises to, microseconds
+  """
+  def pi_clock, do: System.monotonic_time(:microsecond)
+
+  @doc """
+  Age in seconds of the last SENSORS sample, 0 if the teensy clock is not synchronised yet
+  """
+  def sensors_lag(%{sensors: %{t_pi: nil}}), do: 0
+  def sensors_lag(%{sensors: %{t_pi: t_pi}}), do: (pi_clock() - t_pi) / 1_000_000
+
   def save_configuration(state, conf) do
     Engine.Config.save_config(conf)
     |> Steppers.configuration_change()
@@ -264,6 +348,66 @@ defmodule Engine do
 
   ############### Private functions
 
+  # keeps the sequence, timestamp and drop count of the SENSORS messages, logs the messages lost on the line
+  defp sensors_sequence(state, ["AZ", _az, "ALT", _alt, "SEQ", seq, "T", t_mus, "DROPPED", dropped | sync]) do
+    with {seq, _} <- Integer.parse(seq),
+         {t_mus, _} <- Integer.parse(t_mus),
+         {dropped, _} <- Integer.parse(dropped) do
+      sensors_sequence(state, seq, t_mus, dropped, match?(["SYNC", "1" <> _ | _], sync))
+    else
+      _ -> state
+    end
+  end
+
+  defp sensors_sequence(state, _payload), do: state   # teensy firmware without sequence numbers
+
+  defp sensors_sequence(%{sensors: sensors} = state, seq, t_mus, dropped, synced) do
+    lost =
+      case sensors.seq do
+        nil -> 0
+        previous -> rem(seq - previous - 1 + 65536, 65536)   # 16 bit, wraps
+      end
+    if lost > 0, do: Logger.info("Engine - #{lost} SENSORS messages lost before #{seq}")
+    t_pi = if synced, do: pi_time(t_mus), else: nil
+    %{state | sensors: %{seq: seq, t_mus: t_mus, t_pi: t_pi, lost: sensors.lost + lost, dropped: dropped}}
+  end
+
+  # the answer to the last tsync sent, its t4 goes with the next one
+  defp tsync_reply(%{tsync: %{t1: t1, t4: 0}} = state, t1), do: %{state | tsync: %{t1: t1, t4: pi_clock()}}
+  defp tsync_reply(state, _t1), do: state   # late or not requested
+
+  # full pi_clock of a recent time known by its 32 low bits
+  defp pi_time(t32) do
+    now = pi_clock()
+    now - ((now - t32) &&& 0xFFFFFFFF)
+  end
+
+  # accelerometer calibration, binary SENSORS frames (see Engine.Framing) and the baud switch, at 115200
+  defp link_setup(pid, status) do
+    upload_accel_calibration(pid)
+    Circuits.UART.write(pid, "telemetry binary #{sensors_rate(status)}")
+    Circuits.UART.write(pid, "baud #{@link_baud}")
+  end
+
+  defp link_alive(state), do: %{state | link_rx: System.monotonic_time(:millisecond)}
+
+  # every handle_cast and handle_info returns through here: the status may have been changed by any of them or by
+  # the status modules they dispatch to (a goto from the GUI, the end of a slew in the SENSORS handler...)
+  defp noreply(state), do: {:noreply, follow_status(state)}
+
+  # the SENSORS stream rate follows the status: fast while slewing, slow when idle
+  defp follow_status(state) do
+    case sensors_rate(state.status) do
+      rate when rate == state.stream_rate -> state
+      rate -> Circuits.UART.write(state.serial_pid, "stream altaz #{rate}")
+              %{state | stream_rate: rate}
+    end
+  end
+
+  defp sensors_rate(:Goto), do: 50
+  defp sensors_rate(:Idle), do: div(1000, @gui_interval)   # the GUI is not updated faster
+  defp sensors_rate(_status), do: @sensors_rate
+
   defp save_accel_calibration(calib, state) do
     [ox, gx, oz, gz] = calib
     Engine.Config.save_config(%{get_configuration(:all) | a_cal: %{OX: ox, GX: gx, OZ: oz, GZ: gz}})
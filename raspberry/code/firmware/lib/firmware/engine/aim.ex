@@ -53,22 +53,30 @@ defmodule Engine.Aim do
   #   returns a map with the data coming from the sensors in a usable format
   #   includes the ALT/AZ coordinates converted to Equatorial
   #   all data expressed in degrees
+  #   msg is either the SENSORS text line split in a list or the already decoded binary frame
+  defp sensors_message(%{az: f_az, alt: f_alt}, state) do
+    {:ok, sensors_coordinates(f_az, f_alt, state)}
+  end
+
   defp sensors_message(msg, state) do
     try do
-      ["AZ", az, "ALT", alt] = msg
+      ["AZ", az, "ALT", alt | _sequence] = msg    # SEQ, T, DROPPED: see Engine.sensors_sequence
       {f_az, _} = Float.parse(String.trim(az))
       {f_alt, _} = Float.parse(String.trim(alt))
-      # dovrebbe essere il solo punto dove aggiungere la correzione della magnetic declination
-      f_az = f_az + state.mag_dec  # NOTA: dovrebbe essere questo, provo a cambiare il segno per vedere se l'errore AZ diminuisce
-      # f_az = f_az - state.mag_dec
-      res = Astrex.az2eq(%{alt: f_alt, az: f_az}) |> Map.merge(%{alt: f_alt, az: f_az})
-      {:ok, res}
+      {:ok, sensors_coordinates(f_az, f_alt, state)}
     rescue
       _ -> Logger.error("Engine.Aim.sensors_message - Error parsing message")
            {:error, "error"}
     end
   end
 
+  defp sensors_coordinates(f_az, f_alt, state) do
+    # dovrebbe essere il solo punto dove aggiungere la correzione della magnetic declination
+    f_az = f_az + state.mag_dec  # NOTA: dovrebbe essere questo, provo a cambiare il segno per vedere se l'errore AZ diminuisce
+    # f_az = f_az - state.mag_dec
+    Astrex.az2eq(%{alt: f_alt, az: f_az}) |> Map.merge(%{alt: f_alt, az: f_az})
+  end
+
   defp add_target(mex, state) do
     if state.target.defined do
       %{alt: alt, az: az} = Astrex.eq2az(%{ra: state.target.ar, dec: state.target.dec})
@@ -0,0 +1,91 @@
+defmodule Engine.Framing do
+  @moduledoc """
+    Circuits.UART framing of the teensy link. Two kinds of messages share the line:
+    - text lines terminated by "\\n", delivered as strings like Circuits.UART.Framing.Line does
+    - binary telemetry frames: 0, COBS encoded payload and CRC-16/CCITT, 0.
+      Delivered as {:frame, payload} once the CRC is verified, dropped otherwise
+
+    The frame layout is described in the teensy sketch, telemetry.h
+    Outgoing commands are terminated by "\\n"
+  """
+  @behaviour Circuits.UART.Framing
+
+  require Logger
+  import Bitwise
+
+  defstruct buffer: <<>>
+
+  def init(_args), do: {:ok, %__MODULE__{}}
+
+  def add_framing(data, state), do: {:ok, [data, "\n"], state}
+
+  def remove_framing(data, state) do
+    {messages, rest} = split(state.buffer <> data, [])
+    rc = if rest == <<>>, do: :ok, else: :in_frame
+    {rc, messages, %{state | buffer: rest}}
+  end
+
+  def frame_timeout(state) do
+    {:ok, [], %{state | buffer: <<>>}}
+  end
+
+  def flush(:transmit, state), do: state
+  def flush(_direction, state), do: %{state | buffer: <<>>}
+
+  def buffer_empty?(state), do: state.buffer == <<>>
+
+  ############### Private functions
+
+  # returns the complete messages and the incomplete tail
+  defp split(<<>>, acc), do: {Enum.reverse(acc), <<>>}
+
+  defp split(<<0, rest::binary>> = data, acc) do
+    case :binary.split(rest, <<0>>) do
+      [<<>>, _tail] -> split(rest, acc)     # end delimiter of a frame lost: this 0 starts the next one
+      [frame, tail] -> split(tail, add_frame(frame, acc))
+      [_partial] -> {Enum.reverse(acc), data}
+    end
+  end
+
+  defp split(data, acc) do
+    case :binary.split(data, "\n") do
+      [line, tail] -> split(tail, [line | acc])
+      [_partial] -> {Enum.reverse(acc), data}
+    end
+  end
+
+  defp add_frame(frame, acc) do
+    with {:ok, decoded} <- cobs_decode(frame, []),
+         size when size > 2 <- byte_size(decoded) - 2,
+         <<payload::binary-size(size), crc::little-16>> <- decoded,
+         true <- crc16(payload) == crc do
+      [{:frame, payload} | acc]
+    else
+      _ -> Logger.debug("Engine.Framing - corrupted frame dropped")
+           acc
+    end
+  end
+
+  defp cobs_decode(<<>>, acc), do: {:ok, acc |> Enum.reverse() |> IO.iodata_to_binary()}
+
+  defp cobs_decode(<<code, rest::binary>>, acc) when code > 0 and byte_size(rest) >= code - 1 do
+    <<block::binary-size(code - 1), tail::binary>> = rest
+    acc = if code < 0xFF and tail != <<>>, do: [<<0>>, block | acc], else: [block | acc]
+    cobs_decode(tail, acc)
+  end
+
+  defp cobs_decode(_data, _acc), do: :error
+
+  # CRC-16/CCITT-FALSE
+  defp crc16(data), do: crc16(data, 0xFFFF)
+
+  defp crc16(<<>>, crc), do: crc
+
+  defp crc16(<<byte, rest::binary>>, crc) do
+    crc =
+      Enum.reduce(1..8, bxor(crc, byte <<< 8), fn _, c ->
+        if (c &&& 0x8000) != 0, do: bxor(c <<< 1, 0x1021) &&& 0xFFFF, else: (c <<< 1) &&& 0xFFFF
+      end)
+    crc16(rest, crc)
+  end
+end
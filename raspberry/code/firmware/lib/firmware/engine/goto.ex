@@ -20,6 +20,7 @@ defmodule Engine.Goto do
   @slewX12  3     # 3 gradi/sec
 
   @tt       0.5   # tracking_thresh
+  @command_latency 0.02   # seconds, estimated, from the sensors message to the motors following a new speed
 
   @doc """
     handles message from gui.
@@ -83,17 +84,18 @@ defmodule Engine.Goto do
   @doc """
   response to sensors event in goto mode
   - updates the state and updates the GUI via aim_change
+  - extrapolates the position, at the current slew speeds, to the time the new speeds take effect:
+    the sample is Engine.sensors_lag old and the command needs @command_latency
   - if distance to object below threshold, changes status to :Tracking
   - returns the new state
   """
   def sensors(payload, state) do
     state = Engine.Aim.aim_change(payload, state)
-    {da, dz} = delta_altaz(state)
+    {da, dz} = delta_altaz(state) |> extrapolate(state)
     if abs(da) < @tt and abs(dz) < @tt do
-      %{state | status: :Tracking}
+      %{state | status: :Tracking, slew: %{speed_alt: 0, speed_az: 0}}
     else
-      go(%{da: da, dz: dz, lat: state.site_lat}, state.serial_pid)
-      state
+      %{state | slew: go(%{da: da, dz: dz, lat: state.site_lat}, state.serial_pid)}
     end
   end
 
@@ -102,14 +104,14 @@ defmodule Engine.Goto do
     ra = obj[:ar] |> Astrex.Common.hms2hours |> Astrex.Common.hours2deg
     dec = obj[:decl] |> Astrex.Common.dms2deg
     target = %{defined: true, label: label, ar: ra, dec: dec}
-    %{state | target: target}
+    %{state | target: target, slew: %{speed_alt: 0, speed_az: 0}}   # a new goto starts from still motors
   end
 
   def goto_planet(planet, state) do
     # where_is returns ra in hours, dec in degrees
     coords = Astrex.where_is(String.to_atom(planet))
     target = %{defined: true, label: String.to_atom(planet), ar: coords.ra |> Astrex.Common.hours2deg, dec: coords.dec}
-    %{state | target: target}
+    %{state | target: target, slew: %{speed_alt: 0, speed_az: 0}}   # a new goto starts from still motors
   end
 
   # returns the AZ and ALT gaps that needs to be filled to reach the target
@@ -120,12 +122,19 @@ defmodule Engine.Goto do
     {gt_alt - state.aim.pos_alt, gt_az - state.aim.pos_az}
   end
 
+  # the gaps left when the speeds being sent take effect
+  defp extrapolate({da, dz}, state) do
+    lag = Engine.sensors_lag(state) + @command_latency
+    {da - state.slew.speed_alt * lag, dz - state.slew.speed_az * lag}
+  end
+
   # riceve le coordinate ALT/AZ a cui il telescopio sta puntando ORA
   # La mappa ricevuta contiene anche la key rot: con l'angolo di rotazione
+  # returns the speeds sent to the motors
   defp go(deltas, pid) do
-    deltas
-    |> speeds
-    |> Engine.Motors.move_motors(pid)
+    motors = speeds(deltas)
+    Engine.Motors.move_motors(motors, pid)
+    motors
   end
 
   defp speeds(deltas) do